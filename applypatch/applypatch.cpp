@@ -22,11 +22,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <string>
@@ -45,9 +47,41 @@
 
 static int LoadPartitionContents(const std::string& filename, FileContents* file);
 static size_t FileSink(const unsigned char* data, size_t len, int fd);
-static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
-                          const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data);
+static int GenerateTarget(const MappedFileContents& source_file,
+                          const std::unique_ptr<Value>& patch, const std::string& target_filename,
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data,
+                          bool backup_source);
+
+// The sources are hashed in windows of this size, so that hashing a partition needs a bounded
+// amount of memory regardless of the partition size.
+static constexpr size_t kHashWindowSize = 1024 * 1024;
+
+// Callback that receives each window of the data being hashed.
+using WindowFn = std::function<void(const unsigned char*, size_t)>;
+
+// Reads up to 'size' bytes from 'fd' in windows of kHashWindowSize, adds them to the SHA-1 context,
+// and passes each window to the optional 'window_fn'. Returns the number of bytes read, which falls
+// short of 'size' only on read errors or EOF.
+static size_t HashWindows(int fd, size_t size, SHA_CTX* ctx, const WindowFn& window_fn) {
+  std::vector<unsigned char> window(std::min(size, kHashWindowSize));
+  size_t done = 0;
+  while (done < size) {
+    size_t to_read = std::min(size - done, window.size());
+    ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, window.data(), to_read));
+    if (read_count == -1) {
+      printf("read error at %zu: %s\n", done, strerror(errno));
+      break;
+    } else if (read_count == 0) {
+      break;
+    }
+    SHA1_Update(ctx, window.data(), read_count);
+    if (window_fn) {
+      window_fn(window.data(), read_count);
+    }
+    done += read_count;
+  }
+  return done;
+}
 
 // Read a file into memory; store the file contents and associated metadata in *file.
 // Return 0 on success.
@@ -80,12 +114,15 @@ int LoadFileContents(const char* filename, FileContents* file) {
   return 0;
 }
 
-// Load the contents of an EMMC partition into the provided
-// FileContents.  filename should be a string of the form
-// "EMMC:<partition_device>:...".  The smallest size_n bytes for
-// which that prefix of the partition contents has the corresponding
-// sha1 hash will be loaded.  It is acceptable for a size value to be
-// repeated with different sha1s.  Will return 0 on success.
+// Find the prefix of an EMMC partition whose contents match one of
+// the (size, sha1) pairs in filename, which should be a string of
+// the form "EMMC:<partition_device>:...".  The smallest size_n bytes
+// for which that prefix of the partition contents has the
+// corresponding sha1 hash will be matched.  It is acceptable for a
+// size value to be repeated with different sha1s.  The partition is
+// read through a fixed-size window, each of which is also passed to
+// the optional window_fn.  On success, stores the opened partition in
+// *fd, and the matched size and hash in *size and sha1; returns 0.
 //
 // This complexity is needed because if an OTA installation is
 // interrupted, the partition might contain either the source or the
@@ -94,7 +131,8 @@ int LoadFileContents(const char* filename, FileContents* file) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
-static int LoadPartitionContents(const std::string& filename, FileContents* file) {
+static int FindPartitionContents(const std::string& filename, unique_fd* fd, size_t* size,
+                                 uint8_t sha1[SHA_DIGEST_LENGTH], const WindowFn& window_fn) {
   std::vector<std::string> pieces = android::base::Split(filename, ":");
   if (pieces.size() < 4 || pieces.size() % 2 != 0 || pieces[0] != "EMMC") {
     printf("LoadPartitionContents called with bad filename \"%s\"\n", filename.c_str());
@@ -116,8 +154,8 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   std::sort(pairs.begin(), pairs.end());
 
   const char* partition = pieces[1].c_str();
-  unique_file dev(ota_fopen(partition, "rb"));
-  if (!dev) {
+  unique_fd dev(ota_open(partition, O_RDONLY));
+  if (dev == -1) {
     printf("failed to open emmc partition \"%s\": %s\n", partition, strerror(errno));
     return -1;
   }
@@ -125,9 +163,6 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   SHA_CTX sha_ctx;
   SHA1_Init(&sha_ctx);
 
-  // Allocate enough memory to hold the largest size.
-  std::vector<unsigned char> buffer(pairs[pair_count - 1].first);
-  unsigned char* buffer_ptr = buffer.data();
   size_t buffer_size = 0;  // # bytes read so far
   bool found = false;
 
@@ -139,14 +174,12 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     // we're trying the possibilities in order of increasing size).
     size_t next = current_size - buffer_size;
     if (next > 0) {
-      size_t read = ota_fread(buffer_ptr, 1, next, dev.get());
+      size_t read = HashWindows(dev, next, &sha_ctx, window_fn);
       if (next != read) {
         printf("short read (%zu bytes of %zu) for partition \"%s\"\n", read, next, partition);
         return -1;
       }
-      SHA1_Update(&sha_ctx, buffer_ptr, read);
       buffer_size += read;
-      buffer_ptr += read;
     }
 
     // Duplicate the SHA context and finalize the duplicate so we can
@@ -176,27 +209,106 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     return -1;
   }
 
-  SHA1_Final(file->sha1, &sha_ctx);
+  SHA1_Final(sha1, &sha_ctx);
+  *fd = std::move(dev);
+  *size = buffer_size;
+  return 0;
+}
 
-  buffer.resize(buffer_size);
+// Load the contents of an EMMC partition into the provided
+// FileContents, which should be of the form described for
+// FindPartitionContents() above.  Will return 0 on success.
+static int LoadPartitionContents(const std::string& filename, FileContents* file) {
+  std::vector<unsigned char> buffer;
+  auto append = [&buffer](const unsigned char* data, size_t len) {
+    buffer.insert(buffer.end(), data, data + len);
+  };
+  unique_fd fd;
+  size_t size;
+  if (FindPartitionContents(filename, &fd, &size, file->sha1, append) != 0) {
+    return -1;
+  }
   file->data = std::move(buffer);
+  return 0;
+}
+
+MappedFileContents::~MappedFileContents() {
+  Unmap();
+}
+
+void MappedFileContents::Unmap() {
+  if (data != nullptr && munmap(const_cast<unsigned char*>(data), size) == -1) {
+    printf("failed to munmap %zu bytes: %s\n", size, strerror(errno));
+  }
+  data = nullptr;
+  size = 0;
+}
+
+// Map a file or an EMMC partition read-only; store the mapping and
+// the hash of the mapped contents in *file.  Unlike
+// LoadFileContents(), the contents aren't copied into memory: they
+// are hashed through a fixed-size window and then left in the page
+// cache, so that a large partition can be patched without holding it
+// on the heap.  Return 0 on success.
+int MapFileContents(const char* filename, MappedFileContents* file) {
+  file->Unmap();
+
+  unique_fd fd;
+  size_t size;
+  if (strncmp(filename, "EMMC:", 5) == 0) {
+    if (FindPartitionContents(filename, &fd, &size, file->sha1, nullptr) != 0) {
+      return -1;
+    }
+  } else {
+    struct stat sb;
+    if (stat(filename, &sb) == -1) {
+      printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+      return -1;
+    }
+    size = sb.st_size;
 
+    fd.reset(ota_open(filename, O_RDONLY));
+    if (fd == -1) {
+      printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+      return -1;
+    }
+
+    SHA_CTX sha_ctx;
+    SHA1_Init(&sha_ctx);
+    size_t bytes_read = HashWindows(fd, size, &sha_ctx, nullptr);
+    if (bytes_read != size) {
+      printf("short read of \"%s\" (%zu bytes of %zu)\n", filename, bytes_read, size);
+      return -1;
+    }
+    SHA1_Final(file->sha1, &sha_ctx);
+  }
+
+  // mmap() rejects empty mappings; an empty file is left with no data.
+  if (size == 0) {
+    return 0;
+  }
+  void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    printf("failed to mmap %zu bytes of \"%s\": %s\n", size, filename, strerror(errno));
+    return -1;
+  }
+  file->data = static_cast<const unsigned char*>(addr);
+  file->size = size;
   return 0;
 }
 
-// Save the contents of the given FileContents object under the given
-// filename.  Return 0 on success.
-int SaveFileContents(const char* filename, const FileContents* file) {
+// Save the given data under the given filename.  Return 0 on success.
+static int SaveContents(const char* filename, const unsigned char* data, size_t len) {
   unique_fd fd(ota_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRUSR | S_IWUSR));
   if (fd == -1) {
     printf("failed to open \"%s\" for write: %s\n", filename, strerror(errno));
     return -1;
   }
 
-  size_t bytes_written = FileSink(file->data.data(), file->data.size(), fd);
-  if (bytes_written != file->data.size()) {
-    printf("short write of \"%s\" (%zd bytes of %zu): %s\n", filename, bytes_written,
-           file->data.size(), strerror(errno));
+  size_t bytes_written = FileSink(data, len, fd);
+  if (bytes_written != len) {
+    printf("short write of \"%s\" (%zd bytes of %zu): %s\n", filename, bytes_written, len,
+           strerror(errno));
     return -1;
   }
   if (ota_fsync(fd) != 0) {
@@ -211,6 +323,12 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Save the contents of the given FileContents object under the given
+// filename.  Return 0 on success.
+int SaveFileContents(const char* filename, const FileContents* file) {
+  return SaveContents(filename, file->data.data(), file->data.size());
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
@@ -390,20 +508,20 @@ static int FindMatchingPatch(uint8_t* sha1, const std::vector<std::string>& patc
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
 int applypatch_check(const char* filename, const std::vector<std::string>& patch_sha1_str) {
-  FileContents file;
+  MappedFileContents file;
 
   // It's okay to specify no sha1s; the check will pass if the
-  // LoadFileContents is successful.  (Useful for reading
+  // MapFileContents is successful.  (Useful for reading
   // partitions, where the filename encodes the sha1s; no need to
   // check them twice.)
-  if (LoadFileContents(filename, &file) != 0 ||
+  if (MapFileContents(filename, &file) != 0 ||
       (!patch_sha1_str.empty() && FindMatchingPatch(file.sha1, patch_sha1_str) < 0)) {
     printf("file \"%s\" doesn't have any of expected sha1 sums; checking cache\n", filename);
 
     // If the source file is missing or corrupted, it might be because we were killed in the middle
     // of patching it.  A copy of it should have been made in cache_temp_source.  If that file
     // exists and matches the sha1 we're looking for, the check still passes.
-    if (LoadFileContents(CacheLocation::location().cache_temp_source().c_str(), &file) != 0) {
+    if (MapFileContents(CacheLocation::location().cache_temp_source().c_str(), &file) != 0) {
       printf("failed to load cache file\n");
       return 1;
     }
@@ -496,8 +614,9 @@ int applypatch(const char* source_filename, const char* target_filename,
   }
 
   // We try to load the target file into the source_file object.
-  FileContents source_file;
-  if (LoadFileContents(target_filename, &source_file) == 0) {
+  MappedFileContents source_file;
+  bool source_loaded = MapFileContents(target_filename, &source_file) == 0;
+  if (source_loaded) {
     if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
       // The early-exit case: the patch was already applied, this file has the desired hash, nothing
       // for us to do.
@@ -506,26 +625,25 @@ int applypatch(const char* source_filename, const char* target_filename,
     }
   }
 
-  if (source_file.data.empty() ||
+  if (!source_loaded || source_file.size == 0 ||
       (target_filename != source_filename && strcmp(target_filename, source_filename) != 0)) {
     // Need to load the source file: either we failed to load the target file, or we did but it's
     // different from the expected.
-    source_file.data.clear();
-    LoadFileContents(source_filename, &source_file);
+    source_loaded = MapFileContents(source_filename, &source_file) == 0;
   }
 
-  if (!source_file.data.empty()) {
+  if (source_loaded && source_file.size != 0) {
     int to_use = FindMatchingPatch(source_file.sha1, patch_sha1_str);
     if (to_use != -1) {
       return GenerateTarget(source_file, patch_data[to_use], target_filename, target_sha1,
-                            bonus_data);
+                            bonus_data, true);
     }
   }
 
   printf("source file is bad; trying copy\n");
 
-  FileContents copy_file;
-  if (LoadFileContents(CacheLocation::location().cache_temp_source().c_str(), &copy_file) < 0) {
+  MappedFileContents copy_file;
+  if (MapFileContents(CacheLocation::location().cache_temp_source().c_str(), &copy_file) < 0) {
     printf("failed to read copy file\n");
     return 1;
   }
@@ -536,7 +654,9 @@ int applypatch(const char* source_filename, const char* target_filename,
     return 1;
   }
 
-  return GenerateTarget(copy_file, patch_data[to_use], target_filename, target_sha1, bonus_data);
+  // The copy is mapped from the backup file itself, which must not be rewritten from the mapping.
+  return GenerateTarget(copy_file, patch_data[to_use], target_filename, target_sha1, bonus_data,
+                        false);
 }
 
 /*
@@ -567,8 +687,8 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   pieces.push_back(std::to_string(target_size));
   pieces.push_back(target_sha1_str);
   std::string fullname = android::base::Join(pieces, ':');
-  FileContents source_file;
-  if (LoadPartitionContents(fullname, &source_file) == 0 &&
+  MappedFileContents source_file;
+  if (MapFileContents(fullname.c_str(), &source_file) == 0 &&
       memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
     // The early-exit case: the image was already applied, this partition
     // has the desired hash, nothing for us to do.
@@ -576,26 +696,35 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
     return 0;
   }
 
-  if (LoadFileContents(source_filename, &source_file) == 0) {
-    if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
-      // The source doesn't have desired checksum.
-      printf("source \"%s\" doesn't have expected sha1 sum\n", source_filename);
-      printf("expected: %s, found: %s\n", short_sha1(target_sha1).c_str(),
-             short_sha1(source_file.sha1).c_str());
-      return 1;
-    }
+  if (MapFileContents(source_filename, &source_file) != 0) {
+    printf("failed to load source \"%s\"\n", source_filename);
+    return 1;
+  }
+  if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+    // The source doesn't have desired checksum.
+    printf("source \"%s\" doesn't have expected sha1 sum\n", source_filename);
+    printf("expected: %s, found: %s\n", short_sha1(target_sha1).c_str(),
+           short_sha1(source_file.sha1).c_str());
+    return 1;
+  }
+  if (source_file.size < target_size) {
+    printf("source \"%s\" is shorter than %zu bytes\n", source_filename, target_size);
+    return 1;
   }
 
-  if (WriteToPartition(source_file.data.data(), target_size, target_filename) != 0) {
+  if (WriteToPartition(source_file.data, target_size, target_filename) != 0) {
     printf("write of copied data to %s failed\n", target_filename);
     return 1;
   }
   return 0;
 }
 
-static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
-                          const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data) {
+// Applies |patch| to |source_file| and writes the result to |target_filename|. The source is first
+// backed up to /cache if |backup_source| is true, so that an interrupted write can be resumed.
+static int GenerateTarget(const MappedFileContents& source_file,
+                          const std::unique_ptr<Value>& patch, const std::string& target_filename,
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data,
+                          bool backup_source) {
   if (patch->type != VAL_BLOB) {
     printf("patch is not a blob\n");
     return 1;
@@ -616,13 +745,16 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
   CHECK(android::base::StartsWith(target_filename, "EMMC:"));
 
   // We still write the original source to cache, in case the partition write is interrupted.
-  if (MakeFreeSpaceOnCache(source_file.data.size()) < 0) {
-    printf("not enough free space on /cache\n");
-    return 1;
-  }
-  if (SaveFileContents(CacheLocation::location().cache_temp_source().c_str(), &source_file) < 0) {
-    printf("failed to back up source file\n");
-    return 1;
+  if (backup_source) {
+    if (MakeFreeSpaceOnCache(source_file.size) < 0) {
+      printf("not enough free space on /cache\n");
+      return 1;
+    }
+    if (SaveContents(CacheLocation::location().cache_temp_source().c_str(), source_file.data,
+                     source_file.size) < 0) {
+      printf("failed to back up source file\n");
+      return 1;
+    }
   }
 
   // We store the decoded output in memory.
@@ -637,10 +769,9 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
 
   int result;
   if (use_bsdiff) {
-    result =
-        ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
+    result = ApplyBSDiffPatch(source_file.data, source_file.size, patch->data, 0, sink, &ctx);
   } else {
-    result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink, &ctx,
+    result = ApplyImagePatch(source_file.data, source_file.size, patch->data, sink, &ctx,
                              bonus_data);
   }
 
@@ -142,18 +142,29 @@
 
 #include "applypatch/imgdiff.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <android-base/file.h>
@@ -164,10 +175,14 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
+#include <divsufsort.h>
+#include <divsufsort64.h>
+#include <openssl/sha.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
 #include "applypatch/imgdiff_image.h"
+#include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
 
 using android::base::get_unaligned;
@@ -180,6 +195,10 @@ static_assert(VERSION <= 9, "VERSION occupies more than one byte");
 static constexpr size_t BLOCK_SIZE = 4096;
 static constexpr size_t BUFFER_SIZE = 0x8000;
 
+// The most uncompressed data that the threads reconstructing the deflate chunks may hold at once.
+// A single chunk larger than that is still reconstructed, on its own.
+static constexpr size_t MAX_INFLATED_BYTES_IN_FLIGHT = 256 * 1024 * 1024;
+
 // If we use this function to write the offset and length (type size_t), their values should not
 // exceed 2^63; because the signed bit will be casted away.
 static inline bool Write8(int fd, int64_t value) {
@@ -245,23 +264,408 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// The number of threads to generate the patches on, as given by --threads. 0 means one thread per
+// online CPU.
+static size_t num_threads = 0;
+
+static size_t GetNumThreads() {
+  if (num_threads != 0) {
+    return num_threads;
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
+
+// Calls |fn| for each index in [0, count) on up to |threads| threads, which take the indices in
+// order. Returns true if all the calls succeed; after a failure, the indices not yet taken are
+// skipped.
+static bool ParallelFor(size_t count, size_t threads, const std::function<bool(size_t)>& fn) {
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    while (!failed) {
+      size_t i = next++;
+      if (i >= count) {
+        return;
+      }
+      if (!fn(i)) {
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(count, threads); i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : workers) {
+    t.join();
+  }
+  return !failed;
+}
+
+// The directory of the suffix arrays kept across runs, as given by --sa-cache-dir. Empty means
+// bsdiff builds its own suffix arrays in memory on every run.
+static std::string sa_cache_dir;
+
+// The most space the suffix arrays may take in |sa_cache_dir|, as given by --sa-cache-size. The
+// least recently used ones are removed beyond it.
+static constexpr size_t SA_CACHE_DEFAULT_SIZE_MB = 8192;
+static size_t sa_cache_size_mb = SA_CACHE_DEFAULT_SIZE_MB;
+
+// Header of a suffix array file in |sa_cache_dir|, followed by the (n + 1) array entries.
+struct SuffixArrayFileHeader {
+  char magic[8];
+  uint32_t index_size;  // sizeof() of each array entry
+  uint32_t reserved;
+  uint64_t text_size;
+};
+
+static constexpr char SA_FILE_MAGIC[8] = { 'I', 'M', 'G', 'D', 'S', 'A', '0', '1' };
+
+static int DivSufSort(const uint8_t* text, saidx_t* sa, size_t n) {
+  return divsufsort(text, sa, n);
+}
+
+static int DivSufSort(const uint8_t* text, saidx64_t* sa, size_t n) {
+  return divsufsort64(text, sa, n);
+}
+
+// A suffix array index over |text| for bsdiff, whose array is mmap'ed from |sa_cache_dir|. It's
+// searched the same way as bsdiff's own index, and is read-only so the patch workers can share it.
+template <typename SAIDX>
+class MappedSuffixArrayIndex : public bsdiff::SuffixArrayIndexInterface {
+ public:
+  MappedSuffixArrayIndex(const uint8_t* text, size_t n, void* map, size_t map_size)
+      : text_(text),
+        n_(n),
+        sa_(reinterpret_cast<const SAIDX*>(static_cast<const uint8_t*>(map) +
+                                           sizeof(SuffixArrayFileHeader))),
+        map_(map),
+        map_size_(map_size) {}
+
+  ~MappedSuffixArrayIndex() override {
+    munmap(map_, map_size_);
+  }
+
+  void SearchPrefix(const uint8_t* target, size_t length, size_t* out_length,
+                    uint64_t* out_pos) const override {
+    // Binary search for the adjacent suffixes that |target| sorts between; the longest match is a
+    // prefix of one of them. sa_[0] is the empty suffix, which sorts first. Like bsdiff, only the
+    // common length is compared, so a suffix that is a prefix of |target| goes to the right; any
+    // other order may pick a different one of equally long matches, and change the patch.
+    size_t left = 0;
+    size_t right = n_;
+    while (right - left >= 2) {
+      size_t mid = left + (right - left) / 2;
+      if (memcmp(text_ + sa_[mid], target, std::min<size_t>(n_ - sa_[mid], length)) < 0) {
+        left = mid;
+      } else {
+        right = mid;
+      }
+    }
+
+    size_t left_length = MatchLength(sa_[left], target, length);
+    size_t right_length = MatchLength(sa_[right], target, length);
+    if (left_length > right_length) {
+      *out_length = left_length;
+      *out_pos = sa_[left];
+    } else {
+      *out_length = right_length;
+      *out_pos = sa_[right];
+    }
+  }
+
+ private:
+  size_t MatchLength(SAIDX pos, const uint8_t* target, size_t length) const {
+    size_t limit = std::min(n_ - pos, length);
+    return std::mismatch(text_ + pos, text_ + pos + limit, target).first - (text_ + pos);
+  }
+
+  const uint8_t* text_;
+  size_t n_;
+  const SAIDX* sa_;
+  void* map_;
+  size_t map_size_;
+};
+
+// Maps the suffix array of |text| from |path|. Returns nullptr if the file is missing or doesn't
+// match the text.
+template <typename SAIDX>
+static bsdiff::SuffixArrayIndexInterface* MapSuffixArray(const uint8_t* text, size_t n,
+                                                         const std::string& path) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY));
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return nullptr;
+  }
+  size_t map_size = sizeof(SuffixArrayFileHeader) + (n + 1) * sizeof(SAIDX);
+  if (static_cast<size_t>(st.st_size) != map_size) {
+    LOG(WARNING) << "Ignoring " << path << " of " << st.st_size << " bytes, expecting " << map_size;
+    return nullptr;
+  }
+
+  void* map = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to mmap " << path;
+    return nullptr;
+  }
+  const auto* header = static_cast<const SuffixArrayFileHeader*>(map);
+  if (memcmp(header->magic, SA_FILE_MAGIC, sizeof(SA_FILE_MAGIC)) != 0 ||
+      header->index_size != sizeof(SAIDX) || header->text_size != n) {
+    LOG(WARNING) << "Ignoring " << path << " with a mismatching header";
+    munmap(map, map_size);
+    return nullptr;
+  }
+  return new MappedSuffixArrayIndex<SAIDX>(text, n, map, map_size);
+}
+
+// Builds the suffix array of |text| and writes it to |path|. The file is written under a temporary
+// name and then renamed, so that concurrent runs never map a partial file.
+template <typename SAIDX>
+static bool WriteSuffixArray(const uint8_t* text, size_t n, const std::string& path) {
+  std::vector<SAIDX> sa(n + 1);
+  sa[0] = n;
+  if (n > 0 && DivSufSort(text, sa.data() + 1, n) != 0) {
+    LOG(ERROR) << "Failed to build the suffix array of " << n << " bytes";
+    return false;
+  }
+
+  SuffixArrayFileHeader header = {};
+  memcpy(header.magic, SA_FILE_MAGIC, sizeof(SA_FILE_MAGIC));
+  header.index_size = sizeof(SAIDX);
+  header.text_size = n;
+
+  std::string temp_path = path + ".XXXXXX";
+  android::base::unique_fd fd(mkstemp(&temp_path[0]));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create " << temp_path;
+    return false;
+  }
+  if (!android::base::WriteFully(fd, &header, sizeof(header)) ||
+      !android::base::WriteFully(fd, sa.data(), sa.size() * sizeof(SAIDX))) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Removes the least recently used suffix arrays from |sa_cache_dir| until they fit in
+// |sa_cache_size_mb|, except for |keep|. A file that another run has mapped stays valid.
+static void TrimSuffixArrayCache(const std::string& keep) {
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(sa_cache_dir.c_str()), closedir);
+  if (!dir) {
+    PLOG(WARNING) << "Failed to open " << sa_cache_dir;
+    return;
+  }
+  struct CachedFile {
+    std::string path;
+    struct timespec mtime;
+    uint64_t size;
+  };
+  std::vector<CachedFile> files;
+  uint64_t total_size = 0;
+  dirent* de;
+  while ((de = readdir(dir.get())) != nullptr) {
+    std::string path = sa_cache_dir + "/" + de->d_name;
+    struct stat st;
+    if (!android::base::EndsWith(de->d_name, ".sa") || stat(path.c_str(), &st) != 0) {
+      continue;
+    }
+    total_size += st.st_size;
+    if (path != keep) {
+      files.push_back({ path, st.st_mtim, static_cast<uint64_t>(st.st_size) });
+    }
+  }
+
+  std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) {
+    return std::tie(a.mtime.tv_sec, a.mtime.tv_nsec) < std::tie(b.mtime.tv_sec, b.mtime.tv_nsec);
+  });
+  uint64_t limit = static_cast<uint64_t>(sa_cache_size_mb) * 1024 * 1024;
+  for (const auto& file : files) {
+    if (total_size <= limit) {
+      break;
+    }
+    if (unlink(file.path.c_str()) == 0) {
+      LOG(INFO) << "Removed " << file.path << " of " << file.size << " bytes from the cache";
+      total_size -= file.size;
+    }
+  }
+}
+
+template <typename SAIDX>
+static bsdiff::SuffixArrayIndexInterface* GetCachedSuffixArray(const uint8_t* text, size_t n,
+                                                               const std::string& path) {
+  bsdiff::SuffixArrayIndexInterface* index = MapSuffixArray<SAIDX>(text, n, path);
+  if (index != nullptr) {
+    LOG(INFO) << "Loaded the suffix array of " << n << " bytes from " << path;
+    // Mark the file as recently used.
+    if (utimensat(AT_FDCWD, path.c_str(), nullptr, 0) != 0) {
+      PLOG(WARNING) << "Failed to touch " << path;
+    }
+    return index;
+  }
+  if (!WriteSuffixArray<SAIDX>(text, n, path)) {
+    return nullptr;
+  }
+  TrimSuffixArrayCache(path);
+  return MapSuffixArray<SAIDX>(text, n, path);
+}
+
+// Returns the suffix array index of |text| from |sa_cache_dir|, building and storing it first if
+// it's not there. The files are named after the SHA-256 of the text, so later runs against the
+// same source reuse them. Returns nullptr if the cache is disabled or fails; bsdiff then builds its
+// own index. The caller owns the result.
+static bsdiff::SuffixArrayIndexInterface* GetCachedSuffixArrayIndex(const uint8_t* text,
+                                                                    size_t n) {
+  if (sa_cache_dir.empty()) {
+    return nullptr;
+  }
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(text, n, digest);
+  std::string path = sa_cache_dir + "/" + print_hex(digest, SHA256_DIGEST_LENGTH) + ".sa";
+
+  // Use 32-bit entries when they suffice, as bsdiff does.
+  if (n < static_cast<size_t>(std::numeric_limits<saidx_t>::max())) {
+    return GetCachedSuffixArray<saidx_t>(text, n, path);
+  }
+  return GetCachedSuffixArray<saidx64_t>(text, n, path);
+}
+
+// The file of the deflate encoder parameters kept across runs, as given by --deflate-cache. Empty
+// means the reconstruction of every deflate chunk is probed on every run.
+static std::string deflate_cache_file;
+
+// The first line of |deflate_cache_file|. The level that reproduces a chunk depends on the zlib
+// version and the other encoder parameters, so a cache written with different ones is ignored.
+static std::string DeflateCacheHeader() {
+  return android::base::StringPrintf("imgdiff-deflate-cache zlib-%s %d %d %d %d", zlibVersion(),
+                                     ImageChunk::METHOD, ImageChunk::WINDOWBITS,
+                                     ImageChunk::MEMLEVEL, ImageChunk::STRATEGY);
+}
+
+// Loads the compression levels from |deflate_cache_file|, one "<key> <level>" line per deflate
+// chunk. A level of 0 means the chunk can't be reconstructed.
+static std::map<std::string, int> LoadDeflateCache() {
+  std::map<std::string, int> cache;
+  std::string content;
+  if (!android::base::ReadFileToString(deflate_cache_file, &content)) {
+    return cache;
+  }
+  std::vector<std::string> lines = android::base::Split(content, "\n");
+  if (lines[0] != DeflateCacheHeader()) {
+    LOG(WARNING) << "Ignoring " << deflate_cache_file << " with a mismatching header";
+    return cache;
+  }
+  for (size_t i = 1; i < lines.size(); i++) {
+    std::vector<std::string> pieces = android::base::Split(lines[i], " ");
+    int level;
+    if (pieces.size() == 2 && android::base::ParseInt(pieces[1], &level, 0, 9)) {
+      cache[pieces[0]] = level;
+    }
+  }
+  LOG(INFO) << "Loaded " << cache.size() << " deflate parameters from " << deflate_cache_file;
+  return cache;
+}
+
+// Writes |cache| to |deflate_cache_file|. The file is written under a temporary name and then
+// renamed, so that concurrent runs never read a partial file.
+static bool SaveDeflateCache(const std::map<std::string, int>& cache) {
+  std::string content = DeflateCacheHeader() + "\n";
+  for (const auto& entry : cache) {
+    content += entry.first + " " + std::to_string(entry.second) + "\n";
+  }
+
+  std::string temp_path = deflate_cache_file + ".XXXXXX";
+  android::base::unique_fd fd(mkstemp(&temp_path[0]));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to create " << temp_path;
+    return false;
+  }
+  if (!android::base::WriteStringToFd(content, fd)) {
+    PLOG(ERROR) << "Failed to write " << temp_path;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (rename(temp_path.c_str(), deflate_cache_file.c_str()) != 0) {
+    PLOG(ERROR) << "Failed to rename " << temp_path << " to " << deflate_cache_file;
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "threads", required_argument, nullptr, 0 },
+  { "sa-cache-dir", required_argument, nullptr, 0 },
+  { "sa-cache-size", required_argument, nullptr, 0 },
+  { "deflate-cache", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
 
-ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
+FileContent::FileContent(std::vector<uint8_t> data) {
+  auto buffer = std::make_shared<std::vector<uint8_t>>(std::move(data));
+  data_ = buffer->data();
+  size_ = buffer->size();
+  storage_ = std::move(buffer);
+}
+
+bool FileContent::Map(const std::string& filename) {
+  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
+  if (fd == -1) {
+    PLOG(ERROR) << "Failed to open " << filename;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    PLOG(ERROR) << "Failed to stat " << filename;
+    return false;
+  }
+
+  size_t sz = static_cast<size_t>(st.st_size);
+  storage_.reset();
+  data_ = nullptr;
+  size_ = 0;
+  // mmap(2) rejects an empty mapping.
+  if (sz == 0) {
+    return true;
+  }
+
+  void* addr = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to mmap " << filename;
+    return false;
+  }
+  storage_.reset(addr, [sz](const void* p) { munmap(const_cast<void*>(p), sz); });
+  data_ = static_cast<const uint8_t*>(addr);
+  size_ = sz;
+  return true;
+}
+
+ImageChunk::ImageChunk(int type, size_t start, const FileContent* file_content,
                        size_t raw_data_len, std::string entry_name)
     : type_(type),
       start_(start),
       input_file_ptr_(file_content),
       raw_data_len_(raw_data_len),
       compress_level_(6),
+      uncompressed_len_(0),
       entry_name_(std::move(entry_name)) {
   CHECK(file_content != nullptr) << "input file container can't be nullptr";
 }
@@ -271,20 +675,59 @@ const uint8_t* ImageChunk::GetRawData() const {
   return input_file_ptr_->data() + start_;
 }
 
-const uint8_t * ImageChunk::DataForPatch() const {
-  if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.data();
+bool ImageChunk::DataForPatch(std::vector<uint8_t>* buffer, const uint8_t** data) const {
+  if (type_ != CHUNK_DEFLATE) {
+    *data = GetRawData();
+    return true;
   }
-  return GetRawData();
+
+  buffer->reserve(DataLengthForPatch());
+  if (!Inflate(buffer)) {
+    return false;
+  }
+  buffer->insert(buffer->end(), bonus_data_.begin(), bonus_data_.end());
+  *data = buffer->data();
+  return true;
 }
 
 size_t ImageChunk::DataLengthForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.size();
+    return uncompressed_len_ + bonus_data_.size();
   }
   return raw_data_len_;
 }
 
+bool ImageChunk::Inflate(std::vector<uint8_t>* uncompressed_data) const {
+  CHECK_EQ(type_, CHUNK_DEFLATE);
+  uncompressed_data->resize(uncompressed_len_);
+  // inflate() doesn't like strm.next_out being a nullptr even with avail_out being zero.
+  if (uncompressed_len_ == 0) {
+    return true;
+  }
+
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = raw_data_len_;
+  strm.next_in = GetRawData();
+  strm.avail_out = uncompressed_len_;
+  strm.next_out = uncompressed_data->data();
+  int ret = inflateInit2(&strm, WINDOWBITS);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "Failed to initialize inflate: " << ret;
+    return false;
+  }
+  ret = inflate(&strm, Z_FINISH);
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END || strm.avail_out != 0) {
+    LOG(ERROR) << "Failed to inflate " << raw_data_len_ << " bytes at offset " << start_
+               << " into " << uncompressed_len_ << " bytes: " << ret;
+    return false;
+  }
+  return true;
+}
+
 void ImageChunk::Dump(size_t index) const {
   LOG(INFO) << "chunk: " << index << ", type: " << type_ << ", start: " << start_
             << ", len: " << DataLengthForPatch() << ", name: " << entry_name_;
@@ -298,15 +741,15 @@ bool ImageChunk::operator==(const ImageChunk& other) const {
           memcmp(GetRawData(), other.GetRawData(), raw_data_len_) == 0);
 }
 
-void ImageChunk::SetUncompressedData(std::vector<uint8_t> data) {
-  uncompressed_data_ = std::move(data);
+void ImageChunk::SetUncompressedLength(size_t length) {
+  uncompressed_len_ = length;
 }
 
 bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
   if (type_ != CHUNK_DEFLATE) {
     return false;
   }
-  uncompressed_data_.insert(uncompressed_data_.end(), bonus_data.begin(), bonus_data.end());
+  bonus_data_.insert(bonus_data_.end(), bonus_data.begin(), bonus_data.end());
   return true;
 }
 
@@ -314,7 +757,8 @@ void ImageChunk::ChangeDeflateChunkToNormal() {
   if (type_ != CHUNK_DEFLATE) return;
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
-  uncompressed_data_.clear();
+  uncompressed_len_ = 0;
+  bonus_data_.clear();
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
@@ -338,6 +782,23 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
 #endif
 
+  // The deflate chunks are only inflated for the duration of the diff.
+  std::vector<uint8_t> src_buffer;
+  const uint8_t* src_data;
+  if (!src.DataForPatch(&src_buffer, &src_data)) {
+    LOG(ERROR) << "Failed to get the source data for patch";
+    return false;
+  }
+  std::vector<uint8_t> tgt_buffer;
+  const uint8_t* tgt_data;
+  if (!tgt.DataForPatch(&tgt_buffer, &tgt_data)) {
+    LOG(ERROR) << "Failed to get the target data for patch";
+    return false;
+  }
+  if (bsdiff_cache != nullptr && *bsdiff_cache == nullptr) {
+    *bsdiff_cache = GetCachedSuffixArrayIndex(src_data, src.DataLengthForPatch());
+  }
+
   int fd = mkstemp(ptemp);
   if (fd == -1) {
     PLOG(ERROR) << "MakePatch failed to create a temporary file";
@@ -345,8 +806,8 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   }
   close(fd);
 
-  int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+  int r = bsdiff::bsdiff(src_data, src.DataLengthForPatch(), tgt_data, tgt.DataLengthForPatch(),
+                         ptemp, bsdiff_cache);
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
     return false;
@@ -377,16 +838,27 @@ bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
   return true;
 }
 
-bool ImageChunk::ReconstructDeflateChunk() {
+bool ImageChunk::ReconstructDeflateChunk(int cached_level) {
   if (type_ != CHUNK_DEFLATE) {
     LOG(ERROR) << "Attempted to reconstruct non-deflate chunk";
     return false;
   }
 
+  // The uncompressed data is shared by all the attempts, and released once we're done.
+  std::vector<uint8_t> uncompressed_data;
+  if (!Inflate(&uncompressed_data)) {
+    return false;
+  }
+
+  if (cached_level > 0 && TryReconstruction(uncompressed_data, cached_level)) {
+    compress_level_ = cached_level;
+    return true;
+  }
+
   // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
   // (the maximum).
   for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
+    if (level != cached_level && TryReconstruction(uncompressed_data, level)) {
       compress_level_ = level;
       return true;
     }
@@ -395,18 +867,100 @@ bool ImageChunk::ReconstructDeflateChunk() {
   return false;
 }
 
+std::vector<bool> ImageChunk::ReconstructDeflateChunks(const std::vector<ImageChunk*>& chunks,
+                                                       size_t threads) {
+  // Look up the chunks by the SHA-256 of the compressed data and the uncompressed length.
+  std::vector<std::string> keys(chunks.size());
+  std::map<std::string, int> cache;
+  if (!deflate_cache_file.empty()) {
+    ParallelFor(chunks.size(), threads, [&](size_t i) {
+      uint8_t digest[SHA256_DIGEST_LENGTH];
+      SHA256(chunks[i]->GetRawData(), chunks[i]->GetRawDataLength(), digest);
+      keys[i] = print_hex(digest, SHA256_DIGEST_LENGTH) + ":" +
+                std::to_string(chunks[i]->uncompressed_len_);
+      return true;
+    });
+    cache = LoadDeflateCache();
+  }
+
+  // A cached level is checked by reconstructing the chunk at it, while the chunks that couldn't be
+  // reconstructed are taken as they are.
+  std::vector<int> levels(chunks.size(), 0);
+  std::vector<int> cached_levels(chunks.size(), -1);
+  std::vector<size_t> to_probe;
+  size_t verified = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    auto it = cache.find(keys[i]);
+    if (it != cache.end()) {
+      cached_levels[i] = it->second;
+    }
+    if (cached_levels[i] != 0) {
+      to_probe.push_back(i);
+      verified += (cached_levels[i] > 0) ? 1 : 0;
+    }
+  }
+  LOG(INFO) << "Probing the reconstruction of " << to_probe.size() << " of " << chunks.size()
+            << " deflate chunks, " << verified << " of them at a cached level...";
+
+  // Each attempt holds the uncompressed data of its chunk, so the threads wait for one another
+  // once they hold MAX_INFLATED_BYTES_IN_FLIGHT bytes.
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t bytes_in_flight = 0;
+  ParallelFor(to_probe.size(), threads, [&](size_t k) {
+    size_t i = to_probe[k];
+    ImageChunk* chunk = chunks[i];
+    size_t bytes = chunk->uncompressed_len_;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] {
+        return bytes_in_flight == 0 || bytes_in_flight + bytes <= MAX_INFLATED_BYTES_IN_FLIGHT;
+      });
+      bytes_in_flight += bytes;
+    }
+    levels[i] = chunk->ReconstructDeflateChunk(std::max(cached_levels[i], 0))
+                    ? chunk->compress_level_
+                    : 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      bytes_in_flight -= bytes;
+    }
+    cv.notify_all();
+    return true;
+  });
+
+  std::vector<bool> reconstructed(chunks.size());
+  bool cache_changed = false;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    reconstructed[i] = levels[i] > 0;
+    if (!deflate_cache_file.empty() && cached_levels[i] != 0 && levels[i] != cached_levels[i]) {
+      if (cached_levels[i] > 0) {
+        LOG(WARNING) << "Cached level " << cached_levels[i] << " doesn't reconstruct chunk "
+                     << keys[i] << "; probed " << levels[i];
+      }
+      cache[keys[i]] = levels[i];
+      cache_changed = true;
+    }
+  }
+
+  if (cache_changed) {
+    SaveDeflateCache(cache);
+  }
+  return reconstructed;
+}
+
 /*
- * Takes the uncompressed data stored in the chunk, compresses it using the zlib parameters stored
- * in the chunk, and checks that it matches exactly the compressed data we started with (also
- * stored in the chunk).
+ * Takes the uncompressed data of the chunk, compresses it using the zlib parameters stored in the
+ * chunk, and checks that it matches exactly the compressed data we started with (also stored in
+ * the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(const std::vector<uint8_t>& uncompressed_data, int level) {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = uncompressed_data_.size();
-  strm.next_in = uncompressed_data_.data();
+  strm.avail_in = uncompressed_data.size();
+  strm.next_in = uncompressed_data.data();
   int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
@@ -421,11 +975,15 @@ bool ImageChunk::TryReconstruction(int level) {
     ret = deflate(&strm, Z_FINISH);
     if (ret < 0) {
       LOG(ERROR) << "Failed to deflate: " << ret;
+      deflateEnd(&strm);
       return false;
     }
 
+    // Compare each piece as soon as deflate produces it, so that a mismatch stops the attempt
+    // without compressing the rest of the data.
     size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
+    if (offset + compressed_size > raw_data_len_ ||
+        memcmp(buffer.data(), GetRawData() + offset, compressed_size) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return false;
@@ -462,7 +1020,7 @@ PatchChunk::PatchChunk(const ImageChunk& tgt)
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
-      data_(tgt.DataForPatch(), tgt.DataForPatch() + tgt.DataLengthForPatch()) {}
+      data_(tgt.GetRawData(), tgt.GetRawData() + tgt.GetRawDataLength()) {}
 
 // Return true if raw data is smaller than the patch size.
 bool PatchChunk::RawDataIsSmaller(const ImageChunk& tgt, size_t patch_size) {
@@ -618,33 +1176,8 @@ void Image::DumpChunks() const {
   }
 }
 
-bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_content) {
-  CHECK(file_content != nullptr);
-
-  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
-  if (fd == -1) {
-    PLOG(ERROR) << "Failed to open " << filename;
-    return false;
-  }
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat " << filename;
-    return false;
-  }
-
-  size_t sz = static_cast<size_t>(st.st_size);
-  file_content->resize(sz);
-  if (!android::base::ReadFully(fd, file_content->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << filename;
-    return false;
-  }
-  fd.reset();
-
-  return true;
-}
-
 bool ZipModeImage::Initialize(const std::string& filename) {
-  if (!ReadFile(filename, &file_content_)) {
+  if (!file_content_.Map(filename)) {
     return false;
   }
 
@@ -775,16 +1308,8 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
       compressed_len -= length;
     }
   } else if (entry->method == kCompressDeflated) {
-    size_t uncompressed_len = entry->uncompressed_length;
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
     ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
+    curr.SetUncompressedLength(entry->uncompressed_length);
     chunks_.push_back(std::move(curr));
   } else {
     chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
@@ -862,6 +1387,29 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
 }
 
 bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+  // Probe the target deflate chunks that will need a reconstruction up front, on several threads.
+  std::vector<ImageChunk*> to_reconstruct;
+  for (auto& tgt_chunk : *tgt_image) {
+    if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
+      continue;
+    }
+    const ImageChunk* src_chunk = src_image->FindChunkByName(tgt_chunk.GetEntryName());
+    if (src_chunk != nullptr && tgt_chunk != *src_chunk) {
+      to_reconstruct.push_back(&tgt_chunk);
+    }
+  }
+  std::vector<bool> results = ImageChunk::ReconstructDeflateChunks(to_reconstruct, GetNumThreads());
+  std::map<const ImageChunk*, bool> reconstructed;
+  for (size_t i = 0; i < to_reconstruct.size(); i++) {
+    reconstructed[to_reconstruct[i]] = results[i];
+  }
+  // A chunk may only match a different source below, once the source chunks it matched above are
+  // changed to normal ones; probe such chunks on the spot.
+  auto reconstruct = [&reconstructed](ImageChunk* chunk) {
+    auto it = reconstructed.find(chunk);
+    return it != reconstructed.end() ? it->second : chunk->ReconstructDeflateChunk();
+  };
+
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
@@ -877,7 +1425,7 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!reconstruct(&tgt_chunk)) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
       LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
@@ -1097,43 +1645,70 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks, size_t threads) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  // Find the source of each chunk that needs a patch.
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  std::vector<const ImageChunk*> src_refs(tgt_image.NumOfChunks());
+  std::vector<size_t> to_patch;
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
     const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
                                       ? nullptr
                                       : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    src_refs[i] = (src_chunk == nullptr) ? &pseudo_source : src_chunk;
+    to_patch.push_back(i);
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
-    bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+  // The first patch against the pseudo source loads its suffix array from the cache, or builds it.
+  // It's then shared read-only by the patches on the other threads.
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  auto make_patch = [&](size_t i, bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (!ImageChunk::MakePatch(tgt_chunk, *src_refs[i], &patches[i], bsdiff_cache_ptr)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  };
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  auto first_pseudo = std::find_if(to_patch.begin(), to_patch.end(),
+                                   [&](size_t i) { return src_refs[i] == &pseudo_source; });
+  if (first_pseudo != to_patch.end()) {
+    if (!make_patch(*first_pseudo, &bsdiff_cache)) {
+      delete bsdiff_cache;
+      return false;
+    }
+    to_patch.erase(first_pseudo);
+  }
+  bool success = ParallelFor(to_patch.size(), threads, [&](size_t k) {
+    size_t i = to_patch[k];
+    bsdiff::SuffixArrayIndexInterface* cache = bsdiff_cache;
+    return make_patch(i, (src_refs[i] == &pseudo_source) ? &cache : nullptr);
+  });
+  delete bsdiff_cache;
+  if (!success) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (src_refs[i] == nullptr || PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *src_refs[i], std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
@@ -1143,7 +1718,7 @@ bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeI
                                    const std::string& patch_name) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, GetNumThreads());
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
@@ -1172,14 +1747,23 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
     return false;
   }
 
+  // Generate the split patches in parallel, dividing the threads among the splits; then write them
+  // out in order.
+  size_t threads = GetNumThreads();
+  size_t split_count = split_tgt_images.size();
+  size_t threads_per_split = std::max<size_t>(1, threads / std::max<size_t>(1, split_count));
+  std::vector<std::vector<PatchChunk>> split_patch_chunks(split_count);
+  if (!ParallelFor(split_count, threads, [&](size_t i) {
+        return ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
+                                                     &split_patch_chunks[i], threads_per_split);
+      })) {
+    LOG(ERROR) << "Failed to generate split patch";
+    return false;
+  }
+
   std::vector<std::string> split_info_list;
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
-    std::vector<PatchChunk> patch_chunks;
-    if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
-      LOG(ERROR) << "Failed to generate split patch";
-      return false;
-    }
+    std::vector<PatchChunk>& patch_chunks = split_patch_chunks[i];
 
     size_t total_patch_size = 12;
     for (auto& p : patch_chunks) {
@@ -1208,8 +1792,8 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
         PLOG(ERROR) << "Failed to open " << src_name;
         return false;
       }
-      if (!android::base::WriteFully(fd, split_src_images[i].PseudoSource().DataForPatch(),
-                                     split_src_images[i].PseudoSource().DataLengthForPatch())) {
+      if (!android::base::WriteFully(fd, split_src_images[i].PseudoSource().GetRawData(),
+                                     split_src_images[i].PseudoSource().GetRawDataLength())) {
         PLOG(ERROR) << "Failed to write split source data into " << src_name;
         return false;
       }
@@ -1244,7 +1828,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
 }
 
 bool ImageModeImage::Initialize(const std::string& filename) {
-  if (!ReadFile(filename, &file_content_)) {
+  if (!file_content_.Map(filename)) {
     return false;
   }
 
@@ -1268,7 +1852,7 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       pos += GZIP_HEADER_LEN;
 
       // We must decompress this chunk in order to discover where it ends, and so we can update
-      // the uncompressed_data of the image body and its length.
+      // the uncompressed length of the image body. The data itself is inflated again on demand.
 
       z_stream strm;
       strm.zalloc = Z_NULL;
@@ -1285,23 +1869,18 @@ bool ImageModeImage::Initialize(const std::string& filename) {
         return false;
       }
 
-      size_t allocated = BUFFER_SIZE;
-      std::vector<uint8_t> uncompressed_data(allocated);
+      std::vector<uint8_t> buffer(BUFFER_SIZE);
       size_t uncompressed_len = 0, raw_data_len = 0;
       do {
-        strm.avail_out = allocated - uncompressed_len;
-        strm.next_out = uncompressed_data.data() + uncompressed_len;
+        strm.avail_out = buffer.size();
+        strm.next_out = buffer.data();
         ret = inflate(&strm, Z_NO_FLUSH);
         if (ret < 0) {
           LOG(WARNING) << "Inflate failed [" << strm.msg << "] at offset [" << chunk_offset
                        << "]; treating as a normal chunk";
           break;
         }
-        uncompressed_len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
-          allocated *= 2;
-          uncompressed_data.resize(allocated);
-        }
+        uncompressed_len += buffer.size() - strm.avail_out;
       } while (ret != Z_STREAM_END);
 
       raw_data_len = sz - strm.avail_in - pos;
@@ -1326,8 +1905,7 @@ bool ImageModeImage::Initialize(const std::string& filename) {
       }
 
       ImageChunk body(CHUNK_DEFLATE, pos, &file_content_, raw_data_len);
-      uncompressed_data.resize(uncompressed_len);
-      body.SetUncompressedData(std::move(uncompressed_data));
+      body.SetUncompressedLength(uncompressed_len);
       chunks_.push_back(std::move(body));
 
       pos += raw_data_len;
@@ -1392,6 +1970,20 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     }
   }
 
+  // Probe the target deflate chunks that need a reconstruction up front, on several threads.
+  std::vector<ImageChunk*> to_reconstruct;
+  for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
+    auto& tgt_chunk = (*tgt_image)[i];
+    if (tgt_chunk.GetType() == CHUNK_DEFLATE && tgt_chunk != (*src_image)[i]) {
+      to_reconstruct.push_back(&tgt_chunk);
+    }
+  }
+  std::vector<bool> results = ImageChunk::ReconstructDeflateChunks(to_reconstruct, GetNumThreads());
+  std::map<const ImageChunk*, bool> reconstructed;
+  for (size_t i = 0; i < to_reconstruct.size(); i++) {
+    reconstructed[to_reconstruct[i]] = results[i];
+  }
+
   for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
     auto& tgt_chunk = (*tgt_image)[i];
     auto& src_chunk = (*src_image)[i];
@@ -1403,7 +1995,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else if (!reconstructed[&tgt_chunk]) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1432,30 +2024,38 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
                                      const std::string& patch_name) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  std::vector<PatchChunk> patch_chunks;
-  patch_chunks.reserve(tgt_image.NumOfChunks());
-
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  auto make_patch = [&](size_t i) {
     const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
-      continue;
+      return true;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
+    // The source chunk may be inflated for the diff only, so its index can't outlive the patch.
+    bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+    bool success = ImageChunk::MakePatch(tgt_chunk, src_image[i], &patches[i], &bsdiff_cache);
+    delete bsdiff_cache;
+    if (!success) {
       LOG(ERROR) << "Failed to generate patch for target chunk " << i;
       return false;
     }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  };
+  if (!ParallelFor(tgt_image.NumOfChunks(), GetNumThreads(), make_patch)) {
+    return false;
+  }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  std::vector<PatchChunk> patch_chunks;
+  patch_chunks.reserve(tgt_image.NumOfChunks());
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0) ||
+        PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], std::move(patches[i]));
     }
   }
 
@@ -1482,6 +2082,10 @@ int imgdiff(int argc, const char** argv) {
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
+  num_threads = 0;
+  sa_cache_dir.clear();
+  sa_cache_size_mb = SA_CACHE_DEFAULT_SIZE_MB;
+  deflate_cache_file.clear();
 
   while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
          -1) {
@@ -1521,6 +2125,18 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "threads" &&
+                   (!android::base::ParseUint(optarg, &num_threads) || num_threads == 0)) {
+          LOG(ERROR) << "Failed to parse threads: " << optarg;
+          return 1;
+        } else if (name == "sa-cache-dir") {
+          sa_cache_dir = optarg;
+        } else if (name == "sa-cache-size" &&
+                   !android::base::ParseUint(optarg, &sa_cache_size_mb)) {
+          LOG(ERROR) << "Failed to parse sa-cache-size: " << optarg;
+          return 1;
+        } else if (name == "deflate-cache") {
+          deflate_cache_file = optarg;
         }
         break;
       }
@@ -1546,6 +2162,16 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --threads,        Number of threads to probe the deflate chunks and generate the\n"
+           "                    patches on; defaults to one per CPU. The patch doesn't depend on\n"
+           "                    it.\n"
+           "  --sa-cache-dir,   Directory to keep the suffix arrays of the sources in, so that\n"
+           "                    later runs against the same source skip building them.\n"
+           "  --sa-cache-size,  Size in MiB that the suffix arrays may take in the cache\n"
+           "                    directory; the least recently used ones are removed beyond it.\n"
+           "                    Defaults to 8192.\n"
+           "  --deflate-cache,  File to keep the deflate parameters of the target chunks in, so\n"
+           "                    that later runs skip probing the same chunks.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
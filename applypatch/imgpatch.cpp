@@ -26,8 +26,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -50,7 +55,7 @@ static inline int32_t Read4(const void *address) {
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
 // patched data and stream the deflated data to output.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
-                                            const Value& patch, size_t patch_offset,
+                                            std::string_view patch, size_t patch_offset,
                                             const char* deflate_header, SinkFn sink, SHA_CTX* ctx) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   int level = Read4(deflate_header + 40);
@@ -76,13 +81,13 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   size_t actual_target_length = 0;
   size_t total_written = 0;
   static constexpr size_t buffer_size = 32768;
+  std::vector<uint8_t> buffer(buffer_size);
   auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
+                           &ret, &ctx, &sink, &buffer](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
       strm.avail_out = buffer_size;
       strm.next_out = buffer.data();
       if (actual_target_length + len < expected_target_length) {
@@ -133,156 +138,360 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 }
 
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink) {
-  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
+                    size_t patch_size, SinkFn sink, size_t max_threads) {
+  std::string_view patch(reinterpret_cast<const char*>(patch_data), patch_size);
+  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr, max_threads);
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    SHA_CTX* ctx, const Value* bonus_data) {
-  if (patch.data.size() < 12) {
+// Inflates the source of the deflate chunk described by 'deflate_header' into 'expanded_source',
+// appending the optional bonus data, then applies the chunk's bsdiff patch and streams the deflated
+// output through 'sink'. 'expanded_source' is only used as scratch space, so that the callers can
+// reuse it across chunks.
+static bool ApplyDeflateChunk(const unsigned char* old_data, const char* deflate_header,
+                              std::string_view patch, const Value* bonus_data,
+                              std::vector<unsigned char>* expanded_source, SinkFn sink,
+                              SHA_CTX* ctx) {
+  size_t src_start = static_cast<size_t>(Read8(deflate_header));
+  size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+  size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+  size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+  // Decompress the source data; the chunk header tells us exactly
+  // how big we expect it to be when decompressed.
+
+  // Note: expanded_len will include the bonus data size if
+  // the patch was constructed with bonus data.  The
+  // deflation will come up 'bonus_size' bytes short; these
+  // must be appended from the bonus_data value.
+  size_t bonus_size = (bonus_data != NULL) ? bonus_data->data.size() : 0;
+
+  expanded_source->resize(expanded_len);
+
+  // inflate() doesn't like strm.next_out being a nullptr even with
+  // avail_out being zero (Z_STREAM_ERROR).
+  if (expanded_len != 0) {
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = src_len;
+    strm.next_in = old_data + src_start;
+    strm.avail_out = expanded_len;
+    strm.next_out = expanded_source->data();
+
+    int ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+      printf("failed to init source inflation: %d\n", ret);
+      return false;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END) {
+      printf("source inflation returned %d\n", ret);
+      inflateEnd(&strm);
+      return false;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+      printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
+      inflateEnd(&strm);
+      return false;
+    }
+    inflateEnd(&strm);
+
+    if (bonus_size) {
+      memcpy(expanded_source->data() + (expanded_len - bonus_size), &bonus_data->data[0],
+             bonus_size);
+    }
+  }
+
+  if (!ApplyBSDiffPatchAndStreamOutput(expanded_source->data(), expanded_len, patch, patch_offset,
+                                       deflate_header, sink, ctx)) {
+    LOG(ERROR) << "Fail to apply streaming bspatch.";
+    return false;
+  }
+  return true;
+}
+
+// The deflate chunks of an image patch are inflated, patched and deflated on up to this many
+// worker threads. Recompressing the output dominates the time spent on such chunks.
+static constexpr size_t kMaxDeflateThreads = 4;
+
+// The deflate chunks in flight (being processed, or done and waiting for their turn to be written)
+// may expand to at most this many bytes of source and target. A chunk that is larger on its own is
+// only started when nothing else is in flight.
+static constexpr size_t kMaxDeflateBytesInFlight = 64 * 1024 * 1024;
+
+namespace {
+
+// A chunk record parsed from an image patch.
+struct ChunkRecord {
+  int type;
+  // The chunk header, which follows the 4-byte type.
+  const char* header;
+  // The bonus data to append to the source of a deflate chunk, if any.
+  const Value* bonus_data;
+};
+
+// Processes the deflate chunks of an image patch on worker threads, and hands out their deflated
+// output in chunk order so that it can be written exactly as the sequential code would.
+class DeflateChunkPipeline {
+ public:
+  DeflateChunkPipeline(const unsigned char* old_data, std::string_view patch,
+                       const std::vector<const ChunkRecord*>& chunks, size_t num_threads)
+      : old_data_(old_data),
+        patch_(patch),
+        jobs_(chunks.size()) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      jobs_[i].chunk = chunks[i];
+      // The expanded source and target lengths from the deflate header.
+      jobs_[i].bytes = static_cast<size_t>(Read8(chunks[i]->header + 24)) +
+                       static_cast<size_t>(Read8(chunks[i]->header + 32));
+    }
+    for (size_t i = 0; i < num_threads; i++) {
+      workers_.emplace_back(&DeflateChunkPipeline::WorkerLoop, this);
+    }
+  }
+
+  ~DeflateChunkPipeline() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      abort_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Waits for the next deflate chunk in order, and writes its output through 'sink'.
+  bool WriteNext(SinkFn sink, SHA_CTX* ctx) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Job& job = jobs_[written_];
+    cv_.wait(lock, [&job] { return job.done; });
+    std::vector<unsigned char> output = std::move(job.output);
+    bool success = job.success;
+    lock.unlock();
+
+    if (success) {
+      if (ctx) {
+        SHA1_Update(ctx, output.data(), output.size());
+      }
+      if (sink(output.data(), output.size()) != output.size()) {
+        LOG(ERROR) << "Failed to write " << output.size() << " deflated bytes to output.";
+        success = false;
+      }
+    }
+
+    lock.lock();
+    PutBuffer(std::move(output));
+    bytes_in_flight_ -= job.bytes;
+    written_++;
+    cv_.notify_all();
+    return success;
+  }
+
+ private:
+  struct Job {
+    const ChunkRecord* chunk = nullptr;
+    size_t bytes = 0;
+    bool done = false;
+    bool success = false;
+    std::vector<unsigned char> output;
+  };
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] {
+        return abort_ || started_ == jobs_.size() || started_ == written_ ||
+               bytes_in_flight_ + jobs_[started_].bytes <= kMaxDeflateBytesInFlight;
+      });
+      if (abort_ || started_ == jobs_.size()) {
+        return;
+      }
+      Job& job = jobs_[started_++];
+      bytes_in_flight_ += job.bytes;
+      std::vector<unsigned char> expanded_source = GetBuffer();
+      std::vector<unsigned char> output = GetBuffer();
+      lock.unlock();
+
+      output.clear();
+      SinkFn sink = [&output](const unsigned char* data, size_t len) {
+        output.insert(output.end(), data, data + len);
+        return len;
+      };
+      bool success = ApplyDeflateChunk(old_data_, job.chunk->header, patch_, job.chunk->bonus_data,
+                                       &expanded_source, sink, nullptr);
+
+      lock.lock();
+      PutBuffer(std::move(expanded_source));
+      job.output = std::move(output);
+      job.success = success;
+      job.done = true;
+      cv_.notify_all();
+    }
+  }
+
+  // The inflated sources and the deflated outputs are drawn from a pool of buffers, so that their
+  // allocations are reused across the chunks. Both require holding mutex_.
+  std::vector<unsigned char> GetBuffer() {
+    if (buffers_.empty()) {
+      return {};
+    }
+    std::vector<unsigned char> buffer = std::move(buffers_.back());
+    buffers_.pop_back();
+    return buffer;
+  }
+
+  void PutBuffer(std::vector<unsigned char> buffer) {
+    buffers_.push_back(std::move(buffer));
+  }
+
+  const unsigned char* old_data_;
+  std::string_view patch_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Job> jobs_;
+  // Number of jobs taken by the workers, and number of jobs written in order.
+  size_t started_ = 0;
+  size_t written_ = 0;
+  // The expanded bytes of the jobs that have been started but not written.
+  size_t bytes_in_flight_ = 0;
+  bool abort_ = false;
+  std::vector<std::vector<unsigned char>> buffers_;
+  std::vector<std::thread> workers_;
+};
+
+}  // namespace
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data, size_t max_threads) {
+  if (patch.size() < 12) {
     printf("patch too short to contain header\n");
     return -1;
   }
 
   // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
   // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
-  const char* const patch_header = patch.data.data();
+  const char* const patch_header = patch.data();
   if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
     printf("corrupt patch file header (magic number)\n");
     return -1;
   }
 
+  // Parse and check all the chunk records first, so that the deflate chunks can be started ahead
+  // of the chunks before them.
   int num_chunks = Read4(patch_header + 8);
+  std::vector<ChunkRecord> chunks;
+  std::vector<const ChunkRecord*> deflate_chunks;
   size_t pos = 12;
   for (int i = 0; i < num_chunks; ++i) {
     // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
+    if (pos + 4 > patch.size()) {
       printf("failed to read chunk %d record\n", i);
       return -1;
     }
     int type = Read4(patch_header + pos);
     pos += 4;
 
+    const char* chunk_header = patch_header + pos;
     if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
       pos += 24;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d normal header data\n", i);
         return -1;
       }
 
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
-
+      size_t src_start = static_cast<size_t>(Read8(chunk_header));
+      size_t src_len = static_cast<size_t>(Read8(chunk_header + 8));
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
         return -1;
       }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
     } else if (type == CHUNK_RAW) {
-      const char* raw_header = patch_header + pos;
       pos += 4;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d raw header data\n", i);
         return -1;
       }
 
-      size_t data_len = static_cast<size_t>(Read4(raw_header));
-
-      if (pos + data_len > patch.data.size()) {
+      size_t data_len = static_cast<size_t>(Read4(chunk_header));
+      if (pos + data_len > patch.size()) {
         printf("failed to read chunk %d raw data\n", i);
         return -1;
       }
-      if (ctx) {
-        SHA1_Update(ctx, patch_header + pos, data_len);
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
-        return -1;
-      }
       pos += data_len;
     } else if (type == CHUNK_DEFLATE) {
       // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
       pos += 60;
-      if (pos > patch.data.size()) {
+      if (pos > patch.size()) {
         printf("failed to read chunk %d deflate header data\n", i);
         return -1;
       }
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
+      size_t src_start = static_cast<size_t>(Read8(chunk_header));
+      size_t src_len = static_cast<size_t>(Read8(chunk_header + 8));
       if (src_start + src_len > old_size) {
         printf("source data too short\n");
         return -1;
       }
+    } else {
+      printf("patch chunk %d is unknown type %d\n", i, type);
+      return -1;
+    }
+    // The bonus data, if any, goes with the second chunk.
+    chunks.push_back({ type, chunk_header, i == 1 ? bonus_data : nullptr });
+  }
+  for (const auto& chunk : chunks) {
+    if (chunk.type == CHUNK_DEFLATE) {
+      deflate_chunks.push_back(&chunk);
+    }
+  }
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if
-      // the patch was constructed with bonus data.  The
-      // deflation will come up 'bonus_size' bytes short; these
-      // must be appended from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
-
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
-        }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
-        }
-        inflateEnd(&strm);
-
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
-                 bonus_size);
-        }
-      }
+  // With more than one deflate chunk, hand them to a pipeline of workers. The other chunks are
+  // cheap, and are still applied on this thread as their turn comes.
+  std::unique_ptr<DeflateChunkPipeline> pipeline;
+  if (max_threads == 0) {
+    max_threads = std::min<size_t>(kMaxDeflateThreads, std::thread::hardware_concurrency());
+  }
+  size_t num_threads = std::min(max_threads, deflate_chunks.size());
+  if (num_threads > 1) {
+    pipeline =
+        std::make_unique<DeflateChunkPipeline>(old_data, patch, deflate_chunks, num_threads);
+  }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink, ctx)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
+  std::vector<unsigned char> expanded_source;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    const ChunkRecord& chunk = chunks[i];
+    if (chunk.type == CHUNK_NORMAL) {
+      size_t src_start = static_cast<size_t>(Read8(chunk.header));
+      size_t src_len = static_cast<size_t>(Read8(chunk.header + 8));
+      size_t patch_offset = static_cast<size_t>(Read8(chunk.header + 16));
+      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
+        printf("Failed to apply bsdiff patch.\n");
         return -1;
       }
-
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
+    } else if (chunk.type == CHUNK_RAW) {
+      size_t data_len = static_cast<size_t>(Read4(chunk.header));
+      const char* data = chunk.header + 4;
+      if (ctx) {
+        SHA1_Update(ctx, data, data_len);
+      }
+      if (sink(reinterpret_cast<const unsigned char*>(data), data_len) != data_len) {
+        printf("failed to write chunk %zu raw data\n", i);
+        return -1;
+      }
+    } else if (pipeline) {
+      if (!pipeline->WriteNext(sink, ctx)) {
+        return -1;
+      }
+    } else if (!ApplyDeflateChunk(old_data, chunk.header, patch, chunk.bonus_data,
+                                  &expanded_source, sink, ctx)) {
       return -1;
     }
   }
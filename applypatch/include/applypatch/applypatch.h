@@ -22,6 +22,7 @@
 #include <functional>
 #include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <openssl/sha.h>
@@ -34,6 +35,21 @@ struct FileContents {
   std::vector<unsigned char> data;
 };
 
+// A read-only mapping of a file or an EMMC partition, as loaded by MapFileContents(). The mapped
+// data is backed by the page cache rather than the heap.
+struct MappedFileContents {
+  MappedFileContents() = default;
+  ~MappedFileContents();
+  MappedFileContents(const MappedFileContents&) = delete;
+  MappedFileContents& operator=(const MappedFileContents&) = delete;
+
+  void Unmap();
+
+  uint8_t sha1[SHA_DIGEST_LENGTH];
+  const unsigned char* data = nullptr;
+  size_t size = 0;
+};
+
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 
 // applypatch.cpp
@@ -56,6 +72,7 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
                      const char* target_sha1_str, size_t target_size);
 
 int LoadFileContents(const char* filename, FileContents* file);
+int MapFileContents(const char* filename, MappedFileContents* file);
 int SaveFileContents(const char* filename, const FileContents* file);
 
 // bspatch.cpp
@@ -64,17 +81,20 @@ void ShowBSDiffLicense();
 
 // Applies the bsdiff-patch given in 'patch' (from offset 'patch_offset' to the end) to the source
 // data given by (old_data, old_size). Writes the patched output through the given 'sink', and
-// updates the SHA-1 context with the output data. Returns 0 on success.
-int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value& patch,
+// updates the SHA-1 context with the output data. Returns 0 on success. 'patch' is a non-owning
+// view, so callers may pass the patch straight out of a mapped package without copying it.
+int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
                      size_t patch_offset, SinkFn sink, SHA_CTX* ctx);
 
 // imgpatch.cpp
 
 // Applies the imgdiff-patch given in 'patch' to the source data given by (old_data, old_size), with
 // the optional bonus data. Writes the patched output through the given 'sink', and updates the
-// SHA-1 context with the output data. Returns 0 on success.
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    SHA_CTX* ctx, const Value* bonus_data);
+// SHA-1 context with the output data. Returns 0 on success. Like ApplyBSDiffPatch(), 'patch' is
+// only viewed and must outlive the call. The deflate chunks are processed on up to 'max_threads'
+// worker threads; 0 picks a default based on the number of CPUs.
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, std::string_view patch,
+                    SinkFn sink, SHA_CTX* ctx, const Value* bonus_data, size_t max_threads = 0);
 
 // freecache.cpp
 
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -31,6 +32,39 @@
 #include "imgdiff.h"
 #include "otautil/rangeset.h"
 
+// The whole content of an input file. The input files are mmapped read-only instead of being read
+// into memory; the images that imgdiff assembles itself (e.g. the split source images) hold their
+// content in memory. Copies share the same underlying data.
+class FileContent {
+ public:
+  FileContent() = default;
+  explicit FileContent(std::vector<uint8_t> data);
+
+  // Map |filename| read-only and replace the current content with it.
+  bool Map(const std::string& filename);
+
+  const uint8_t* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  const uint8_t& operator[](size_t i) const {
+    return data_[i];
+  }
+  const uint8_t* begin() const {
+    return data_;
+  }
+  const uint8_t* end() const {
+    return data_ + size_;
+  }
+
+ private:
+  std::shared_ptr<const void> storage_;  // the mapping or the in-memory buffer
+  const uint8_t* data_{ nullptr };
+  size_t size_{ 0 };
+};
+
 class ImageChunk {
  public:
   static constexpr auto WINDOWBITS = -15;  // 32kb window; negative to indicate a raw stream.
@@ -38,7 +72,7 @@ class ImageChunk {
   static constexpr auto METHOD = Z_DEFLATED;
   static constexpr auto STRATEGY = Z_DEFAULT_STRATEGY;
 
-  ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content, size_t raw_data_len,
+  ImageChunk(int type, size_t start, const FileContent* file_content, size_t raw_data_len,
              std::string entry_name = {});
 
   int GetType() const {
@@ -57,14 +91,18 @@ class ImageChunk {
     return compress_level_;
   }
 
-  // CHUNK_DEFLATE will return the uncompressed data for diff, while other types will simply return
-  // the raw data.
-  const uint8_t* DataForPatch() const;
+  // The raw data of the chunk within the input file.
+  const uint8_t* GetRawData() const;
+
+  // CHUNK_DEFLATE will return the length of the uncompressed data for diff, while other types will
+  // simply return the length of the raw data.
   size_t DataLengthForPatch() const;
 
   void Dump(size_t index) const;
 
-  void SetUncompressedData(std::vector<uint8_t> data);
+  // The uncompressed data of a deflate chunk isn't kept around; it's inflated from the raw data
+  // whenever it's needed, and only the length is recorded here.
+  void SetUncompressedLength(size_t length);
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
   bool operator==(const ImageChunk& other) const;
@@ -83,36 +121,53 @@ class ImageChunk {
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
    * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * parameters needed to produce the right output. A non-zero |cached_level| is tried first, and
+   * the other levels only if it doesn't reproduce the data.
+   */
+  bool ReconstructDeflateChunk(int cached_level = 0);
+
+  /*
+   * Run ReconstructDeflateChunk() for all the given deflate chunks on up to |threads| threads, and
+   * return whether each one can be reconstructed. The encoder parameters are looked up in and
+   * saved to the deflate cache file if one is given; a cached level is only a hint, which saves
+   * probing the other levels once a single attempt at it has reproduced the chunk.
    */
-  bool ReconstructDeflateChunk();
+  static std::vector<bool> ReconstructDeflateChunks(const std::vector<ImageChunk*>& chunks,
+                                                    size_t threads);
   bool IsAdjacentNormal(const ImageChunk& other) const;
   void MergeAdjacentNormal(const ImageChunk& other);
 
   /*
    * Compute a bsdiff patch between |src| and |tgt|; Store the result in the patch_data.
    * |bsdiff_cache| can be used to cache the suffix array if the same |src| chunk is used
-   * repeatedly, pass nullptr if not needed.
+   * repeatedly, pass nullptr if not needed. If it points to nullptr, it's set to the index loaded
+   * from the suffix array cache dir, or built by bsdiff. The index refers to the source data, so
+   * it can only be reused for the chunks that aren't inflated for the diff.
    */
   static bool MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                         std::vector<uint8_t>* patch_data,
                         bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
 
  private:
-  const uint8_t* GetRawData() const;
-  bool TryReconstruction(int level);
-
-  int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
-  size_t start_;                                // offset of chunk in the original input file
-  const std::vector<uint8_t>* input_file_ptr_;  // ptr to the full content of original input file
+  // CHUNK_DEFLATE will inflate the uncompressed data (followed by the bonus data) into |buffer|
+  // and point |data| to it, while other types will simply point |data| to the raw data.
+  bool DataForPatch(std::vector<uint8_t>* buffer, const uint8_t** data) const;
+  // Inflate the raw data of a deflate chunk into |uncompressed_data|.
+  bool Inflate(std::vector<uint8_t>* uncompressed_data) const;
+  bool TryReconstruction(const std::vector<uint8_t>& uncompressed_data, int level);
+
+  int type_;                           // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
+  size_t start_;                       // offset of chunk in the original input file
+  const FileContent* input_file_ptr_;  // ptr to the full content of original input file
   size_t raw_data_len_;
 
   // deflate encoder parameters
   int compress_level_;
 
   // --- for CHUNK_DEFLATE chunks only: ---
-  std::vector<uint8_t> uncompressed_data_;
-  std::string entry_name_;  // used for zip entries
+  size_t uncompressed_len_;
+  std::vector<uint8_t> bonus_data_;  // appended to the uncompressed data for diff
+  std::string entry_name_;           // used for zip entries
 };
 
 // PatchChunk stores the patch data between a source chunk and a target chunk. It also keeps track
@@ -197,11 +252,9 @@ class Image {
   }
 
  protected:
-  bool ReadFile(const std::string& filename, std::vector<uint8_t>* file_content);
-
-  bool is_source_;                     // True if it's for source chunks.
-  std::vector<ImageChunk> chunks_;     // Internal storage of ImageChunk.
-  std::vector<uint8_t> file_content_;  // Store the whole input file in memory.
+  bool is_source_;                  // True if it's for source chunks.
+  std::vector<ImageChunk> chunks_;  // Internal storage of ImageChunk.
+  FileContent file_content_;        // The whole input file, mapped or in memory.
 };
 
 class ZipModeImage : public Image {
@@ -213,9 +266,9 @@ class ZipModeImage : public Image {
   // Initialize a dummy ZipModeImage from an existing ImageChunk vector. For src img pieces, we
   // reconstruct a new file_content based on the source ranges; but it's not needed for the tgt img
   // pieces; because for each chunk both the data and their offset within the file are unchanged.
-  void Initialize(const std::vector<ImageChunk>& chunks, const std::vector<uint8_t>& file_content) {
+  void Initialize(const std::vector<ImageChunk>& chunks, std::vector<uint8_t> file_content) {
     chunks_ = chunks;
-    file_content_ = file_content;
+    file_content_ = FileContent(std::move(file_content));
   }
 
   // The pesudo source chunk for bsdiff if there's no match for the given target chunk. It's in
@@ -275,9 +328,9 @@ class ZipModeImage : public Image {
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images);
 
-  // Function that actually iterates the tgt_chunks and makes patches.
+  // Function that actually iterates the tgt_chunks and makes patches, on up to |threads| threads.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks, size_t threads);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
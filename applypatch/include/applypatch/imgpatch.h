@@ -23,7 +23,10 @@
 
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 
+// Applies the imgdiff-patch in (patch_data, patch_size) to (old_data, old_size), writing the
+// output through 'sink'. The deflate chunks are processed on up to 'max_threads' worker threads; 0
+// picks a default based on the number of CPUs.
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink);
+                    size_t patch_size, SinkFn sink, size_t max_threads = 0);
 
 #endif  // _APPLYPATCH_IMGPATCH_H
@@ -26,6 +26,8 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <sys/stat.h>  // mode_t
+#include <sys/types.h>
+#include <sys/uio.h>  // struct iovec
 
 #include <memory>
 
@@ -49,6 +51,8 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream);
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 int ota_fsync(int fd);
 
 struct OtaCloser {
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <map>
@@ -190,6 +191,25 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     return status;
 }
 
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = filename_cache.find(fd);
+        if (cached != filename_cache.end() &&
+                get_hit_file(cached->second, write_fault_file_name)) {
+            write_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwritev64(fd, iov, iovcnt, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
 int ota_fsync(int fd) {
     if (should_fault_inject(OTAIO_FSYNC)) {
         std::lock_guard<std::mutex> lock(filename_mutex);
@@ -49,6 +49,13 @@ class CacheLocation {
     stash_directory_base_ = base;
   }
 
+  std::string profile_directory() const {
+    return profile_directory_;
+  }
+  void set_profile_directory(const std::string& directory) {
+    profile_directory_ = directory;
+  }
+
  private:
   CacheLocation();
   DISALLOW_COPY_AND_ASSIGN(CacheLocation);
@@ -64,6 +71,9 @@ class CacheLocation {
 
   // The base directory to write stashes during update.
   std::string stash_directory_base_;
+
+  // The directory to write the per-command profiles of block image updates.
+  std::string profile_directory_;
 };
 
 #endif  // _OTAUTIL_OTAUTIL_CACHE_LOCATION_H_
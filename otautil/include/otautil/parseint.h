@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <limits>
+#include <string>
+#include <string_view>
+
+#include <android-base/parseint.h>
+
+// Versions of android::base::ParseUint() and ParseInt() for the numbers in a larger text, such as
+// the tokens of a transfer list. Short numbers are NUL-terminated on the stack instead of being
+// copied into a std::string.
+
+template <typename T>
+bool ParseUint(std::string_view text, T* value, T max = std::numeric_limits<T>::max()) {
+  char buf[32];
+  if (text.size() >= sizeof(buf)) {
+    return android::base::ParseUint(std::string(text), value, max);
+  }
+  text.copy(buf, text.size());
+  buf[text.size()] = '\0';
+  return android::base::ParseUint(buf, value, max);
+}
+
+template <typename T>
+bool ParseInt(std::string_view text, T* value, T min = std::numeric_limits<T>::min(),
+              T max = std::numeric_limits<T>::max()) {
+  char buf[32];
+  if (text.size() >= sizeof(buf)) {
+    return android::base::ParseInt(std::string(text), value, min, max);
+  }
+  text.copy(buf, text.size());
+  buf[text.size()] = '\0';
+  return android::base::ParseInt(buf, value, min, max);
+}
@@ -19,6 +19,7 @@
 #include <stddef.h>
 
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -32,7 +33,7 @@ class RangeSet {
 
   // Parses the given string into a RangeSet. Returns the parsed RangeSet, or an empty RangeSet on
   // errors.
-  static RangeSet Parse(const std::string& range_text);
+  static RangeSet Parse(std::string_view range_text);
 
   // Appends the given Range to the current RangeSet.
   bool PushBack(Range range);
@@ -21,13 +21,14 @@
 
 #include <algorithm>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
-#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
-#include <android-base/strings.h>
+
+#include "otautil/parseint.h"
 
 RangeSet::RangeSet(std::vector<Range>&& pairs) {
   blocks_ = 0;
@@ -44,15 +45,17 @@ RangeSet::RangeSet(std::vector<Range>&& pairs) {
   }
 }
 
-RangeSet RangeSet::Parse(const std::string& range_text) {
-  std::vector<std::string> pieces = android::base::Split(range_text, ",");
-  if (pieces.size() < 3) {
+RangeSet RangeSet::Parse(std::string_view range_text) {
+  // The text is "<num>,<first_0>,<second_0>,...", i.e. <num> + 1 comma-separated pieces.
+  size_t commas = std::count(range_text.begin(), range_text.end(), ',');
+  if (commas < 2) {
     LOG(ERROR) << "Invalid range text: " << range_text;
     return {};
   }
 
+  size_t pos = range_text.find(',');
   size_t num;
-  if (!android::base::ParseUint(pieces[0], &num, static_cast<size_t>(INT_MAX))) {
+  if (!ParseUint(range_text.substr(0, pos), &num, static_cast<size_t>(INT_MAX))) {
     LOG(ERROR) << "Failed to parse the number of tokens: " << range_text;
     return {};
   }
@@ -64,17 +67,25 @@ RangeSet RangeSet::Parse(const std::string& range_text) {
     LOG(ERROR) << "Number of tokens must be even: " << range_text;
     return {};
   }
-  if (num != pieces.size() - 1) {
+  if (num != commas) {
     LOG(ERROR) << "Mismatching number of tokens: " << range_text;
     return {};
   }
 
+  // Returns the next piece after the comma at |pos|.
+  auto next_piece = [&range_text, &pos]() {
+    size_t start = pos + 1;
+    pos = range_text.find(',', start);
+    return range_text.substr(start, pos == std::string_view::npos ? pos : pos - start);
+  };
+
   std::vector<Range> pairs;
+  pairs.reserve(num / 2);
   for (size_t i = 0; i < num; i += 2) {
     size_t first;
     size_t second;
-    if (!android::base::ParseUint(pieces[i + 1], &first, static_cast<size_t>(INT_MAX)) ||
-        !android::base::ParseUint(pieces[i + 2], &second, static_cast<size_t>(INT_MAX))) {
+    if (!ParseUint(next_piece(), &first, static_cast<size_t>(INT_MAX)) ||
+        !ParseUint(next_piece(), &second, static_cast<size_t>(INT_MAX))) {
       return {};
     }
     pairs.emplace_back(first, second);
@@ -167,6 +167,8 @@ LOCAL_STATIC_LIBRARIES := \
     libsquashfs_utils \
     libcutils \
     libbrotli \
+    libzstd \
+    liblz4 \
     libBionicGtestMain \
     $(tune2fs_static_libraries)
 
@@ -202,18 +204,32 @@ LOCAL_MODULE := recovery_host_test
 LOCAL_MODULE_HOST_OS := linux
 LOCAL_C_INCLUDES := bootable/recovery
 LOCAL_SRC_FILES := \
-    component/imgdiff_test.cpp
+    component/imgdiff_test.cpp \
+    component/update_simulator_test.cpp
 LOCAL_STATIC_LIBRARIES := \
+    libupdate_simulator \
     libimgdiff \
     libimgpatch \
+    libapplypatch \
+    libedify \
+    libotafault \
     libotautil \
     libbsdiff \
     libbspatch \
     libziparchive \
+    libfec \
+    libfec_rs \
+    libext4_utils \
+    libsquashfs_utils \
+    libsparse \
     libutils \
+    libcutils \
     libbase \
+    libcrypto_utils \
     libcrypto \
     libbrotli \
+    libzstd \
+    liblz4 \
     libbz \
     libdivsufsort64 \
     libdivsufsort \
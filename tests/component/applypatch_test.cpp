@@ -166,6 +166,44 @@ TEST_F(ApplyPatchTest, CheckModeEmmcTarget) {
   ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s));
 }
 
+TEST_F(ApplyPatchTest, MapFileContentsEmmcTarget) {
+  // A partition that spans several hash windows, with a prefix that matches partway through one.
+  TemporaryFile temp_file;
+  std::string content(3 * 1024 * 1024 + 17, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = rand() % 256;
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(content, temp_file.path));
+
+  std::string content_sha1;
+  sha1sum(temp_file.path, &content_sha1);
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(content.data()), 5000, digest);
+  std::string prefix_sha1 = print_sha1(digest);
+
+  std::string src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(content.size()) + ":" +
+                         content_sha1 + ":5000:" + prefix_sha1;
+  MappedFileContents file;
+  ASSERT_EQ(0, MapFileContents(src_file.c_str(), &file));
+  ASSERT_EQ(5000U, file.size);
+  ASSERT_EQ(prefix_sha1, print_sha1(file.sha1));
+  ASSERT_EQ(content.substr(0, 5000), std::string(reinterpret_cast<const char*>(file.data), 5000));
+
+  src_file = "EMMC:"s + temp_file.path + ":" + std::to_string(content.size()) + ":" + content_sha1;
+  ASSERT_EQ(0, MapFileContents(src_file.c_str(), &file));
+  ASSERT_EQ(content.size(), file.size);
+  ASSERT_EQ(content_sha1, print_sha1(file.sha1));
+
+  // The regular file gives the same contents.
+  ASSERT_EQ(0, MapFileContents(temp_file.path, &file));
+  ASSERT_EQ(content, std::string(reinterpret_cast<const char*>(file.data), file.size));
+
+  // Reading past the end of the partition fails.
+  src_file =
+      "EMMC:"s + temp_file.path + ":" + std::to_string(content.size() + 1) + ":" + content_sha1;
+  ASSERT_NE(0, MapFileContents(src_file.c_str(), &file));
+}
+
 TEST_F(ApplyPatchCacheTest, CheckCacheCorruptedSourceSingle) {
   TemporaryFile temp_file;
   mangle_file(temp_file.path);
@@ -316,6 +354,51 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetWithBsdiffPatch) {
   ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
 }
 
+// Ensures that applypatch falls back to the backup copy of the source on /cache, when the source
+// partition doesn't have the expected contents.
+TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetFromCacheCopy) {
+  std::string boot_img = from_testdata_base("boot.img");
+  size_t boot_img_size;
+  std::string boot_img_sha1;
+  sha1sum(boot_img, &boot_img_sha1, &boot_img_size);
+
+  std::string recovery_img = from_testdata_base("recovery.img");
+  size_t recovery_img_size;
+  std::string recovery_img_sha1;
+  sha1sum(recovery_img, &recovery_img_sha1, &recovery_img_size);
+
+  // The backup on /cache has the source, while the source partition has been clobbered.
+  std::string boot_img_content;
+  ASSERT_TRUE(android::base::ReadFileToString(boot_img, &boot_img_content));
+  ASSERT_TRUE(android::base::WriteStringToFile(boot_img_content, cache_source.path));
+  TemporaryFile src;
+  mangle_file(src.path);
+
+  // applypatch -b <bonus-file> <src-file> <tgt-file> <tgt-sha1> <tgt-size> <src-sha1>:<patch>
+  std::string bonus_file = from_testdata_base("bonus.file");
+  std::string src_file_arg =
+      "EMMC:"s + src.path + ":" + std::to_string(boot_img_size) + ":" + boot_img_sha1;
+  TemporaryFile tgt_file;
+  std::string tgt_file_arg = "EMMC:"s + tgt_file.path;
+  std::string recovery_img_size_arg = std::to_string(recovery_img_size);
+  std::string patch_arg = boot_img_sha1 + ":" + from_testdata_base("recovery-from-boot.p");
+  std::vector<const char*> args = { "applypatch",
+                                    "-b",
+                                    bonus_file.c_str(),
+                                    src_file_arg.c_str(),
+                                    tgt_file_arg.c_str(),
+                                    recovery_img_sha1.c_str(),
+                                    recovery_img_size_arg.c_str(),
+                                    patch_arg.c_str() };
+  ASSERT_EQ(0, applypatch_modes(args.size(), args.data()));
+
+  std::string tgt_file_sha1;
+  size_t tgt_file_size;
+  sha1sum(tgt_file.path, &tgt_file_sha1, &tgt_file_size);
+  ASSERT_EQ(recovery_img_size, tgt_file_size);
+  ASSERT_EQ(recovery_img_sha1, tgt_file_sha1);
+}
+
 TEST_F(ApplyPatchModesTest, PatchModeInvalidArgs) {
   // Invalid bonus file.
   ASSERT_NE(0, applypatch_modes(3, (const char* []){ "applypatch", "-b", "/doesntexist" }));
@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <stdio.h>
 
 #include <algorithm>
@@ -685,7 +686,7 @@ static void GenerateAndCheckSplitTarget(const std::string& debug_dir, size_t cou
 }
 
 std::vector<ImageChunk> ConstructImageChunks(
-    const std::vector<uint8_t>& content, const std::vector<std::tuple<std::string, size_t>>& info) {
+    const FileContent& content, const std::vector<std::tuple<std::string, size_t>>& info) {
   std::vector<ImageChunk> chunks;
   size_t start = 0;
   for (const auto& t : info) {
@@ -697,33 +698,70 @@ std::vector<ImageChunk> ConstructImageChunks(
   return chunks;
 }
 
+TEST(ImgpatchTest, deflate_chunks_threads) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_LT(1U, num_deflate);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+
+  // The deflate chunks are written in order whether they're applied inline or on the workers.
+  for (size_t threads : { 1, 4 }) {
+    std::string patched;
+    ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                                 reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+                                 [&](const unsigned char* data, size_t len) {
+                                   patched.append(reinterpret_cast<const char*>(data), len);
+                                   return len;
+                                 },
+                                 threads))
+        << "threads: " << threads;
+    ASSERT_EQ(tgt, patched) << "threads: " << threads;
+  }
+}
+
 TEST(ImgdiffTest, zip_mode_split_image_smoke) {
   std::vector<uint8_t> content;
   content.reserve(4096 * 50);
   uint8_t n = 0;
   generate_n(back_inserter(content), 4096 * 50, [&n]() { return n++ / 4096; });
+  FileContent file_content(content);
 
   ZipModeImage tgt_image(false, 4096 * 10);
-  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(content, { { "a", 100 },
-                                                                       { "b", 4096 * 2 },
-                                                                       { "c", 4096 * 3 },
-                                                                       { "d", 300 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 4096 * 5 },
-                                                                       { "CD", 200 } });
+  std::vector<ImageChunk> tgt_chunks = ConstructImageChunks(file_content, { { "a", 100 },
+                                                                            { "b", 4096 * 2 },
+                                                                            { "c", 4096 * 3 },
+                                                                            { "d", 300 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 4096 * 5 },
+                                                                            { "CD", 200 } });
   tgt_image.Initialize(std::move(tgt_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 82520));
 
   tgt_image.DumpChunks();
 
   ZipModeImage src_image(true, 4096 * 10);
-  std::vector<ImageChunk> src_chunks = ConstructImageChunks(content, { { "b", 4096 * 3 },
-                                                                       { "c-0", 4096 * 10 },
-                                                                       { "c-1", 4096 * 2 },
-                                                                       { "a", 4096 * 5 },
-                                                                       { "e-0", 4096 * 10 },
-                                                                       { "e-1", 10000 },
-                                                                       { "CD", 5000 } });
+  std::vector<ImageChunk> src_chunks = ConstructImageChunks(file_content, { { "b", 4096 * 3 },
+                                                                            { "c-0", 4096 * 10 },
+                                                                            { "c-1", 4096 * 2 },
+                                                                            { "a", 4096 * 5 },
+                                                                            { "e-0", 4096 * 10 },
+                                                                            { "e-1", 10000 },
+                                                                            { "CD", 5000 } });
   src_image.Initialize(std::move(src_chunks),
                        std::vector<uint8_t>(content.begin(), content.begin() + 137880));
 
@@ -885,6 +923,215 @@ TEST(ImgdiffTest, zip_mode_deflate_large_apk) {
   GenerateAndCheckSplitTarget(debug_dir.path, 5, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_threads) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // The patches and the split info don't depend on the number of threads.
+  std::string patches[2];
+  std::string split_patches[2];
+  std::string split_infos[2];
+  const char* threads[2] = { "--threads=1", "--threads=4" };
+  for (size_t i = 0; i < 2; i++) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", "-z", threads[i], src_path.c_str(), tgt_path.c_str(), patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patches[i]));
+
+    TemporaryFile split_patch_file;
+    TemporaryFile split_info_file;
+    std::string split_info_arg =
+        android::base::StringPrintf("--split-info=%s", split_info_file.path);
+    std::vector<const char*> split_args = {
+      "imgdiff", "-z", threads[i], "--block-limit=10", split_info_arg.c_str(),
+      src_path.c_str(), tgt_path.c_str(), split_patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(split_args.size(), split_args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(split_patch_file.path, &split_patches[i]));
+    ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_infos[i]));
+  }
+  ASSERT_EQ(patches[0], patches[1]);
+  ASSERT_EQ(split_patches[0], split_patches[1]);
+  ASSERT_EQ(split_infos[0], split_infos[1]);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  verify_patched_image(src, patches[1], tgt);
+
+  // Invalid number of threads.
+  std::vector<const char*> args = {
+    "imgdiff", "-z", "--threads=0", src_path.c_str(), tgt_path.c_str(), "/dev/null",
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffTest, zip_mode_sa_cache_dir) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // The first run with the cache dir saves the suffix arrays, and the second one maps them. Neither
+  // should change the patch.
+  TemporaryDir sa_cache_dir;
+  std::string sa_cache_arg = android::base::StringPrintf("--sa-cache-dir=%s", sa_cache_dir.path);
+  std::string patches[3];
+  for (size_t i = 0; i < 3; i++) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+    };
+    if (i > 0) {
+      args.insert(args.begin() + 2, sa_cache_arg.c_str());
+    }
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patches[i]));
+  }
+  ASSERT_EQ(patches[0], patches[1]);
+  ASSERT_EQ(patches[0], patches[2]);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  verify_patched_image(src, patches[2], tgt);
+}
+
+static std::vector<std::string> ListSuffixArrays(const std::string& dir_path) {
+  std::vector<std::string> files;
+  std::unique_ptr<DIR, decltype(&closedir)> dir(opendir(dir_path.c_str()), closedir);
+  dirent* de;
+  while (dir && (de = readdir(dir.get())) != nullptr) {
+    if (android::base::EndsWith(de->d_name, ".sa")) {
+      files.push_back(de->d_name);
+    }
+  }
+  return files;
+}
+
+TEST(ImgdiffTest, image_mode_sa_cache_size) {
+  // Use two letters only, so that many suffixes are prefixes of one another; the cached suffix
+  // arrays must give the same matches as the ones of bsdiff.
+  auto generator = []() { return 'a' + rand() % 2; };
+  std::string srcs[2];
+  for (auto& src : srcs) {
+    generate_n(back_inserter(src), 65536, generator);
+  }
+  std::string tgt = srcs[0].substr(1000) + srcs[1].substr(0, 4096) + srcs[0].substr(0, 1000);
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryDir sa_cache_dir;
+  std::string sa_cache_arg = android::base::StringPrintf("--sa-cache-dir=%s", sa_cache_dir.path);
+  auto generate_patch = [&](const std::string& src, const std::vector<const char*>& options,
+                            std::string* patch) {
+    TemporaryFile src_file;
+    ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+    TemporaryFile patch_file;
+    std::vector<const char*> args = { "imgdiff" };
+    args.insert(args.end(), options.begin(), options.end());
+    args.insert(args.end(), { src_file.path, tgt_file.path, patch_file.path });
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, patch));
+  };
+
+  std::string patch;
+  generate_patch(srcs[0], {}, &patch);
+  for (size_t i = 0; i < 2; i++) {
+    std::string cached_patch;
+    generate_patch(srcs[0], { sa_cache_arg.c_str() }, &cached_patch);
+    ASSERT_EQ(patch, cached_patch);
+  }
+  std::vector<std::string> files = ListSuffixArrays(sa_cache_dir.path);
+  ASSERT_EQ(1U, files.size());
+  verify_patched_image(srcs[0], patch, tgt);
+
+  // The suffix array of the first source doesn't fit next to the one of the second.
+  std::string patch2;
+  generate_patch(srcs[1], { sa_cache_arg.c_str(), "--sa-cache-size=0" }, &patch2);
+  std::vector<std::string> files2 = ListSuffixArrays(sa_cache_dir.path);
+  ASSERT_EQ(1U, files2.size());
+  ASSERT_NE(files[0], files2[0]);
+  verify_patched_image(srcs[1], patch2, tgt);
+
+  // Invalid cache size.
+  std::vector<const char*> args = {
+    "imgdiff", sa_cache_arg.c_str(), "--sa-cache-size=-1", tgt_file.path, tgt_file.path,
+    "/dev/null",
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffTest, zip_mode_deflate_cache) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  TemporaryDir cache_dir;
+  std::string cache_file = android::base::StringPrintf("%s/deflate_cache", cache_dir.path);
+  std::string cache_arg = "--deflate-cache=" + cache_file;
+  auto generate_patch = [&](bool use_cache, std::string* patch) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+    };
+    if (use_cache) {
+      args.insert(args.begin() + 2, cache_arg.c_str());
+    }
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, patch));
+  };
+
+  // The first run with the cache saves the probed parameters, and the second one loads them.
+  // Neither should change the patch.
+  std::string patches[3];
+  for (size_t i = 0; i < 3; i++) {
+    generate_patch(i > 0, &patches[i]);
+  }
+  ASSERT_EQ(patches[0], patches[1]);
+  ASSERT_EQ(patches[0], patches[2]);
+
+  std::string cache;
+  ASSERT_TRUE(android::base::ReadFileToString(cache_file, &cache));
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(cache), "\n");
+  ASSERT_LT(1U, lines.size());
+
+  // The cached parameters are used without probing again; mark all the chunks as not
+  // reconstructible, which turns them into normal chunks in the patch.
+  std::string no_deflate_cache = lines[0] + "\n";
+  for (size_t i = 1; i < lines.size(); i++) {
+    no_deflate_cache += android::base::Split(lines[i], " ")[0] + " 0\n";
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(no_deflate_cache, cache_file));
+  std::string patch;
+  generate_patch(true, &patch);
+  ASSERT_NE(patches[0], patch);
+
+  // A cached level is only a hint, which is checked before use; the chunks that it doesn't
+  // reproduce are probed again.
+  std::string level_1_cache = lines[0] + "\n";
+  for (size_t i = 1; i < lines.size(); i++) {
+    level_1_cache += android::base::Split(lines[i], " ")[0] + " 1\n";
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(level_1_cache, cache_file));
+  std::string reprobed_patch;
+  generate_patch(true, &reprobed_patch);
+  size_t num_deflate;
+  verify_patch_header(patches[0], nullptr, nullptr, &num_deflate);
+  size_t reprobed_num_deflate;
+  verify_patch_header(reprobed_patch, nullptr, nullptr, &reprobed_num_deflate);
+  ASSERT_EQ(num_deflate, reprobed_num_deflate);
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  verify_patched_image(src, patches[0], tgt);
+  verify_patched_image(src, patch, tgt);
+  verify_patched_image(src, reprobed_patch, tgt);
+}
+
 TEST(ImgdiffTest, zip_mode_no_match_source) {
   // Generate 20 blocks of random data.
   std::string random_data;
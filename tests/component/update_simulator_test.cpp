@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ftw.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_writer.h>
+
+#include "otautil/print_sha1.h"
+#include "updater/update_simulator.h"
+
+static void BuildUpdatePackage(const std::map<std::string, std::string>& entries, int fd) {
+  FILE* zip_file_ptr = fdopen(fd, "wb");
+  ZipWriter zip_writer(zip_file_ptr);
+
+  for (const auto& entry : entries) {
+    ASSERT_EQ(0, zip_writer.StartEntry(entry.first.c_str(), 0));
+    if (!entry.second.empty()) {
+      ASSERT_EQ(0, zip_writer.WriteBytes(entry.second.data(), entry.second.size()));
+    }
+    ASSERT_EQ(0, zip_writer.FinishEntry());
+  }
+
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+}
+
+static std::string get_sha1(const std::string& content) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(content.c_str()), content.size(), digest);
+  return print_sha1(digest);
+}
+
+// Removes what update_simulator leaves in the work directory, i.e. the target image, the profiles
+// and the stash directory, but keeps the directory itself for TemporaryDir to clean up.
+static void CleanUpWorkDir(const std::string& work_dir) {
+  nftw(work_dir.c_str(),
+       [](const char* path, const struct stat*, int, struct FTW* ftwbuf) {
+         return ftwbuf->level == 0 ? 0 : remove(path);
+       },
+       4, FTW_DEPTH | FTW_PHYS);
+}
+
+class UpdateSimulatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Move the first block to the second one, and fill the first block with the new data.
+    src_content_ = std::string(4096, 'a') + std::string(4096, 'c');
+    tgt_content_ = std::string(4096, 'b') + std::string(4096, 'a');
+    std::vector<std::string> transfer_list = {
+      "4",
+      "2",
+      "0",
+      "0",
+      "move " + get_sha1(std::string(4096, 'a')) + " 2,1,2 1 2,0,1",
+      "new 2,0,1",
+    };
+    entries_ = {
+      { "system.new.dat", std::string(4096, 'b') },
+      { "system.patch.dat", "" },
+      { "system.transfer.list", android::base::Join(transfer_list, '\n') },
+    };
+    ASSERT_TRUE(android::base::WriteStringToFile(src_content_, src_file_.path));
+  }
+
+  void TearDown() override {
+    CleanUpWorkDir(work_dir_.path);
+  }
+
+  int RunSimulator(const std::map<std::string, std::string>& entries,
+                   const std::vector<std::string>& options) {
+    TemporaryFile zip_file;
+    BuildUpdatePackage(entries, zip_file.release());
+
+    std::string work_dir_arg = std::string("--work_dir=") + work_dir_.path;
+    std::vector<const char*> args = { "update_simulator", work_dir_arg.c_str() };
+    for (const auto& option : options) {
+      args.push_back(option.c_str());
+    }
+    args.push_back(zip_file.path);
+    args.push_back(src_file_.path);
+    return update_simulator(args.size(), args.data());
+  }
+
+  std::string src_content_;
+  std::string tgt_content_;
+  std::map<std::string, std::string> entries_;
+  TemporaryFile src_file_;
+  TemporaryDir work_dir_;
+};
+
+TEST_F(UpdateSimulatorTest, block_image_update) {
+  ASSERT_EQ(0, RunSimulator(entries_, {}));
+
+  // The update goes to a copy of the source image in the work directory.
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(work_dir_.path) + "/system.img",
+                                              &updated_content));
+  ASSERT_EQ(tgt_content_, updated_content);
+  std::string src_content;
+  ASSERT_TRUE(android::base::ReadFileToString(src_file_.path, &src_content));
+  ASSERT_EQ(src_content_, src_content);
+
+  // A successful update removes the last_command_file from the work directory.
+  ASSERT_EQ(-1, access(std::string(work_dir_.path).append("/last_command").c_str(), F_OK));
+}
+
+TEST_F(UpdateSimulatorTest, block_image_update_repeated) {
+  // Each run starts from the source image, so the results don't depend on the earlier runs.
+  for (size_t i = 0; i < 2; i++) {
+    ASSERT_EQ(0, RunSimulator(entries_, { "--verify" }));
+    std::string updated_content;
+    ASSERT_TRUE(android::base::ReadFileToString(std::string(work_dir_.path) + "/system.img",
+                                                &updated_content));
+    ASSERT_EQ(tgt_content_, updated_content);
+  }
+}
+
+TEST_F(UpdateSimulatorTest, partition) {
+  std::map<std::string, std::string> entries;
+  for (const auto& entry : entries_) {
+    entries.emplace("vendor" + entry.first.substr(entry.first.find('.')), entry.second);
+  }
+  ASSERT_EQ(1, RunSimulator(entries, {}));
+  ASSERT_EQ(0, RunSimulator(entries, { "--partition=vendor" }));
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(std::string(work_dir_.path) + "/vendor.img",
+                                              &updated_content));
+  ASSERT_EQ(tgt_content_, updated_content);
+}
+
+TEST_F(UpdateSimulatorTest, source_mismatch) {
+  // The move fails on a source image that doesn't match the transfer list.
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(8192, 'd'), src_file_.path));
+  ASSERT_EQ(1, RunSimulator(entries_, {}));
+  ASSERT_EQ(1, RunSimulator(entries_, { "--verify" }));
+}
+
+TEST_F(UpdateSimulatorTest, invalid_args) {
+  std::vector<const char*> args = { "update_simulator", "--foo" };
+  ASSERT_EQ(1, update_simulator(args.size(), args.data()));
+
+  args = { "update_simulator", src_file_.path };
+  ASSERT_EQ(1, update_simulator(args.size(), args.data()));
+}
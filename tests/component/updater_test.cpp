@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -21,6 +22,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -34,9 +36,13 @@
 #include <bootloader_message/bootloader_message.h>
 #include <brotli/encode.h>
 #include <bsdiff/bsdiff.h>
+#include <fec/io.h>
 #include <gtest/gtest.h>
+#include <lz4.h>
+#include <lz4frame.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_writer.h>
+#include <zstd.h>
 
 #include "common/test_constants.h"
 #include "edify/expr.h"
@@ -44,6 +50,8 @@
 #include "otautil/cache_location.h"
 #include "otautil/error_code.h"
 #include "otautil/print_sha1.h"
+#include "otautil/rangeset.h"
+#include "private/blockimg.h"
 #include "updater/blockimg.h"
 #include "updater/install.h"
 #include "updater/updater.h"
@@ -115,11 +123,18 @@ class UpdaterTest : public ::testing::Test {
     CacheLocation::location().set_cache_temp_source(temp_saved_source_.path);
     CacheLocation::location().set_last_command_file(temp_last_command_.path);
     CacheLocation::location().set_stash_directory_base(temp_stash_base_.path);
+    CacheLocation::location().set_profile_directory(temp_profile_dir_.path);
+  }
+
+  virtual void TearDown() override {
+    // Restore the checkpoint interval that a failed test may have left behind.
+    SetNewDataCheckpointInterval(NEW_DATA_CHECKPOINT_BYTES);
   }
 
   TemporaryFile temp_saved_source_;
   TemporaryFile temp_last_command_;
   TemporaryDir temp_stash_base_;
+  TemporaryDir temp_profile_dir_;
 };
 
 TEST_F(UpdaterTest, getprop) {
@@ -932,6 +947,184 @@ TEST_F(UpdaterTest, brotli_new_data) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, brotli_new_data_over_write) {
+  // Encode 2 blocks of new data for a single block of target.
+  std::string new_data(4096 * 2, 'a');
+  size_t encoded_size = BrotliEncoderMaxCompressedSize(new_data.size());
+  std::string encoded_data(encoded_size, 0);
+  ASSERT_TRUE(BrotliEncoderCompress(
+      BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE, new_data.size(),
+      reinterpret_cast<const uint8_t*>(new_data.data()), &encoded_size,
+      reinterpret_cast<uint8_t*>(const_cast<char*>(encoded_data.data()))));
+  encoded_data.resize(encoded_size);
+
+  std::vector<std::string> transfer_list = {
+    "4", "1", "0", "0", "new 2,0,1",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new.dat.br", std::move(encoded_data) },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wb");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  // The excess output of the decoder fails the update, rather than being silently dropped.
+  TemporaryFile update_file;
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new.dat.br", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+// Writes |new_data| (100 blocks) through the new commands, with the new data stored in the package
+// as |new_data_entry| in its |encoded_data| form.
+static void VerifyCompressedNewData(const std::string& new_data_entry,
+                                    const std::string& encoded_data, const std::string& new_data) {
+  // Same as in brotli_new_data, mix small and large chunks to catch potential short writes.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "100",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 2,1,2",
+    "new 4,2,50,50,97",
+    "new 2,97,98",
+    "new 2,98,99",
+    "new 2,99,100",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { new_data_entry, encoded_data },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wb");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  std::string script_new_data = "block_image_update(\"" + std::string(update_file.path) +
+                                R"(", package_extract_file("transfer_list"), ")" +
+                                new_data_entry + R"(", "patch_data"))";
+  expect("t", script_new_data.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(new_data, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, zstd_new_data) {
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 100, generator);
+
+  std::string encoded_data(ZSTD_compressBound(new_data.size()), '\0');
+  size_t encoded_size = ZSTD_compress(&encoded_data[0], encoded_data.size(), new_data.data(),
+                                      new_data.size(), ZSTD_CLEVEL_DEFAULT);
+  ASSERT_FALSE(ZSTD_isError(encoded_size));
+  encoded_data.resize(encoded_size);
+
+  VerifyCompressedNewData("new.dat.zst", encoded_data, new_data);
+}
+
+TEST_F(UpdaterTest, lz4_new_data) {
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 100, generator);
+
+  std::string encoded_data(LZ4F_compressFrameBound(new_data.size(), nullptr), '\0');
+  size_t encoded_size = LZ4F_compressFrame(&encoded_data[0], encoded_data.size(), new_data.data(),
+                                           new_data.size(), nullptr);
+  ASSERT_FALSE(LZ4F_isError(encoded_size));
+  encoded_data.resize(encoded_size);
+
+  VerifyCompressedNewData("new.dat.lz4", encoded_data, new_data);
+}
+
+// Packs |new_data| into the framed new data format, with each frame compressed by |compress|.
+static std::string BuildFramedNewData(
+    const std::string& new_data, uint32_t codec, size_t frame_size,
+    const std::function<std::string(const std::string&)>& compress) {
+  std::vector<std::string> frames;
+  for (size_t offset = 0; offset < new_data.size(); offset += frame_size) {
+    frames.push_back(compress(new_data.substr(offset, frame_size)));
+  }
+
+  auto append = [](std::string* out, auto value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  std::string framed = "NEWFRAME";
+  append(&framed, static_cast<uint32_t>(1));
+  append(&framed, codec);
+  append(&framed, static_cast<uint32_t>(frame_size));
+  append(&framed, static_cast<uint32_t>(frames.size()));
+  append(&framed, static_cast<uint64_t>(new_data.size()));
+  for (const auto& frame : frames) {
+    append(&framed, static_cast<uint32_t>(frame.size()));
+  }
+  for (const auto& frame : frames) {
+    framed += frame;
+  }
+  return framed;
+}
+
+TEST_F(UpdaterTest, framed_new_data) {
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 100, generator);
+
+  // Frames that don't line up with the blocks nor with the new commands, and a shorter last frame.
+  std::string zstd_framed =
+      BuildFramedNewData(new_data, 2, 4096 * 3 + 100, [](const std::string& frame) {
+        std::string encoded(ZSTD_compressBound(frame.size()), '\0');
+        encoded.resize(ZSTD_compress(&encoded[0], encoded.size(), frame.data(), frame.size(),
+                                     ZSTD_CLEVEL_DEFAULT));
+        return encoded;
+      });
+  VerifyCompressedNewData("new.dat.frames", zstd_framed, new_data);
+
+  std::string lz4_framed = BuildFramedNewData(new_data, 3, 65536, [](const std::string& frame) {
+    std::string encoded(LZ4_compressBound(frame.size()), '\0');
+    encoded.resize(
+        LZ4_compress_default(frame.data(), &encoded[0], frame.size(), encoded.size()));
+    return encoded;
+  });
+  VerifyCompressedNewData("new.dat.frames", lz4_framed, new_data);
+}
+
 TEST_F(UpdaterTest, last_command_update) {
   std::string last_command_file = CacheLocation::location().last_command_file();
 
@@ -1019,6 +1212,89 @@ TEST_F(UpdaterTest, last_command_update) {
   CloseArchive(handle);
 }
 
+TEST_F(UpdaterTest, last_command_update_batched) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block1_hash = get_sha1(block1);
+  std::string block2_hash = get_sha1(block2);
+
+  // Stashing block1 again after freeing it is checkpointed right away, while the stash of block2
+  // is batched. The second 'move' overwrites the source of the stashes, which makes them durable.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "2",
+    "stash " + block1_hash + " 2,0,1",
+    "free " + block1_hash,
+    "stash " + block1_hash + " 2,0,1",
+    "stash " + block2_hash + " 2,1,2",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+  };
+  std::vector<std::string> transfer_list_fail = transfer_list;
+  transfer_list_fail.push_back("fail");
+  std::vector<std::string> transfer_list_continue = transfer_list;
+  transfer_list_continue.push_back("move " + block2_hash + " 2,2,3 1 - " + block2_hash + ":2,0,1");
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list_fail", android::base::Join(transfer_list_fail, '\n') },
+    { "transfer_list_continue", android::base::Join(transfer_list_continue, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  std::string src_content = block1 + block2 + block3;
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script =
+      "block_image_update(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list_fail"), "new_data", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // The update resumes after the last stash command.
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file.c_str(), &last_command_content));
+  ASSERT_EQ("3\nstash " + block2_hash + " 2,1,2", last_command_content);
+  std::string updated_contents;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block3, updated_contents);
+
+  // The skipped stash commands have left their stashes on /cache for the last 'move'.
+  script = "block_image_update(\"" + std::string(update_file.path) +
+           R"(", package_extract_file("transfer_list_continue"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_contents));
+  ASSERT_EQ(block1 + block1 + block2, updated_contents);
+  ASSERT_EQ(-1, access(last_command_file.c_str(), R_OK));
+
+  // An update fails if it can't write a checkpoint.
+  TemporaryDir temp_dir;
+  CacheLocation::location().set_last_command_file(std::string(temp_dir.path) + "/x/last_command");
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
 TEST_F(UpdaterTest, last_command_update_unresumable) {
   std::string last_command_file = CacheLocation::location().last_command_file();
 
@@ -1145,3 +1421,982 @@ TEST_F(UpdaterTest, last_command_verify) {
   ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
   CloseArchive(handle);
 }
+
+TEST_F(UpdaterTest, block_image_update_prefetch_overlap) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block4 = std::string(4096, '4');
+  std::string block1_hash = get_sha1(block1);
+  std::string block4_hash = get_sha1(block4);
+
+  // The second move reads the block written by the first one, so it must not use the data read
+  // ahead of time. The third move doesn't depend on any earlier writes.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "0",
+    "0",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "move " + block4_hash + " 2,0,1 1 2,3,4",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4,
+                                               update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block4 + block1 + block1 + block4, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_verify_parallel) {
+  // The stash_map is shared by all the block_image_verify calls, so use the blocks that the other
+  // tests don't stash.
+  std::string block1 = std::string(4096, 'a');
+  std::string block2 = std::string(4096, 'b');
+  std::string block3 = std::string(4096, 'c');
+  std::string block4 = std::string(4096, 'd');
+  std::string block1_hash = get_sha1(block1);
+  std::string block3_hash = get_sha1(block3);
+  std::string block4_hash = get_sha1(block4);
+
+  // The commands after the first one are checked by the verify workers. The first move reads a
+  // stash, which is found in the source blocks of the stash command; the diff only needs its
+  // source blocks; and the second move has been done already.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "5",
+    "0",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + get_sha1(block2 + block1) + " 2,4,6 2 2,1,2 2,0,1 " + block1_hash + ":2,1,2",
+    "free " + block1_hash,
+    "bsdiff 0 0 " + block3_hash + " " + get_sha1(block1) + " 2,2,3 1 2,2,3",
+    "move " + block4_hash + " 2,3,4 1 2,3,4",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  std::string src_content = block1 + block2 + block3 + block4 + std::string(8192, '0');
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  std::string script = "block_image_verify(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // The verification fails once the source blocks of the diff don't match.
+  src_content = block1 + block2 + block2 + block4 + std::string(8192, '0');
+  ASSERT_TRUE(android::base::WriteStringToFile(src_content, update_file.path));
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_parallel_patch) {
+  std::vector<std::string> src_blocks = {
+    std::string(4096, 'a'), std::string(4096, 'b'), std::string(4096, 'c'), std::string(4096, 'd'),
+  };
+  std::vector<std::string> tgt_blocks = {
+    std::string(4096, 'w'), std::string(4096, 'x'), std::string(4096, 'y'), std::string(4096, 'z'),
+  };
+
+  // Generate the patches: a -> x, x -> y, d -> z and a -> w.
+  std::string patch_data;
+  std::vector<std::string> patch_args;
+  std::vector<std::pair<const std::string*, const std::string*>> patches = {
+    { &src_blocks[0], &tgt_blocks[1] },
+    { &tgt_blocks[1], &tgt_blocks[2] },
+    { &src_blocks[3], &tgt_blocks[3] },
+    { &src_blocks[0], &tgt_blocks[0] },
+  };
+  for (const auto& patch : patches) {
+    TemporaryFile patch_file;
+    ASSERT_EQ(0, bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(patch.first->data()),
+                                patch.first->size(),
+                                reinterpret_cast<const uint8_t*>(patch.second->data()),
+                                patch.second->size(), patch_file.path, nullptr));
+    std::string patch_content;
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch_content));
+    patch_args.push_back(android::base::StringPrintf("%zu %zu %s %s", patch_data.size(),
+                                                     patch_content.size(),
+                                                     get_sha1(*patch.first).c_str(),
+                                                     get_sha1(*patch.second).c_str()));
+    patch_data += patch_content;
+  }
+
+  // The second bsdiff reads the block written by the first one, and the last one reads the stash
+  // created by the first command. The third one doesn't depend on any earlier commands.
+  std::string stash_id = get_sha1(src_blocks[0]);
+  std::vector<std::string> transfer_list = {
+    "4",
+    "4",
+    "1",
+    "1",
+    "stash " + stash_id + " 2,0,1",
+    "bsdiff " + patch_args[0] + " 2,1,2 1 2,0,1",
+    "bsdiff " + patch_args[1] + " 2,2,3 1 2,1,2",
+    "bsdiff " + patch_args[2] + " 2,3,4 1 2,3,4",
+    "bsdiff " + patch_args[3] + " 2,0,1 1 - " + stash_id + ":2,0,1",
+    "free " + stash_id,
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", patch_data },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(android::base::Join(src_blocks, ""),
+                                               update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(android::base::Join(tgt_blocks, ""), updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_memory_stash_persist) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block1_hash = get_sha1(block1);
+  std::string block2_hash = get_sha1(block2);
+
+  // The move overwrites the source block of the stash, which must be written to the stash
+  // directory before the update fails.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "1",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block2_hash + " 2,0,1 1 2,1,2",
+    "fail",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block2 + block2, updated_content);
+
+  // The stash and the last command file allow the update to be resumed.
+  std::string stash_content;
+  std::string stash_file = std::string(temp_stash_base_.path) + "/" +
+                           get_sha1(update_file.path) + "/" + block1_hash;
+  ASSERT_TRUE(android::base::ReadFileToString(stash_file, &stash_content));
+  ASSERT_EQ(block1, stash_content);
+
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file.c_str(), &last_command_content));
+  EXPECT_EQ("0\nstash " + block1_hash + " 2,0,1", last_command_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, new_data_larger_than_ring) {
+  // Generate 3000 blocks of new data, which doesn't fit in the ring buffer of the new data thread
+  // at once.
+  std::string new_data;
+  new_data.reserve(4096 * 3000);
+  for (size_t i = 0; i < 3000; i++) {
+    new_data += std::string(4096, 'a' + i % 26);
+  }
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3000",
+    "0",
+    "0",
+    "new 2,0,1",
+    "new 2,1,1500",
+    "new 2,1500,2999",
+    "new 2,2999,3000",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", new_data },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(new_data, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_fragmented_target) {
+  std::string block_a = std::string(4096, 'a');
+  std::string block_b = std::string(4096, 'b');
+  std::string block_c = std::string(4096, 'c');
+  std::string block_x = std::string(4096, 'x');
+  std::string src_hash = get_sha1(block_a + block_b + block_c);
+
+  // The target ranges are adjacent on the device but out of order, so they're written with a
+  // single vectored write in a different order than the source data.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "0",
+    "0",
+    "move " + src_hash + " 6,5,6,3,4,4,5 3 2,0,3",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      block_a + block_b + block_c + block_x + block_x + block_x, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated_content;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated_content));
+  ASSERT_EQ(block_a + block_b + block_c + block_b + block_c + block_a, updated_content);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_profile) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block1_hash = get_sha1(block1);
+
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+    "zero 2,0,1",
+    "zero 2,1,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  // Build the update package.
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  // Set up the handler, command_pipe, patch offset & length.
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string verify_script =
+      "block_image_verify(\"" + std::string(update_file.path) +
+      R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", verify_script.c_str(), kNoCause, &updater_info);
+
+  // block_image_verify doesn't write a profile.
+  std::string partition = android::base::Basename(update_file.path);
+  ASSERT_EQ(-1, access((std::string(temp_profile_dir_.path) + "/block_image_verify_profile_" +
+                        partition + ".csv")
+                           .c_str(),
+                       F_OK));
+
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  // Expect one line per command type after the header, in the order of the names.
+  std::string profile_file = std::string(temp_profile_dir_.path) + "/block_image_update_profile_" +
+                             partition + ".csv";
+  std::string profile_content;
+  ASSERT_TRUE(android::base::ReadFileToString(profile_file, &profile_content));
+  std::vector<std::string> lines =
+      android::base::Split(android::base::Trim(profile_content), "\n");
+  ASSERT_EQ(5u, lines.size());
+  ASSERT_TRUE(android::base::StartsWith(lines[0], "command,count,total_ms,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[1], "free,1,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[2], "move,1,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[3], "stash,1,"));
+  ASSERT_TRUE(android::base::StartsWith(lines[4], "zero,2,"));
+
+  // The move writes one block, and the zeros write one block each.
+  std::vector<std::string> move_fields = android::base::Split(lines[2], ",");
+  ASSERT_EQ("1", move_fields[move_fields.size() - 2]);
+  std::vector<std::string> zero_fields = android::base::Split(lines[4], ",");
+  ASSERT_EQ("2", zero_fields[zero_fields.size() - 2]);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_parallel) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block1_hash = get_sha1(block1);
+
+  // The first partition moves a block through a stash, and the second one writes new data.
+  std::vector<std::string> transfer_list_move = {
+    "4",
+    "1",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 - " + block1_hash + ":2,0,1",
+    "free " + block1_hash,
+  };
+  std::vector<std::string> transfer_list_new = {
+    "4", "2", "0", "0", "new 2,0,2",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data_move", "" },
+    { "new_data_new", block2 + block1 },
+    { "patch_data", "" },
+    { "transfer_list_move", android::base::Join(transfer_list_move, '\n') },
+    { "transfer_list_new", android::base::Join(transfer_list_new, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file_move;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file_move.path));
+  TemporaryFile update_file_new;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block1, update_file_new.path));
+
+  std::string args_move = "\"" + std::string(update_file_move.path) +
+                          R"(", package_extract_file("transfer_list_move"), "new_data_move", )"
+                          R"("patch_data")";
+  std::string args_new = "\"" + std::string(update_file_new.path) +
+                         R"(", package_extract_file("transfer_list_new"), "new_data_new", )"
+                         R"("patch_data")";
+  std::string script = "block_image_update_parallel(" + args_move + ", " + args_new + ")";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file_move.path, &updated));
+  ASSERT_EQ(block1 + block1, updated);
+  ASSERT_TRUE(android::base::ReadFileToString(update_file_new.path, &updated));
+  ASSERT_EQ(block2 + block1, updated);
+
+  // The progress covers the blocks of both partitions.
+  std::string cmd_pipe_content;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_pipe.path, &cmd_pipe_content));
+  std::vector<std::string> progress_lines;
+  for (const auto& line : android::base::Split(cmd_pipe_content, "\n")) {
+    if (android::base::StartsWith(line, "set_progress ")) {
+      progress_lines.push_back(line);
+    }
+  }
+  ASSERT_FALSE(progress_lines.empty());
+  ASSERT_EQ("set_progress 1.0000", progress_lines.back());
+
+  // The same partition can't be updated twice at the same time.
+  updater_info.cmd_pipe = fopen(temp_pipe.path, "wbe");
+  script = "block_image_update_parallel(" + args_new + ", " + args_new + ")";
+  expect("", script.c_str(), kArgsParsingFailure, &updater_info);
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_parallel_resume) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block2_hash = get_sha1(block2);
+
+  // The first update of the first partition is interrupted after the stash command.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "2",
+    "0",
+    "1",
+    "move " + block2_hash + " 2,0,1 1 2,1,2",
+    "stash " + block2_hash + " 2,1,2",
+    "new 2,1,2",
+    "free " + block2_hash,
+  };
+  std::vector<std::string> transfer_list_fail(transfer_list.begin(), transfer_list.begin() + 6);
+  transfer_list_fail.push_back("fail");
+  std::vector<std::string> transfer_list_new = {
+    "4", "1", "0", "0", "new 2,0,1",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", block3 },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+    { "transfer_list_fail", android::base::Join(transfer_list_fail, '\n') },
+    { "transfer_list_new", android::base::Join(transfer_list_new, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  TemporaryFile update_file_new;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1, update_file_new.path));
+
+  std::string args_fail = "\"" + std::string(update_file.path) +
+                          R"(", package_extract_file("transfer_list_fail"), "new_data", )"
+                          R"("patch_data")";
+  std::string args_new = "\"" + std::string(update_file_new.path) +
+                         R"(", package_extract_file("transfer_list_new"), "new_data", )"
+                         R"("patch_data")";
+  std::string script = "block_image_update_parallel(" + args_fail + ", " + args_new + ")";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // Only the interrupted partition has its own last_command_file left.
+  std::string last_command_file = CacheLocation::location().last_command_file() + "_" +
+                                  android::base::Basename(update_file.path);
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file, &last_command_content));
+  ASSERT_EQ("1\nstash " + block2_hash + " 2,1,2", last_command_content);
+  std::string last_command_file_new = CacheLocation::location().last_command_file() + "_" +
+                                      android::base::Basename(update_file_new.path);
+  ASSERT_EQ(-1, access(last_command_file_new.c_str(), R_OK));
+
+  // Once the partition has been restored, block_image_verify() finds that the commands before the
+  // saved index haven't been executed, and drops the last_command_file of the partition.
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2, update_file.path));
+  std::string args = "\"" + std::string(update_file.path) +
+                     R"(", package_extract_file("transfer_list"), "new_data", "patch_data")";
+  script = "block_image_verify(" + args + ")";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  ASSERT_EQ(-1, access(last_command_file.c_str(), R_OK));
+
+  // So the update starts over.
+  script = "block_image_update_parallel(" + args + ", " + args_new + ")";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(block2 + block3, updated);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_recover_parallel) {
+  // An image without the verity metadata reads through libfec as is. Its data area ends in the
+  // middle of block 9, and the blocks after it stand for the metadata.
+  auto generator = []() { return rand() % 128; };
+  std::string image;
+  generate_n(back_inserter(image), 4096 * 12, generator);
+  TemporaryFile image_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(image, image_file.path));
+
+  fec::io fh(image_file.path, O_RDWR);
+  ASSERT_TRUE(fh);
+  RecoverStats stats;
+  std::string err;
+  ASSERT_TRUE(RecoverBlockImage(image_file.path, fh, 4096 * 9 + 100,
+                                RangeSet({ { 0, 3 }, { 5, 12 } }), &stats, &err))
+      << err;
+  // The partial block at the end of the data area is read as well.
+  ASSERT_EQ(8u, stats.blocks);
+  ASSERT_EQ(0u, stats.corrected);
+
+  std::string recovered;
+  ASSERT_TRUE(android::base::ReadFileToString(image_file.path, &recovered));
+  ASSERT_EQ(image, recovered);
+
+  // The ranges past the data area are left alone.
+  stats = {};
+  ASSERT_TRUE(RecoverBlockImage(image_file.path, fh, 4096 * 9 + 100, RangeSet({ { 10, 12 } }),
+                                &stats, &err));
+  ASSERT_EQ(0u, stats.blocks);
+}
+
+TEST_F(UpdaterTest, block_image_update_zero) {
+  std::string block1 = std::string(4096, '1');
+  std::string zeros = std::string(4096, '\0');
+
+  // Zero a block in the middle and two blocks past the end of the file, which needs to be
+  // extended by the zeroing.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "0",
+    "0",
+    "zero 4,1,2,3,5",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block1 + block1, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(block1 + zeros + block1 + zeros + zeros, updated);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_block_cache) {
+  std::string block1 = std::string(4096, '1');
+  std::string block2 = std::string(4096, '2');
+  std::string block3 = std::string(4096, '3');
+  std::string block4 = std::string(4096, '4');
+  std::string block1_hash = get_sha1(block1);
+  std::string block4_hash = get_sha1(block4);
+
+  // The first move reads the block that has just been stashed, and the second one reads the block
+  // written by the first move. Once block 0 is overwritten, it must be verified again instead of
+  // being taken as the previously verified contents, so the last move fails.
+  std::vector<std::string> transfer_list = {
+    "4",
+    "3",
+    "1",
+    "1",
+    "stash " + block1_hash + " 2,0,1",
+    "move " + block1_hash + " 2,1,2 1 2,0,1",
+    "free " + block1_hash,
+    "move " + block1_hash + " 2,2,3 1 2,1,2",
+    "move " + block4_hash + " 2,0,1 1 2,3,4",
+    "move " + block1_hash + " 2,3,4 1 2,0,1",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(block1 + block2 + block3 + block4,
+                                               update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(block4 + block1 + block1 + block4, updated);
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, block_image_update_move_in_chunks) {
+  // Moves larger than the memory budget are copied in chunks. Shifting the blocks by one block
+  // needs to be copied from the end, and shifting them back from the start.
+  constexpr size_t kBlocks = 4200;
+  std::string content;
+  for (size_t i = 0; i <= kBlocks; i++) {
+    std::string block(4096, static_cast<char>('a' + i % 26));
+    std::string id = std::to_string(i);
+    content += block.replace(0, id.size(), id);
+  }
+  std::string hash = get_sha1(content.substr(0, kBlocks * 4096));
+  std::vector<std::string> transfer_list = {
+    "4",
+    std::to_string(kBlocks * 2),
+    "0",
+    std::to_string(kBlocks),
+    "move " + hash + " 2,1,4201 4200 2,0,4200",
+    "move " + hash + " 2,0,4200 4200 2,1,4201",
+  };
+
+  std::unordered_map<std::string, std::string> entries = {
+    { "new_data", "" },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(content, update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(content.substr(0, kBlocks * 4096) + content.substr((kBlocks - 1) * 4096, 4096),
+            updated);
+
+  // The stashes of the overlapping source blocks have been freed.
+  std::string stash_base = std::string(temp_stash_base_.path) + "/" + get_sha1(update_file.path);
+  ASSERT_EQ(-1, access((stash_base + "/" + hash).c_str(), F_OK));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
+
+TEST_F(UpdaterTest, new_data_resume) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 6, generator);
+  std::string written(4096 * 4, 'w');
+
+  // The first command and half of the second one have been written by an interrupted update, as
+  // recorded in the last_command_file and the progress of the new data.
+  std::vector<std::string> transfer_list = {
+    "4", "6", "0", "0", "new 2,0,2", "new 2,2,6",
+  };
+
+  for (const auto& [entry, encoded] : std::vector<std::pair<std::string, std::string>>{
+           { "new.dat", new_data },
+           { "new.dat.frames",
+             BuildFramedNewData(new_data, 0, 4096 * 3, [](const std::string& f) { return f; }) },
+       }) {
+    std::unordered_map<std::string, std::string> entries = {
+      { entry, encoded },
+      { "patch_data", "" },
+      { "transfer_list", android::base::Join(transfer_list, '\n') },
+    };
+
+    TemporaryFile zip_file;
+    BuildUpdatePackage(entries, zip_file.release());
+
+    MemMapping map;
+    ASSERT_TRUE(map.MapFile(zip_file.path));
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+    UpdaterInfo updater_info;
+    updater_info.package_zip = handle;
+    TemporaryFile temp_pipe;
+    updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+    updater_info.package_zip_addr = map.addr;
+    updater_info.package_zip_len = map.length;
+
+    ASSERT_TRUE(android::base::WriteStringToFile("0\nnew 2,0,2", last_command_file));
+    ASSERT_TRUE(android::base::WriteStringToFile("1\n8192", last_command_file + ".new"));
+
+    // Only the rest of the second command is written, with the data that follows.
+    TemporaryFile update_file;
+    ASSERT_TRUE(android::base::WriteStringToFile(written, update_file.path));
+    std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                         R"(", package_extract_file("transfer_list"), ")" + entry +
+                         R"(", "patch_data"))";
+    expect("t", script.c_str(), kNoCause, &updater_info);
+
+    std::string updated;
+    ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+    ASSERT_EQ(written + new_data.substr(4096 * 4), updated);
+    ASSERT_EQ(-1, access(last_command_file.c_str(), R_OK));
+    ASSERT_EQ(-1, access((last_command_file + ".new").c_str(), R_OK));
+
+    ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+    CloseArchive(handle);
+  }
+}
+
+TEST_F(UpdaterTest, new_data_checkpoint) {
+  std::string last_command_file = CacheLocation::location().last_command_file();
+
+  auto generator = []() { return rand() % 128; };
+  std::string new_data;
+  generate_n(back_inserter(new_data), 4096 * 6, generator);
+
+  std::vector<std::string> transfer_list = {
+    "4", "6", "0", "0", "new 2,0,2", "new 2,2,6",
+  };
+
+  // The first package is cut off in the middle of the second command.
+  std::unordered_map<std::string, std::string> entries = {
+    { "short_new_data", new_data.substr(0, 4096 * 3 + 100) },
+    { "new_data", new_data },
+    { "patch_data", "" },
+    { "transfer_list", android::base::Join(transfer_list, '\n') },
+  };
+
+  TemporaryFile zip_file;
+  BuildUpdatePackage(entries, zip_file.release());
+
+  MemMapping map;
+  ASSERT_TRUE(map.MapFile(zip_file.path));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(map.addr, map.length, zip_file.path, &handle));
+
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(temp_pipe.release(), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  // Record the progress after every block.
+  SetNewDataCheckpointInterval(4096);
+  ASSERT_EQ(0, unlink(last_command_file.c_str()));
+
+  TemporaryFile update_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(4096 * 6, 'w'), update_file.path));
+  std::string script = "block_image_update(\"" + std::string(update_file.path) +
+                       R"(", package_extract_file("transfer_list"), "short_new_data", )" +
+                       R"("patch_data"))";
+  expect("", script.c_str(), kNoCause, &updater_info);
+
+  // The first command and the complete block of the second one have been checkpointed.
+  std::string last_command_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file, &last_command_content));
+  ASSERT_EQ("0\nnew 2,0,2", last_command_content);
+  std::string progress_content;
+  ASSERT_TRUE(android::base::ReadFileToString(last_command_file + ".new", &progress_content));
+  ASSERT_EQ("1\n4096", progress_content);
+
+  // Clobber the checkpointed blocks, which must not be written again on resume.
+  std::string updated;
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(new_data.substr(0, 4096 * 3), updated.substr(0, 4096 * 3));
+  std::string written(4096 * 3, 'x');
+  ASSERT_TRUE(android::base::WriteStringToFile(written + updated.substr(4096 * 3),
+                                               update_file.path));
+
+  script = "block_image_update(\"" + std::string(update_file.path) +
+           R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  expect("t", script.c_str(), kNoCause, &updater_info);
+
+  ASSERT_TRUE(android::base::ReadFileToString(update_file.path, &updated));
+  ASSERT_EQ(written + new_data.substr(4096 * 3), updated);
+  ASSERT_EQ(-1, access(last_command_file.c_str(), R_OK));
+  ASSERT_EQ(-1, access((last_command_file + ".new").c_str(), R_OK));
+
+  ASSERT_EQ(0, fclose(updater_info.cmd_pipe));
+  CloseArchive(handle);
+}
@@ -18,6 +18,7 @@
 #include <sys/types.h>
 
 #include <limits>
+#include <string_view>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -50,6 +51,12 @@ TEST(RangeSetTest, Parse_smoke) {
   // Leading zeros are fine. But android::base::ParseUint() doesn't like trailing zeros like "10 ".
   ASSERT_EQ(rs, RangeSet::Parse(" 2, 1,   10"));
   ASSERT_FALSE(RangeSet::Parse("2,1,10 "));
+
+  // The text doesn't need to be null-terminated, e.g. a token in a transfer list line.
+  std::string_view line = "move abc 2,1,10 4,15,20,1,10";
+  ASSERT_EQ(rs, RangeSet::Parse(line.substr(9, 6)));
+  ASSERT_EQ(rs2, RangeSet::Parse(line.substr(16)));
+  ASSERT_FALSE(RangeSet::Parse(line.substr(9, 4)));
 }
 
 TEST(RangeSetTest, Parse_InvalidCases) {
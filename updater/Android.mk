@@ -48,6 +48,8 @@ updater_common_static_libraries := \
     libcutils \
     libtune2fs \
     libbrotli \
+    libzstd \
+    liblz4 \
     libziparchive \
     $(tune2fs_static_libraries)
 
@@ -139,3 +141,79 @@ inc :=
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+update_simulator_static_libraries := \
+    libapplypatch \
+    libbspatch \
+    libedify \
+    libotautil \
+    libotafault \
+    libziparchive \
+    libfec \
+    libfec_rs \
+    libext4_utils \
+    libsquashfs_utils \
+    libsparse \
+    libcrypto_utils \
+    libcrypto \
+    libbrotli \
+    libzstd \
+    liblz4 \
+    libbz \
+    libz \
+    libbase \
+    libutils \
+    libcutils \
+    liblog
+
+# libupdate_simulator (host static library)
+# ===============================
+# Replays the block image update of a partition from an OTA package against a source image on the
+# host, and reports the throughput, the peak memory and the time spent in each phase.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libupdate_simulator
+LOCAL_MODULE_HOST_OS := linux
+
+LOCAL_SRC_FILES := \
+    blockimg.cpp \
+    update_simulator.cpp
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/.. \
+    $(LOCAL_PATH)/include
+
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+
+LOCAL_EXPORT_C_INCLUDE_DIRS := \
+    $(LOCAL_PATH)/include
+
+LOCAL_STATIC_LIBRARIES := \
+    $(update_simulator_static_libraries)
+
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+# update_simulator (host executable)
+# ===============================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := update_simulator
+LOCAL_MODULE_HOST_OS := linux
+
+LOCAL_SRC_FILES := \
+    update_simulator_main.cpp
+
+LOCAL_C_INCLUDES := \
+    $(LOCAL_PATH)/include
+
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+
+LOCAL_STATIC_LIBRARIES := \
+    libupdate_simulator \
+    $(update_simulator_static_libraries)
+
+include $(BUILD_HOST_EXECUTABLE)
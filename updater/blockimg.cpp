@@ -19,6 +19,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -29,34 +31,53 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <limits>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <applypatch/applypatch.h>
 #include <brotli/decode.h>
+#include <lz4.h>
+#include <lz4frame.h>
 #include <openssl/sha.h>
 #include <private/android_filesystem_config.h>
 #include <ziparchive/zip_archive.h>
+#include <zstd.h>
 
 #include "edify/expr.h"
 #include "otafault/ota_io.h"
 #include "otautil/cache_location.h"
 #include "otautil/error_code.h"
+#include "otautil/parseint.h"
 #include "otautil/print_sha1.h"
 #include "otautil/rangeset.h"
+#include "private/blockimg.h"
 #include "updater/install.h"
 #include "updater/updater.h"
 
@@ -69,21 +90,202 @@ static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
 
-static CauseCode failure_type = kNoCause;
-static bool is_retry = false;
-static std::unordered_map<std::string, RangeSet> stash_map;
+// The number of upcoming transfer commands whose source blocks may be read ahead, and the maximum
+// amount of memory held by the read-ahead buffers.
+static constexpr size_t PREFETCH_MAX_COMMANDS = 16;
+static constexpr size_t PREFETCH_MAX_BYTES = 32 * 1024 * 1024;
+
+// The maximum number of threads to apply bsdiff/imgdiff patches ahead of time, the number of
+// upcoming commands they may work on, and the memory budget for their source and target buffers.
+static constexpr size_t PATCH_MAX_THREADS = 8;
+static constexpr size_t PATCH_MAX_COMMANDS = 32;
+static constexpr size_t PATCH_MAX_BYTES = 64 * 1024 * 1024;
+
+// How many upcoming commands the verify workers may check in verification mode, the memory budget
+// for the source data they assemble, and the number of blocks they hash at a time otherwise.
+static constexpr size_t VERIFY_MAX_COMMANDS = 64;
+static constexpr size_t VERIFY_MAX_BYTES = 64 * 1024 * 1024;
+static constexpr size_t VERIFY_CHUNK_BLOCKS = 256;
+
+// The memory budget for the source blocks that are kept for the later commands, and the number of
+// the recently verified source ranges that are remembered.
+static constexpr size_t BLOCK_CACHE_BYTES = 16 * 1024 * 1024;
+static constexpr size_t BLOCK_CACHE_MAX_VERIFIED = 64;
+
+// The default memory budget for the buffer of a single transfer command in MiB, which can be
+// overridden with the "ro.updater.command_memory_mb" property. A move whose source doesn't fit is
+// copied in chunks of up to MOVE_CHUNK_BLOCKS blocks.
+static constexpr size_t COMMAND_MEMORY_DEFAULT_MB = 16;
+static constexpr size_t MOVE_CHUNK_BLOCKS = 2048;
+
+// The default memory budget for the stashes in MiB, which can be overridden with the
+// "ro.updater.stash_memory_mb" property. Zero keeps all the stashes on /cache.
+static constexpr size_t STASH_MEMORY_DEFAULT_MB = 64;
+
+// The maximum number of threads to recover the blocks with libfec, and the number of blocks each
+// of them reads at a time. Every thread has its own libfec handle, which holds a copy of the verity
+// metadata; so only a few of them are used.
+static constexpr size_t RECOVER_MAX_THREADS = 4;
+static constexpr size_t RECOVER_BATCH_BLOCKS = 256;
+
+// How often a 'new' command records its progress; NEW_DATA_CHECKPOINT_BYTES unless the tests have
+// changed it with SetNewDataCheckpointInterval().
+static size_t new_data_checkpoint_bytes = NEW_DATA_CHECKPOINT_BYTES;
+
+// The amount of uncompressed new data that the background thread may decompress ahead of time.
+static constexpr size_t NEW_DATA_RING_BYTES = 8 * 1024 * 1024;
+
+// The maximum number of threads to decompress the frames of a framed new data entry, and the
+// largest frame size accepted. Up to twice as many frames as threads are decompressed ahead.
+static constexpr size_t NEW_DATA_MAX_THREADS = 4;
+static constexpr size_t NEW_DATA_MAX_FRAME_BYTES = 4 * 1024 * 1024;
+
+// Returns the number of the worker threads to start, before the limits of each pool are applied.
+static size_t WorkerCount() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n == 0 ? 4 : n;
+}
 
-static void DeleteLastCommandFile() {
-  std::string last_command_file = CacheLocation::location().last_command_file();
-  if (unlink(last_command_file.c_str()) == -1 && errno != ENOENT) {
-    PLOG(ERROR) << "Failed to unlink: " << last_command_file;
+/**
+ * The state of one block_image_update() or block_image_verify() invocation. It's kept out of the
+ * globals, so that block_image_update_parallel() can update several partitions at the same time.
+ */
+struct BlockImageContext {
+  // The cause of the failure, which is reported through State::cause_code.
+  CauseCode failure_type = kNoCause;
+  // Whether this is a retry, in which case the target blocks are discarded before being written.
+  bool is_retry = false;
+  // The source blocks of the stashes, which are printed when a stash is missing or corrupted.
+  std::unordered_map<std::string, RangeSet> stash_map;
+};
+
+// The maximum number of last_command_file updates to batch, and how long they may be delayed.
+static constexpr size_t CHECKPOINT_MAX_PENDING = 64;
+static constexpr std::chrono::seconds CHECKPOINT_MAX_DELAY(10);
+
+// The number of the slowest commands to summarize in the log after a block image update.
+static constexpr size_t PROFILE_TOP_COMMANDS = 10;
+
+// The phases of a transfer command that are timed by the profile.
+enum ProfilePhase {
+  kPhaseOther,  // Anything that's not timed separately.
+  kPhaseSourceRead,
+  kPhaseHashVerify,
+  kPhaseStashLoad,
+  kPhaseStashStore,
+  kPhasePatchApply,
+  kPhaseNewData,  // Waiting for the new data to be decompressed.
+  kPhaseWrite,
+  kPhaseDiscard,
+  kPhaseFsync,
+  kPhaseCheckpoint,  // Updating the last_command_file.
+  kPhaseCount,
+};
+
+static const char* const kProfilePhaseNames[kPhaseCount] = {
+  "other", "source_read", "hash_verify", "stash_load", "stash_store", "patch_apply",
+  "new_data",  "write",       "discard",     "fsync",      "checkpoint",
+};
+
+/**
+ * CommandProfile records where the time goes while executing a transfer command. The time of each
+ * phase is exclusive, i.e. the time spent in a nested phase (such as the writes while applying a
+ * patch) is only accounted to the nested phase.
+ */
+struct CommandProfile {
+  using Clock = std::chrono::steady_clock;
+
+  int cmdindex = -1;
+  std::string cmdname;
+  double phase_ms[kPhaseCount] = {};
+  double total_ms = 0;
+  size_t blocks_read = 0;
+  size_t blocks_written = 0;
+  size_t blocks_stashed = 0;
+
+  ProfilePhase current_phase = kPhaseOther;
+  Clock::time_point start;
+  Clock::time_point mark;
+
+  // Switches to |phase| and returns the previous phase.
+  ProfilePhase Enter(ProfilePhase phase) {
+    ProfilePhase previous = current_phase;
+    Charge();
+    current_phase = phase;
+    return previous;
+  }
+
+  void Charge() {
+    Clock::time_point now = Clock::now();
+    phase_ms[current_phase] += std::chrono::duration<double, std::milli>(now - mark).count();
+    mark = now;
+  }
+};
+
+// The profiles of all the executed commands of one type, e.g. 'bsdiff', added up.
+struct CommandTypeProfile {
+  size_t count = 0;
+  double phase_ms[kPhaseCount] = {};
+  double total_ms = 0;
+  size_t blocks_read = 0;
+  size_t blocks_written = 0;
+  size_t blocks_stashed = 0;
+
+  void Add(const CommandProfile& profile) {
+    count++;
+    for (size_t i = 0; i < kPhaseCount; i++) {
+      phase_ms[i] += profile.phase_ms[i];
+    }
+    total_ms += profile.total_ms;
+    blocks_read += profile.blocks_read;
+    blocks_written += profile.blocks_written;
+    blocks_stashed += profile.blocks_stashed;
+  }
+};
+
+// The profile of the command being executed by the main thread. The background threads don't
+// contribute to the profile, only the time that the main thread spends waiting for them does.
+static thread_local CommandProfile* current_profile = nullptr;
+
+// Accounts the time until the end of the scope to the given phase of the current command.
+class ScopedPhase {
+ public:
+  explicit ScopedPhase(ProfilePhase phase) : profile_(current_profile) {
+    if (profile_ != nullptr) {
+      previous_ = profile_->Enter(phase);
+    }
+  }
+
+  ~ScopedPhase() {
+    if (profile_ != nullptr) {
+      profile_->Enter(previous_);
+    }
+  }
+
+ private:
+  CommandProfile* profile_;
+  ProfilePhase previous_ = kPhaseOther;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedPhase);
+};
+
+// The file next to the last_command_file that records the progress of an interrupted 'new'
+// command.
+static std::string GetNewDataProgressFile(const std::string& last_command_file) {
+  return last_command_file + ".new";
+}
+
+static void DeleteLastCommandFile(const std::string& last_command_file) {
+  for (const auto& fn : { last_command_file, GetNewDataProgressFile(last_command_file) }) {
+    if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
+      PLOG(ERROR) << "Failed to unlink: " << fn;
+    }
   }
 }
 
 // Parse the last command index of the last update and save the result to |last_command_index|.
 // Return true if we successfully read the index.
-static bool ParseLastCommandFile(int* last_command_index) {
-  std::string last_command_file = CacheLocation::location().last_command_file();
+static bool ParseLastCommandFile(const std::string& last_command_file, int* last_command_index) {
   android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(last_command_file.c_str(), O_RDONLY)));
   if (fd == -1) {
     if (errno != ENOENT) {
@@ -116,60 +318,189 @@ static bool ParseLastCommandFile(int* last_command_index) {
   return true;
 }
 
-// Update the last command index in the last_command_file if the current command writes to the
-// stash either explicitly or implicitly.
-static bool UpdateLastCommandIndex(int command_index, const std::string& command_string) {
-  std::string last_command_file = CacheLocation::location().last_command_file();
-  std::string last_command_tmp = last_command_file + ".tmp";
-  std::string content = std::to_string(command_index) + "\n" + command_string;
+// Parses the index of the 'new' command that was interrupted in the last update, and the number of
+// bytes it had written. Returns true if the progress has been recorded.
+static bool ParseNewDataProgress(const std::string& last_command_file, int* index, size_t* bytes) {
+  std::string progress_file = GetNewDataProgressFile(last_command_file);
+  std::string content;
+  if (!android::base::ReadFileToString(progress_file, &content)) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "Failed to read " << progress_file;
+    }
+    return false;
+  }
+
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+  if (lines.size() != 2 || !android::base::ParseInt(lines[0], index, 0) ||
+      !android::base::ParseUint(lines[1], bytes) || *bytes % BLOCKSIZE != 0) {
+    LOG(ERROR) << "Unexpected content in " << progress_file << ": " << content;
+    return false;
+  }
+  return true;
+}
+
+// Atomically replaces |path| with |content|, and makes it durable.
+static bool WriteCheckpointFile(const std::string& path, const std::string& content) {
+  ScopedPhase phase(kPhaseCheckpoint);
+  std::string tmp_path = path + ".tmp";
   android::base::unique_fd wfd(
-      TEMP_FAILURE_RETRY(open(last_command_tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
+      TEMP_FAILURE_RETRY(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0660)));
   if (wfd == -1 || !android::base::WriteStringToFd(content, wfd)) {
-    PLOG(ERROR) << "Failed to update last command";
+    PLOG(ERROR) << "Failed to write " << tmp_path;
     return false;
   }
 
   if (fsync(wfd) == -1) {
-    PLOG(ERROR) << "Failed to fsync " << last_command_tmp;
+    PLOG(ERROR) << "Failed to fsync " << tmp_path;
     return false;
   }
 
-  if (chown(last_command_tmp.c_str(), AID_SYSTEM, AID_SYSTEM) == -1) {
-    PLOG(ERROR) << "Failed to change owner for " << last_command_tmp;
+  if (chown(tmp_path.c_str(), AID_SYSTEM, AID_SYSTEM) == -1) {
+    PLOG(ERROR) << "Failed to change owner for " << tmp_path;
     return false;
   }
 
-  if (rename(last_command_tmp.c_str(), last_command_file.c_str()) == -1) {
-    PLOG(ERROR) << "Failed to rename" << last_command_tmp;
+  if (rename(tmp_path.c_str(), path.c_str()) == -1) {
+    PLOG(ERROR) << "Failed to rename" << tmp_path;
     return false;
   }
 
-  std::string last_command_dir = android::base::Dirname(last_command_file);
-  android::base::unique_fd dfd(
-      TEMP_FAILURE_RETRY(ota_open(last_command_dir.c_str(), O_RDONLY | O_DIRECTORY)));
+  std::string dir = android::base::Dirname(path);
+  android::base::unique_fd dfd(TEMP_FAILURE_RETRY(ota_open(dir.c_str(), O_RDONLY | O_DIRECTORY)));
   if (dfd == -1) {
-    PLOG(ERROR) << "Failed to open " << last_command_dir;
+    PLOG(ERROR) << "Failed to open " << dir;
     return false;
   }
 
   if (fsync(dfd) == -1) {
-    PLOG(ERROR) << "Failed to fsync " << last_command_dir;
+    PLOG(ERROR) << "Failed to fsync " << dir;
     return false;
   }
 
   return true;
 }
 
-static int read_all(int fd, uint8_t* data, size_t size) {
+// Update the last command index in the last_command_file if the current command writes to the
+// stash either explicitly or implicitly.
+static bool UpdateLastCommandIndex(const std::string& last_command_file, int command_index,
+                                   const std::string& command_string) {
+  return WriteCheckpointFile(last_command_file,
+                             std::to_string(command_index) + "\n" + command_string);
+}
+
+/**
+ * CommandCheckpoint batches the updates to the last_command_file, so that a transfer list with
+ * many stash commands doesn't pay for a file rewrite and two fsyncs per stash.
+ *
+ * Delaying a checkpoint only means that a resumed update executes a few more commands again,
+ * which is safe as long as they produce the same results. The stash commands find their stashes
+ * on /cache, which are made durable before the checkpoint is recorded; and the commands that write
+ * blocks find their targets written already. The exception is a stash id that is freed and then
+ * stashed again (b/69858743): executing the 'free' again would delete the new stash, whose source
+ * blocks may have been overwritten since. So a stash whose id has been freed after the last
+ * durable checkpoint is checkpointed right away.
+ *
+ * Otherwise the checkpoint is written once CHECKPOINT_MAX_PENDING updates are pending, or after
+ * CHECKPOINT_MAX_DELAY; and by Commit() before giving up on a failed update. A checkpoint that
+ * can't be written fails the update, since a resume could no longer rely on the stashes it skips.
+ */
+class CommandCheckpoint {
+ public:
+  void set_last_command_file(const std::string& last_command_file) {
+    last_command_file_ = last_command_file;
+  }
+
+  // Records that the commands up to |index|, whose stashes are on /cache, won't need to be executed
+  // again. Writes the last_command_file if |sync| is true or the batch is full. Returns false if
+  // the write fails.
+  bool Record(int index, std::string_view cmdline, bool sync) {
+    if (pending_ == 0) {
+      first_pending_ = std::chrono::steady_clock::now();
+    }
+    index_ = index;
+    cmdline_ = cmdline;
+    pending_++;
+    if (sync || pending_ >= CHECKPOINT_MAX_PENDING ||
+        std::chrono::steady_clock::now() - first_pending_ >= CHECKPOINT_MAX_DELAY) {
+      return Commit();
+    }
+    return true;
+  }
+
+  // Writes the pending checkpoint to the last_command_file. Returns false if the write fails, in
+  // which case the checkpoint stays pending.
+  bool Commit() {
+    if (pending_ == 0) {
+      return true;
+    }
+    if (!UpdateLastCommandIndex(last_command_file_, index_, cmdline_)) {
+      LOG(ERROR) << "Failed to update the last command file.";
+      return false;
+    }
+    pending_ = 0;
+    commits_++;
+    // The frees up to the checkpoint won't be executed again.
+    for (auto it = freed_.begin(); it != freed_.end();) {
+      it = (it->second <= index_) ? freed_.erase(it) : std::next(it);
+    }
+    return true;
+  }
+
+  // Records that the 'new' command at |index| has written its first |bytes| bytes durably, after
+  // all the commands before it, the last of which is |previous_cmdline|. The stashes in memory must
+  // have been persisted. Returns false if the last_command_file can't be written.
+  bool RecordNewData(int index, std::string_view previous_cmdline, size_t bytes) {
+    if ((index_ != index - 1 || pending_ != 0) && !Record(index - 1, previous_cmdline, true)) {
+      return false;
+    }
+    if (!WriteCheckpointFile(GetNewDataProgressFile(last_command_file_),
+                             std::to_string(index) + "\n" + std::to_string(bytes))) {
+      LOG(WARNING) << "Failed to update the progress of the new data.";
+    }
+    new_data_commits_++;
+    return true;
+  }
+
+  // Notes that the command at |index| deletes the stash |id|.
+  void Free(const std::string& id, int index) {
+    freed_[id] = index;
+  }
+
+  // Returns true if the stash |id| has been freed by a command after the last durable checkpoint.
+  bool FreedSinceCommit(const std::string& id) const {
+    return freed_.find(id) != freed_.end();
+  }
+
+  size_t commits() const {
+    return commits_;
+  }
+
+  size_t new_data_commits() const {
+    return new_data_commits_;
+  }
+
+ private:
+  std::string last_command_file_;
+  int index_ = -1;
+  std::string cmdline_;
+  size_t pending_ = 0;
+  std::chrono::steady_clock::time_point first_pending_;
+  // The stash ids and the indices of the commands that freed them.
+  std::unordered_map<std::string, int> freed_;
+  size_t commits_ = 0;
+  size_t new_data_commits_ = 0;
+};
+
+static int read_all(BlockImageContext& ctx, int fd, uint8_t* data, size_t size) {
     size_t so_far = 0;
     while (so_far < size) {
         ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd, data+so_far, size-so_far));
         if (r == -1) {
-            failure_type = kFreadFailure;
+            ctx.failure_type = kFreadFailure;
             PLOG(ERROR) << "read failed";
             return -1;
         } else if (r == 0) {
-            failure_type = kFreadFailure;
+            ctx.failure_type = kFreadFailure;
             LOG(ERROR) << "read reached unexpected EOF.";
             return -1;
         }
@@ -178,16 +509,16 @@ static int read_all(int fd, uint8_t* data, size_t size) {
     return 0;
 }
 
-static int read_all(int fd, std::vector<uint8_t>& buffer, size_t size) {
-    return read_all(fd, buffer.data(), size);
+static int read_all(BlockImageContext& ctx, int fd, std::vector<uint8_t>& buffer, size_t size) {
+    return read_all(ctx, fd, buffer.data(), size);
 }
 
-static int write_all(int fd, const uint8_t* data, size_t size) {
+static int write_all(BlockImageContext& ctx, int fd, const uint8_t* data, size_t size) {
     size_t written = 0;
     while (written < size) {
         ssize_t w = TEMP_FAILURE_RETRY(ota_write(fd, data+written, size-written));
         if (w == -1) {
-            failure_type = kFwriteFailure;
+            ctx.failure_type = kFwriteFailure;
             PLOG(ERROR) << "write failed";
             return -1;
         }
@@ -197,16 +528,18 @@ static int write_all(int fd, const uint8_t* data, size_t size) {
     return 0;
 }
 
-static int write_all(int fd, const std::vector<uint8_t>& buffer, size_t size) {
-    return write_all(fd, buffer.data(), size);
+static int write_all(BlockImageContext& ctx, int fd, const std::vector<uint8_t>& buffer,
+                     size_t size) {
+    return write_all(ctx, fd, buffer.data(), size);
 }
 
-static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
+static bool discard_blocks(const BlockImageContext& ctx, int fd, off64_t offset, uint64_t size) {
   // Don't discard blocks unless the update is a retry run.
-  if (!is_retry) {
+  if (!ctx.is_retry) {
     return true;
   }
 
+  ScopedPhase phase(kPhaseDiscard);
   uint64_t args[2] = { static_cast<uint64_t>(offset), size };
   if (ioctl(fd, BLKDISCARD, &args) == -1 && errno != ENOTSUP) {
     PLOG(ERROR) << "BLKDISCARD ioctl failed";
@@ -215,10 +548,10 @@ static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
   return true;
 }
 
-static bool check_lseek(int fd, off64_t offset, int whence) {
+static bool check_lseek(BlockImageContext& ctx, int fd, off64_t offset, int whence) {
     off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
     if (rc == -1) {
-        failure_type = kLseekFailure;
+        ctx.failure_type = kLseekFailure;
         PLOG(ERROR) << "lseek64 failed";
         return false;
     }
@@ -232,18 +565,248 @@ static void allocate(size_t size, std::vector<uint8_t>& buffer) {
     buffer.resize(size);
 }
 
+// Writes all the data described by |iov| to |fd| at |offset|, resuming after short writes.
+// Consumes |iov| in the process.
+static int pwritev_all(BlockImageContext& ctx, int fd, struct iovec* iov, int iovcnt,
+                       off64_t offset) {
+  ScopedPhase phase(kPhaseWrite);
+  while (iovcnt > 0) {
+    ssize_t w = TEMP_FAILURE_RETRY(ota_pwritev(fd, iov, std::min(iovcnt, IOV_MAX), offset));
+    if (w == -1) {
+      ctx.failure_type = kFwriteFailure;
+      PLOG(ERROR) << "pwritev failed";
+      return -1;
+    }
+    offset += w;
+    size_t left = w;
+    while (iovcnt > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (left > 0) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+// Returns the extents of |ranges| on the device in bytes, sorted by offset, with the adjacent ones
+// merged.
+static std::vector<std::pair<off64_t, uint64_t>> MergedExtents(const RangeSet& ranges) {
+  std::vector<std::pair<off64_t, uint64_t>> extents;
+  for (const auto& range : ranges) {
+    extents.emplace_back(static_cast<off64_t>(range.first) * BLOCKSIZE,
+                         static_cast<uint64_t>(range.second - range.first) * BLOCKSIZE);
+  }
+  std::sort(extents.begin(), extents.end());
+  size_t merged = 0;
+  for (size_t i = 1; i < extents.size(); i++) {
+    if (extents[merged].first + static_cast<off64_t>(extents[merged].second) ==
+        extents[i].first) {
+      extents[merged].second += extents[i].second;
+    } else {
+      extents[++merged] = extents[i];
+    }
+  }
+  if (!extents.empty()) {
+    extents.resize(merged + 1);
+  }
+  return extents;
+}
+
+// Discards all the blocks in |tgt| ahead of rewriting them, with one BLKDISCARD per extent.
+static bool discard_ranges(const BlockImageContext& ctx, int fd, const RangeSet& tgt) {
+  if (!ctx.is_retry) {
+    return true;
+  }
+  for (const auto& extent : MergedExtents(tgt)) {
+    if (!discard_blocks(ctx, fd, extent.first, extent.second)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * The ways to zero the target blocks, from the fastest to the slowest. The block devices try
+ * BLKZEROOUT, and then BLKDISCARD if the discarded blocks read back as zeros; the files (e.g. on
+ * the host) try to zero or punch the range with fallocate(2). Writing zeros always works.
+ *
+ * Whether a device supports a method is only known once it's been tried, so each device starts
+ * from its fastest candidate, and falls back to the next one upon an unsupported operation. The
+ * first method that works is cached per device, so that the later zero commands (and updates) use
+ * it right away.
+ */
+enum class ZeroMethod {
+  ZEROOUT,     // ioctl(BLKZEROOUT)
+  DISCARD,     // ioctl(BLKDISCARD), when BLKDISCARDZEROES is set
+  ZERO_RANGE,  // fallocate(FALLOC_FL_ZERO_RANGE)
+  PUNCH_HOLE,  // fallocate(FALLOC_FL_PUNCH_HOLE)
+  WRITE,       // write(2) the zeros
+};
+
+static const char* const kZeroMethodNames[] = {
+  "BLKZEROOUT", "BLKDISCARD", "FALLOC_FL_ZERO_RANGE", "FALLOC_FL_PUNCH_HOLE", "write",
+};
+
+// The amount of zeros to write at a time when the zeroing can't be offloaded.
+static constexpr size_t ZERO_WRITE_BYTES = 1024 * 1024;
+
+// The cached methods by device, which is identified by st_rdev for the block devices, and by
+// st_dev and st_ino otherwise.
+static std::mutex zero_methods_mutex;
+static std::map<std::pair<dev_t, ino_t>, ZeroMethod> zero_methods;
+
+static ZeroMethod NextZeroMethod(int fd, ZeroMethod method) {
+  switch (method) {
+    case ZeroMethod::ZEROOUT: {
+      // Not all the devices guarantee zeros upon reading the discarded blocks.
+      unsigned int discard_zeroes = 0;
+      if (ioctl(fd, BLKDISCARDZEROES, &discard_zeroes) == 0 && discard_zeroes != 0) {
+        return ZeroMethod::DISCARD;
+      }
+      return ZeroMethod::WRITE;
+    }
+    case ZeroMethod::ZERO_RANGE:
+      return ZeroMethod::PUNCH_HOLE;
+    default:
+      return ZeroMethod::WRITE;
+  }
+}
+
+// Zeroes |size| bytes at |offset| with |method|. Returns 0 on success, or the errno otherwise.
+static int TryZeroBlocks(BlockImageContext& ctx, int fd, ZeroMethod method, off64_t offset,
+                         uint64_t size) {
+  uint64_t range[2] = { static_cast<uint64_t>(offset), size };
+  switch (method) {
+    case ZeroMethod::ZEROOUT:
+      return ioctl(fd, BLKZEROOUT, &range) == -1 ? errno : 0;
+    case ZeroMethod::DISCARD:
+      return ioctl(fd, BLKDISCARD, &range) == -1 ? errno : 0;
+    case ZeroMethod::ZERO_RANGE:
+      return fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, size) == -1 ? errno : 0;
+    case ZeroMethod::PUNCH_HOLE: {
+      if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == -1) {
+        return errno;
+      }
+      // Punching a hole doesn't extend the file as writing the zeros would.
+      struct stat sb;
+      if (fstat(fd, &sb) == -1) {
+        return errno;
+      }
+      off64_t end = offset + static_cast<off64_t>(size);
+      if (sb.st_size < end && ftruncate64(fd, end) == -1) {
+        return errno;
+      }
+      return 0;
+    }
+    case ZeroMethod::WRITE: {
+      static const std::vector<uint8_t> zeros(ZERO_WRITE_BYTES);
+      while (size > 0) {
+        size_t write_now = std::min<uint64_t>(size, zeros.size());
+        struct iovec iov = { const_cast<uint8_t*>(zeros.data()), write_now };
+        if (pwritev_all(ctx, fd, &iov, 1, offset) == -1) {
+          return errno;
+        }
+        offset += write_now;
+        size -= write_now;
+      }
+      return 0;
+    }
+  }
+  return EINVAL;
+}
+
+// Zeroes |size| bytes at |offset| of |fd|, with the fastest method that the device supports.
+static bool ZeroBlocks(BlockImageContext& ctx, int fd, off64_t offset, uint64_t size) {
+  ScopedPhase phase(kPhaseWrite);
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    PLOG(ERROR) << "failed to fstat the target to zero";
+    return false;
+  }
+  auto device = S_ISBLK(sb.st_mode) ? std::make_pair(sb.st_rdev, static_cast<ino_t>(0))
+                                    : std::make_pair(sb.st_dev, sb.st_ino);
+
+  ZeroMethod method;
+  bool cached;
+  {
+    std::lock_guard<std::mutex> lock(zero_methods_mutex);
+    auto it = zero_methods.find(device);
+    cached = (it != zero_methods.end());
+    if (cached) {
+      method = it->second;
+    } else if (S_ISBLK(sb.st_mode)) {
+      method = ZeroMethod::ZEROOUT;
+    } else if (S_ISREG(sb.st_mode)) {
+      method = ZeroMethod::ZERO_RANGE;
+    } else {
+      method = ZeroMethod::WRITE;
+    }
+  }
+
+  while (true) {
+    int error = TryZeroBlocks(ctx, fd, method, offset, size);
+    if (error == 0) {
+      break;
+    }
+    // Only fall back upon the operations that the device (or its driver) doesn't support.
+    if (method == ZeroMethod::WRITE ||
+        (error != EOPNOTSUPP && error != ENOTTY && error != EINVAL && error != ENOSYS)) {
+      if (method != ZeroMethod::WRITE) {
+        ctx.failure_type = kFwriteFailure;
+      }
+      LOG(ERROR) << "failed to zero " << size << " bytes at " << offset << " with "
+                 << kZeroMethodNames[static_cast<size_t>(method)] << ": " << strerror(error);
+      return false;
+    }
+    ZeroMethod next = NextZeroMethod(fd, method);
+    LOG(INFO) << kZeroMethodNames[static_cast<size_t>(method)] << " isn't supported ("
+              << strerror(error) << "); trying " << kZeroMethodNames[static_cast<size_t>(next)];
+    method = next;
+    cached = false;
+  }
+
+  if (!cached) {
+    LOG(INFO) << "zeroing the blocks with " << kZeroMethodNames[static_cast<size_t>(method)];
+    std::lock_guard<std::mutex> lock(zero_methods_mutex);
+    zero_methods[device] = method;
+  }
+  return true;
+}
+
 /**
  * RangeSinkWriter reads data from the given FD, and writes them to the destination specified by the
  * given RangeSet.
+ *
+ * The data for adjacent blocks on the device is combined in a staging buffer and written with a
+ * single pwritev(2), which avoids the lseek and write calls per range on fragmented targets. Large
+ * writes that start with an empty staging buffer go out directly. The whole target is discarded at
+ * once upon the first write, with the adjacent ranges merged.
+ *
+ * If |direct_fd| is given, which is expected to be opened with O_DIRECT, all the writes are copied
+ * into the block aligned staging buffer and then written through it. The buffer is only flushed
+ * in whole blocks at block aligned offsets, which is what O_DIRECT requires. The other commands
+ * read and write the same blocks through the page cache of |fd|, so any dirty pages there are
+ * written out before the direct write, and the cached pages are dropped after it.
  */
 class RangeSinkWriter {
  public:
-  RangeSinkWriter(int fd, const RangeSet& tgt)
-      : fd_(fd),
+  RangeSinkWriter(BlockImageContext& ctx, int fd, const RangeSet& tgt, int direct_fd = -1)
+      : ctx_(ctx),
+        fd_(fd),
+        direct_fd_(direct_fd),
         tgt_(tgt),
         next_range_(0),
         current_range_left_(0),
-        bytes_written_(0) {
+        current_offset_(0),
+        bytes_written_(0),
+        discarded_(false),
+        staging_(nullptr, free),
+        staged_offset_(0),
+        staged_size_(0) {
     CHECK_NE(tgt.size(), static_cast<size_t>(0));
   };
 
@@ -262,6 +825,13 @@ class RangeSinkWriter {
       return 0;
     }
 
+    if (!discarded_) {
+      if (!discard_ranges(ctx_, fd_, tgt_)) {
+        return 0;
+      }
+      discarded_ = true;
+    }
+
     size_t written = 0;
     while (size > 0) {
       // Move to the next range as needed.
@@ -274,18 +844,22 @@ class RangeSinkWriter {
         write_now = current_range_left_;
       }
 
-      if (write_all(fd_, data, write_now) == -1) {
-        break;
+      if (!Stage(current_offset_, data, write_now)) {
+        return 0;
       }
 
       data += write_now;
       size -= write_now;
 
       current_range_left_ -= write_now;
+      current_offset_ += write_now;
       written += write_now;
     }
 
     bytes_written_ += written;
+    if (Finished() && !Flush()) {
+      return 0;
+    }
     return written;
   }
 
@@ -293,7 +867,59 @@ class RangeSinkWriter {
     return bytes_written_;
   }
 
+  // Skips the first |size| bytes of the target, which have been written before resuming. The
+  // target isn't discarded then, which would drop the written data.
+  void Skip(size_t size) {
+    CHECK_EQ(bytes_written_, static_cast<size_t>(0));
+    CHECK_LT(size, AvailableSpace());
+    discarded_ = true;
+    while (size > 0 && SeekToOutputRange()) {
+      size_t skip_now = std::min<size_t>(size, current_range_left_);
+      current_range_left_ -= skip_now;
+      current_offset_ += skip_now;
+      bytes_written_ += skip_now;
+      size -= skip_now;
+    }
+  }
+
+  // Writes out the staged data.
+  bool Flush() {
+    if (staged_size_ == 0) {
+      return true;
+    }
+    struct iovec iov = { staging_.get(), staged_size_ };
+    if (direct_fd_ == -1) {
+      if (pwritev_all(ctx_, fd_, &iov, 1, staged_offset_) == -1) {
+        return false;
+      }
+    } else {
+      // Write out the dirty pages of |fd_| first, and drop its cached pages afterwards, which the
+      // kernel only does on a best effort basis; the later commands read these blocks through it.
+      if (sync_file_range(fd_, staged_offset_, staged_size_,
+                          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+        ctx_.failure_type = kFwriteFailure;
+        PLOG(ERROR) << "sync_file_range failed";
+        return false;
+      }
+      if (pwritev_all(ctx_, direct_fd_, &iov, 1, staged_offset_) == -1) {
+        return false;
+      }
+      int error = posix_fadvise(fd_, staged_offset_, staged_size_, POSIX_FADV_DONTNEED);
+      if (error != 0) {
+        ctx_.failure_type = kFwriteFailure;
+        LOG(ERROR) << "failed to drop the cached pages: " << strerror(error);
+        return false;
+      }
+    }
+    staged_size_ = 0;
+    return true;
+  }
+
  private:
+  // The size of the staging buffer, in which the writes to adjacent blocks are combined.
+  static constexpr size_t kStagingSize = 1024 * 1024;
+
   // Set up the output cursor, move to next range if needed.
   bool SeekToOutputRange() {
     // We haven't finished the current range yet.
@@ -307,130 +933,451 @@ class RangeSinkWriter {
     }
 
     const Range& range = tgt_[next_range_];
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
+    current_offset_ = static_cast<off64_t>(range.first) * BLOCKSIZE;
     current_range_left_ = (range.second - range.first) * BLOCKSIZE;
     next_range_++;
+    return true;
+  }
 
-    if (!discard_blocks(fd_, offset, current_range_left_)) {
-      return false;
+  // Queues |size| bytes to be written at |offset|. The staged data is written out once it's full,
+  // or when the next write isn't adjacent to it.
+  bool Stage(off64_t offset, const uint8_t* data, size_t size) {
+    if (staged_size_ != 0 && staged_offset_ + static_cast<off64_t>(staged_size_) != offset) {
+      if (!Flush()) {
+        return false;
+      }
     }
-    if (!check_lseek(fd_, offset, SEEK_SET)) {
-      return false;
+
+    if (staged_size_ == 0 && direct_fd_ == -1 && size >= kStagingSize) {
+      struct iovec iov = { const_cast<uint8_t*>(data), size };
+      return pwritev_all(ctx_, fd_, &iov, 1, offset) == 0;
+    }
+
+    if (staging_ == nullptr) {
+      void* buffer;
+      if (posix_memalign(&buffer, BLOCKSIZE, kStagingSize) != 0) {
+        LOG(ERROR) << "failed to allocate the staging buffer";
+        return false;
+      }
+      staging_.reset(static_cast<uint8_t*>(buffer));
+    }
+
+    while (size > 0) {
+      if (staged_size_ == 0) {
+        staged_offset_ = offset;
+      }
+      size_t copy_now = std::min(size, kStagingSize - staged_size_);
+      memcpy(staging_.get() + staged_size_, data, copy_now);
+      staged_size_ += copy_now;
+      data += copy_now;
+      size -= copy_now;
+      offset += copy_now;
+      if (staged_size_ == kStagingSize && !Flush()) {
+        return false;
+      }
     }
     return true;
   }
 
+  BlockImageContext& ctx_;
   // The output file descriptor.
   int fd_;
+  // The output file descriptor opened with O_DIRECT, or -1.
+  int direct_fd_;
   // The destination ranges for the data.
   const RangeSet& tgt_;
   // The next range that we should write to.
   size_t next_range_;
   // The number of bytes to write before moving to the next range.
   size_t current_range_left_;
+  // The offset of the next write in the current range.
+  off64_t current_offset_;
   // Total bytes written by the writer.
   size_t bytes_written_;
+  // Whether the target blocks have been discarded.
+  bool discarded_;
+
+  // The staged data, which starts at |staged_offset_| on the device.
+  std::unique_ptr<uint8_t, decltype(&free)> staging_;
+  off64_t staged_offset_;
+  size_t staged_size_;
 };
 
 /**
- * All of the data for all the 'new' transfers is contained in one file in the update package,
- * concatenated together in the order in which transfers.list will need it. We want to stream it out
- * of the archive (it's compressed) without writing it to a temp file, but we can't write each
- * section until it's that transfer's turn to go.
+ * NewDataRing is a single-producer/single-consumer ring buffer for the uncompressed new data. The
+ * producer only advances |head_| and the consumer only advances |tail_|, so neither side takes a
+ * lock as long as there's space (or data) in the ring. A side only sleeps on |cv_| when the ring
+ * is full (or empty), and the other side wakes it up once it has made progress.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
- *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * The producer may write no more than the |limit| bytes that the 'new' commands will consume; any
+ * data past it is dropped and reported by Overflowed().
  */
-struct NewThreadInfo {
-  ZipArchiveHandle za;
-  ZipEntry entry;
-  bool brotli_compressed;
-
-  std::unique_ptr<RangeSinkWriter> writer;
-  BrotliDecoderState* brotli_decoder_state;
-  bool receiver_available;
-
-  pthread_mutex_t mu;
-  pthread_cond_t cv;
-};
+class NewDataRing {
+ public:
+  NewDataRing(size_t capacity, uint64_t limit) : buffer_(capacity), remaining_(limit) {}
+
+  // Producer side. Returns the size of the contiguous free space at |*out|, waiting for the
+  // consumer if the ring is full. Returns 0 if the consumer has closed the ring. Once the limit
+  // has been reached, it returns a scratch byte instead, where a decoder may try to finish the
+  // stream; committing any output there fails.
+  size_t WaitForSpace(uint8_t** out) {
+    if (closed_.load()) {
+      return 0;
+    }
+    if (remaining_ == 0) {
+      *out = &excess_;
+      return 1;
+    }
+    size_t head = head_.load(std::memory_order_relaxed);
+    auto has_space = [this, head] {
+      return closed_.load() || head - tail_.load() < buffer_.size();
+    };
+    if (!has_space()) {
+      Wait(&producer_waiting_, has_space);
+    }
+    if (closed_.load()) {
+      return 0;
+    }
+    size_t offset = head % buffer_.size();
+    *out = buffer_.data() + offset;
+    size_t space = std::min(buffer_.size() - (head - tail_.load()), buffer_.size() - offset);
+    return std::min<uint64_t>(space, remaining_);
+  }
 
-static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  // Producer side. Publishes |size| bytes written to the space returned by WaitForSpace(). Returns
+  // false if they go past the limit.
+  bool Commit(size_t size) {
+    if (size == 0) {
+      return true;
+    }
+    if (remaining_ == 0) {
+      overflowed_ = true;
+      return false;
+    }
+    remaining_ -= size;
+    head_.fetch_add(size);
+    Wake(consumer_waiting_);
+    return true;
+  }
 
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
+  // Producer side. Copies |data| into the ring. Returns false if the consumer has closed the ring,
+  // or if the data goes past the limit.
+  bool Write(const uint8_t* data, size_t size) {
+    while (size > 0) {
+      uint8_t* out;
+      size_t write_now = std::min(size, WaitForSpace(&out));
+      if (write_now == 0) {
+        return false;
+      }
+      memcpy(out, data, write_now);
+      if (!Commit(write_now)) {
         return false;
       }
-      pthread_cond_wait(&nti->cv, &nti->mu);
+      data += write_now;
+      size -= write_now;
     }
-    pthread_mutex_unlock(&nti->mu);
+    return true;
+  }
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+  // Producer side. Signals the end of the data, be it complete or not.
+  void Finish() {
+    finished_.store(true);
+    Wake(consumer_waiting_);
+  }
 
-    data += write_now;
-    size -= write_now;
+  // Consumer side. Returns the size of the contiguous data at |*out|, waiting for the producer if
+  // the ring is empty. Returns 0 if the producer has finished and all the data has been consumed.
+  size_t WaitForData(const uint8_t** out) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    auto has_data = [this, tail] { return finished_.load() || head_.load() != tail; };
+    if (!has_data()) {
+      Wait(&consumer_waiting_, has_data);
+    }
+    size_t offset = tail % buffer_.size();
+    *out = buffer_.data() + offset;
+    return std::min(head_.load() - tail, buffer_.size() - offset);
+  }
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+  // Consumer side. Releases |size| bytes returned by WaitForData().
+  void Consume(size_t size) {
+    tail_.fetch_add(size);
+    Wake(producer_waiting_);
+  }
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
+  // Consumer side. Stops the producer; it will fail to write any more data.
+  void Close() {
+    closed_.store(true);
+    Wake(producer_waiting_);
   }
 
-  return true;
-}
+  bool Finished() const {
+    return finished_.load();
+  }
 
-static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  // Whether the producer has tried to write more than the limit. Only to be checked once the
+  // producer has finished.
+  bool Overflowed() const {
+    return overflowed_;
+  }
 
-  while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
+ private:
+  // The waiting side announces itself before checking |ready| under the lock, and the other side
+  // checks the announcement after publishing its progress; so no wakeup is lost.
+  template <typename Predicate>
+  void Wait(std::atomic<bool>* waiting, Predicate ready) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    waiting->store(true);
+    cv_.wait(lock, ready);
+    waiting->store(false);
+  }
+
+  void Wake(const std::atomic<bool>& waiting) {
+    if (waiting.load()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cv_.notify_all();
     }
-    pthread_mutex_unlock(&nti->mu);
+  }
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
+  std::vector<uint8_t> buffer_;
+  // The total number of bytes written and read so far.
+  std::atomic<size_t> head_{ 0 };
+  std::atomic<size_t> tail_{ 0 };
+  std::atomic<bool> finished_{ false };
+  std::atomic<bool> closed_{ false };
 
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
+  // The bytes that the producer may still write, and the scratch byte past them. Both are only
+  // accessed by the producer, until it has finished.
+  uint64_t remaining_;
+  uint8_t excess_;
+  bool overflowed_{ false };
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> producer_waiting_{ false };
+  std::atomic<bool> consumer_waiting_{ false };
+};
+
+// The codec of the new data entry, which is chosen by the suffix of its name. A stored or deflated
+// zip entry is expanded by libziparchive; the other codecs are decoded on top of it.
+enum class NewDataCodec {
+  NONE,    // <partition>.new.dat
+  BROTLI,  // <partition>.new.dat.br
+  ZSTD,    // <partition>.new.dat.zst
+  LZ4,     // <partition>.new.dat.lz4
+  FRAMES,  // <partition>.new.dat.frames, see NewDataFrames.
+};
+
+static NewDataCodec GetNewDataCodec(const std::string& new_data_fn) {
+  if (android::base::EndsWith(new_data_fn, ".br")) {
+    return NewDataCodec::BROTLI;
+  }
+  if (android::base::EndsWith(new_data_fn, ".zst")) {
+    return NewDataCodec::ZSTD;
+  }
+  if (android::base::EndsWith(new_data_fn, ".lz4")) {
+    return NewDataCodec::LZ4;
+  }
+  if (android::base::EndsWith(new_data_fn, ".frames")) {
+    return NewDataCodec::FRAMES;
+  }
+  return NewDataCodec::NONE;
+}
+
+/**
+ * A framed new data entry splits the new data into fixed-size frames that are compressed
+ * independently, so that they can be decompressed in parallel. The entry must be stored (not
+ * deflated) in the package, so that the frames can be accessed in place. It's laid out as follows,
+ * with all the integers in little-endian:
+ *
+ *   char     magic[8]                  "NEWFRAME"
+ *   uint32_t version                   1
+ *   uint32_t codec                     0: stored, 1: brotli, 2: zstd, 3: lz4 (block format)
+ *   uint32_t frame_size                The uncompressed size of all the frames but the last one
+ *   uint32_t frame_count
+ *   uint64_t data_size                 The total uncompressed size
+ *   uint32_t compressed_size[frame_count]
+ *   The compressed frames, back to back.
+ */
+static constexpr char NEW_DATA_FRAMES_MAGIC[] = "NEWFRAME";
+static constexpr size_t NEW_DATA_FRAMES_HEADER_SIZE = 32;
+
+struct NewDataFrames {
+  NewDataCodec codec;
+  size_t frame_size;
+  uint64_t data_size;
+  std::vector<const uint8_t*> frames;
+  std::vector<size_t> compressed_sizes;
+
+  size_t count() const {
+    return frames.size();
+  }
+
+  size_t uncompressed_size(size_t index) const {
+    return index + 1 < count() ? frame_size : data_size - index * frame_size;
+  }
+};
+
+template <typename T>
+static T ReadLittleEndian(const uint8_t* data) {
+  T value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static bool ParseNewDataFrames(const uint8_t* data, size_t size, NewDataFrames* result) {
+  if (size < NEW_DATA_FRAMES_HEADER_SIZE ||
+      memcmp(data, NEW_DATA_FRAMES_MAGIC, sizeof(NEW_DATA_FRAMES_MAGIC) - 1) != 0) {
+    LOG(ERROR) << "invalid framed new data header";
+    return false;
+  }
+  uint32_t version = ReadLittleEndian<uint32_t>(data + 8);
+  if (version != 1) {
+    LOG(ERROR) << "unsupported framed new data version " << version;
+    return false;
+  }
+  switch (ReadLittleEndian<uint32_t>(data + 12)) {
+    case 0:
+      result->codec = NewDataCodec::NONE;
+      break;
+    case 1:
+      result->codec = NewDataCodec::BROTLI;
+      break;
+    case 2:
+      result->codec = NewDataCodec::ZSTD;
+      break;
+    case 3:
+      result->codec = NewDataCodec::LZ4;
+      break;
+    default:
+      LOG(ERROR) << "unsupported framed new data codec " << ReadLittleEndian<uint32_t>(data + 12);
+      return false;
+  }
+  result->frame_size = ReadLittleEndian<uint32_t>(data + 16);
+  size_t frame_count = ReadLittleEndian<uint32_t>(data + 20);
+  result->data_size = ReadLittleEndian<uint64_t>(data + 24);
+  if (result->frame_size == 0 || result->frame_size > NEW_DATA_MAX_FRAME_BYTES ||
+      frame_count != result->data_size / result->frame_size +
+                         (result->data_size % result->frame_size != 0 ? 1 : 0)) {
+    LOG(ERROR) << "invalid framed new data: frame size " << result->frame_size << ", "
+               << frame_count << " frames, " << result->data_size << " bytes";
+    return false;
+  }
+
+  // Check the frame count against the size first, so that the size of the index can't overflow.
+  if (frame_count > (size - NEW_DATA_FRAMES_HEADER_SIZE) / sizeof(uint32_t)) {
+    LOG(ERROR) << "truncated framed new data index: " << frame_count << " frames in " << size
+               << " bytes";
+    return false;
+  }
+  size_t offset = NEW_DATA_FRAMES_HEADER_SIZE + frame_count * sizeof(uint32_t);
+  result->frames.clear();
+  result->compressed_sizes.clear();
+  for (size_t i = 0; i < frame_count; i++) {
+    size_t compressed_size =
+        ReadLittleEndian<uint32_t>(data + NEW_DATA_FRAMES_HEADER_SIZE + i * sizeof(uint32_t));
+    if (compressed_size > size - offset) {
+      LOG(ERROR) << "truncated framed new data at frame " << i;
+      return false;
+    }
+    result->frames.push_back(data + offset);
+    result->compressed_sizes.push_back(compressed_size);
+    offset += compressed_size;
+  }
+  return true;
+}
+
+static bool DecompressNewDataFrame(NewDataCodec codec, const uint8_t* src, size_t src_size,
+                                   uint8_t* dst, size_t dst_size) {
+  switch (codec) {
+    case NewDataCodec::NONE:
+      if (src_size != dst_size) {
+        return false;
+      }
+      memcpy(dst, src, dst_size);
+      return true;
+    case NewDataCodec::BROTLI: {
+      size_t decoded_size = dst_size;
+      return BrotliDecoderDecompress(src_size, src, &decoded_size, dst) ==
+                 BROTLI_DECODER_RESULT_SUCCESS &&
+             decoded_size == dst_size;
+    }
+    case NewDataCodec::ZSTD: {
+      size_t decoded_size = ZSTD_decompress(dst, dst_size, src, src_size);
+      return !ZSTD_isError(decoded_size) && decoded_size == dst_size;
+    }
+    case NewDataCodec::LZ4: {
+      int decoded_size = LZ4_decompress_safe(reinterpret_cast<const char*>(src),
+                                             reinterpret_cast<char*>(dst), src_size, dst_size);
+      return decoded_size >= 0 && static_cast<size_t>(decoded_size) == dst_size;
+    }
+    case NewDataCodec::FRAMES:
+      break;
+  }
+  return false;
+}
+
+/**
+ * All of the data for all the 'new' transfers is contained in one file in the update package,
+ * concatenated together in the order in which transfers.list will need it. We want to stream it out
+ * of the archive (it's compressed) without writing it to a temp file, but we can't write each
+ * section until it's that transfer's turn to go.
+ *
+ * To achieve this, we expand the new data from the archive in a background thread into a
+ * NewDataRing, which holds up to NEW_DATA_RING_BYTES of uncompressed data. The decompression runs
+ * ahead of the main thread until the ring is full, while the earlier commands are being executed;
+ * and PerformCommandNew() drains the ring into the target blocks when it's that transfer's turn.
+ * The background thread finishes the ring when it reaches the end of the entry or fails to process
+ * it, in which case the main thread reports the missing data. Upon finishing or failing the update,
+ * the main thread closes the ring, which stops the background thread.
+ *
+ * A framed new data entry (see NewDataFrames) is decompressed by a few more workers, which the
+ * background thread spawns and reorders the frames from.
+ */
+struct ZstdDStreamDeleter {
+  void operator()(ZSTD_DStream* dstream) const {
+    ZSTD_freeDStream(dstream);
+  }
+};
+
+struct Lz4DctxDeleter {
+  void operator()(LZ4F_dctx* dctx) const {
+    LZ4F_freeDecompressionContext(dctx);
+  }
+};
+
+struct NewThreadInfo {
+  ZipArchiveHandle za;
+  ZipEntry entry;
+  NewDataCodec codec;
+
+  std::unique_ptr<NewDataRing> ring;
+  BrotliDecoderState* brotli_decoder_state;
+  std::unique_ptr<ZSTD_DStream, ZstdDStreamDeleter> zstd_dstream;
+  std::unique_ptr<LZ4F_dctx, Lz4DctxDeleter> lz4_dctx;
+  NewDataFrames frames;
+  // The frame to start from when resuming an update; the data before it has been written already.
+  size_t first_frame;
+  // The maximum number of threads to decompress the frames.
+  size_t max_frame_threads;
+};
+
+static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  return nti->ring->Write(data, size);
+}
+
+static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+
+  while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
+    // Decompress straight into the free space of the ring.
+    uint8_t* next_out;
+    size_t buffer_size = nti->ring->WaitForSpace(&next_out);
+    if (buffer_size == 0) {
       return false;
     }
-    uint8_t buffer[buffer_size];
     size_t available_in = size;
     size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
 
     // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
     BrotliDecoderResult result = BrotliDecoderDecompressStream(
@@ -445,53 +1392,217 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
     LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
+    if (!nti->ring->Commit(buffer_size - available_out)) {
       return false;
     }
+    if (result == BROTLI_DECODER_RESULT_SUCCESS) {
+      // End of the stream; there's no more output to produce.
+      break;
+    }
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
+  }
+
+  return true;
+}
+
+static bool receive_zstd_new_data(const uint8_t* data, size_t size, void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+
+  ZSTD_inBuffer input = { data, size, 0 };
+  // A full output buffer means the decoder may still hold some data, even if all the input has
+  // been consumed.
+  bool output_full = false;
+  while (input.pos < input.size || output_full) {
+    uint8_t* next_out;
+    size_t buffer_size = nti->ring->WaitForSpace(&next_out);
+    if (buffer_size == 0) {
+      return false;
+    }
+    ZSTD_outBuffer output = { next_out, buffer_size, 0 };
+
+    size_t result = ZSTD_decompressStream(nti->zstd_dstream.get(), &output, &input);
+    if (ZSTD_isError(result)) {
+      LOG(ERROR) << "Decompression failed with " << ZSTD_getErrorName(result);
+      return false;
+    }
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+    LOG(DEBUG) << "bytes to write: " << output.pos << ", bytes consumed " << input.pos;
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+    if (!nti->ring->Commit(output.pos)) {
+      return false;
     }
+    output_full = (output.pos == output.size);
   }
 
   return true;
 }
 
-static void* unzip_new_data(void* cookie) {
+static bool receive_lz4_new_data(const uint8_t* data, size_t size, void* cookie) {
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
-  if (nti->brotli_compressed) {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
-  } else {
-    ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
+
+  bool output_full = false;
+  while (size > 0 || output_full) {
+    uint8_t* next_out;
+    size_t buffer_size = nti->ring->WaitForSpace(&next_out);
+    if (buffer_size == 0) {
+      return false;
+    }
+
+    // LZ4F_decompress() updates |available_out| and |available_in| to the number of bytes that
+    // it has produced and consumed respectively.
+    size_t available_out = buffer_size;
+    size_t available_in = size;
+    size_t result = LZ4F_decompress(nti->lz4_dctx.get(), next_out, &available_out, data,
+                                    &available_in, nullptr);
+    if (LZ4F_isError(result)) {
+      LOG(ERROR) << "Decompression failed with " << LZ4F_getErrorName(result);
+      return false;
+    }
+
+    LOG(DEBUG) << "bytes to write: " << available_out << ", bytes consumed " << available_in;
+
+    if (!nti->ring->Commit(available_out)) {
+      return false;
+    }
+    output_full = (available_out == buffer_size);
+    data += available_in;
+    size -= available_in;
+  }
+
+  return true;
+}
+
+// Decompresses the frames of a framed new data entry on a few worker threads, and writes them into
+// the ring in order. The workers may run up to twice as many frames ahead as there are workers.
+static bool receive_new_data_frames(NewThreadInfo* nti) {
+  const NewDataFrames& frames = nti->frames;
+  if (frames.codec == NewDataCodec::NONE) {
+    for (size_t i = nti->first_frame; i < frames.count(); i++) {
+      if (frames.compressed_sizes[i] != frames.uncompressed_size(i)) {
+        LOG(ERROR) << "invalid size of stored frame " << i;
+        return false;
+      }
+      if (!nti->ring->Write(frames.frames[i], frames.compressed_sizes[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t num_threads = std::min<size_t>(
+      { WorkerCount(), nti->max_frame_threads, frames.count() - nti->first_frame });
+  size_t window = 2 * num_threads;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t next_decode = nti->first_frame;  // The next frame for the workers to pick up.
+  size_t next_write = nti->first_frame;   // The next frame to be written into the ring.
+  bool failed = false;
+  std::map<size_t, std::vector<uint8_t>> decoded;
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] {
+        return failed || next_decode >= frames.count() || next_decode < next_write + window;
+      });
+      if (failed || next_decode >= frames.count()) {
+        return;
+      }
+      size_t index = next_decode++;
+      lock.unlock();
+
+      std::vector<uint8_t> buffer(frames.uncompressed_size(index));
+      bool success = DecompressNewDataFrame(frames.codec, frames.frames[index],
+                                            frames.compressed_sizes[index], buffer.data(),
+                                            buffer.size());
+      if (!success) {
+        LOG(ERROR) << "failed to decompress frame " << index << " of the new data";
+      }
+
+      lock.lock();
+      if (success) {
+        decoded.emplace(index, std::move(buffer));
+      } else {
+        failed = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < num_threads; i++) {
+    workers.emplace_back(worker);
+  }
+
+  bool success = true;
+  for (size_t index = nti->first_frame; index < frames.count(); index++) {
+    std::vector<uint8_t> buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return failed || decoded.find(index) != decoded.end(); });
+      if (failed) {
+        success = false;
+        break;
+      }
+      auto it = decoded.find(index);
+      buffer = std::move(it->second);
+      decoded.erase(it);
+      next_write = index + 1;
+    }
+    cv.notify_all();
+
+    // Write() fails once the main thread closes the ring; stop the workers then.
+    if (!nti->ring->Write(buffer.data(), buffer.size())) {
+      std::lock_guard<std::mutex> lock(mutex);
+      failed = true;
+      cv.notify_all();
+      success = false;
+      break;
+    }
   }
-  pthread_mutex_lock(&nti->mu);
-  nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
+
+  for (auto& thread : workers) {
+    thread.join();
   }
-  pthread_mutex_unlock(&nti->mu);
+  return success;
+}
+
+static void* unzip_new_data(void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+  switch (nti->codec) {
+    case NewDataCodec::BROTLI:
+      ProcessZipEntryContents(nti->za, &nti->entry, receive_brotli_new_data, nti);
+      break;
+    case NewDataCodec::ZSTD:
+      ProcessZipEntryContents(nti->za, &nti->entry, receive_zstd_new_data, nti);
+      break;
+    case NewDataCodec::LZ4:
+      ProcessZipEntryContents(nti->za, &nti->entry, receive_lz4_new_data, nti);
+      break;
+    case NewDataCodec::FRAMES:
+      receive_new_data_frames(nti);
+      break;
+    case NewDataCodec::NONE:
+      ProcessZipEntryContents(nti->za, &nti->entry, receive_new_data, nti);
+      break;
+  }
+  nti->ring->Finish();
   return nullptr;
 }
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd) {
+static int ReadBlocks(BlockImageContext& ctx, const RangeSet& src, std::vector<uint8_t>& buffer,
+                      int fd) {
   size_t p = 0;
   for (const auto& range : src) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
+    if (!check_lseek(ctx, fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
       return -1;
     }
 
     size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (read_all(fd, buffer.data() + p, size) == -1) {
+    if (read_all(ctx, fd, buffer.data() + p, size) == -1) {
       return -1;
     }
 
@@ -501,498 +1612,2148 @@ static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd)
   return 0;
 }
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
+static int WriteBlocks(BlockImageContext& ctx, const RangeSet& tgt,
+                       const std::vector<uint8_t>& buffer, int fd) {
+  if (!discard_ranges(ctx, fd, tgt)) {
+    return -1;
+  }
+
+  // Sort the ranges by their location on the device, so that the ones next to each other can be
+  // written with a single pwritev(2) call.
+  std::vector<std::pair<off64_t, struct iovec>> writes;
   size_t written = 0;
   for (const auto& range : tgt) {
-    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
     size_t size = (range.second - range.first) * BLOCKSIZE;
-    if (!discard_blocks(fd, offset, size)) {
-      return -1;
-    }
+    struct iovec iov = { const_cast<uint8_t*>(buffer.data()) + written, size };
+    writes.emplace_back(static_cast<off64_t>(range.first) * BLOCKSIZE, iov);
+    written += size;
+  }
+  std::sort(writes.begin(), writes.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
 
-    if (!check_lseek(fd, offset, SEEK_SET)) {
-      return -1;
+  std::vector<struct iovec> iov;
+  off64_t batch_offset = 0;
+  off64_t batch_end = 0;
+  for (const auto& write : writes) {
+    if (!iov.empty() && write.first != batch_end) {
+      if (pwritev_all(ctx, fd, iov.data(), iov.size(), batch_offset) == -1) {
+        return -1;
+      }
+      iov.clear();
     }
-
-    if (write_all(fd, buffer.data() + written, size) == -1) {
-      return -1;
+    if (iov.empty()) {
+      batch_offset = write.first;
     }
-
-    written += size;
+    iov.push_back(write.second);
+    batch_end = write.first + write.second.iov_len;
+  }
+  if (!iov.empty() && pwritev_all(ctx, fd, iov.data(), iov.size(), batch_offset) == -1) {
+    return -1;
   }
 
   return 0;
 }
 
-// Parameters for transfer list command functions
-struct CommandParameters {
-    std::vector<std::string> tokens;
-    size_t cpos;
-    int cmdindex;
-    const char* cmdname;
-    const char* cmdline;
-    std::string freestash;
-    std::string stashbase;
-    bool canwrite;
-    int createdstash;
-    android::base::unique_fd fd;
-    bool foundwrites;
-    bool isunresumable;
-    int version;
-    size_t written;
-    size_t stashed;
-    NewThreadInfo nti;
-    pthread_t thread;
-    std::vector<uint8_t> buffer;
-    uint8_t* patch_start;
-    bool target_verified;  // The target blocks have expected contents already.
-};
-
-// Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
-// handled separately).
-static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
-                                              const std::vector<uint8_t>& buffer) {
-  LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << params.cmdline;
-  CHECK(params.tokens[0] == "move" || params.tokens[0] == "bsdiff" ||
-        params.tokens[0] == "imgdiff");
-
-  size_t pos = 0;
-  // Command example:
-  // move <onehash> <tgt_range> <src_blk_count> <src_range> [<loc_range> <stashed_blocks>]
-  // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
-  //        [<loc_range> <stashed_blocks>]
-  if (params.tokens[0] == "move") {
-    // src_range for move starts at the 4th position.
-    if (params.tokens.size() < 5) {
-      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
-      return;
+// Reads the blocks on a background thread. Unlike ReadBlocks(), it doesn't set the failure type;
+// the callers are expected to retry on the main thread upon failures.
+static bool ReadBlocksInBackground(int fd, const RangeSet& ranges, uint8_t* data) {
+  for (const auto& range : ranges) {
+    off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
+    if (TEMP_FAILURE_RETRY(lseek64(fd, offset, SEEK_SET)) == -1) {
+      PLOG(WARNING) << "failed to seek to block " << range.first;
+      return false;
     }
-    pos = 4;
-  } else {
-    // src_range for diff starts at the 7th position.
-    if (params.tokens.size() < 8) {
-      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
-      return;
+    size_t size = (range.second - range.first) * BLOCKSIZE;
+    size_t so_far = 0;
+    while (so_far < size) {
+      ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd, data + so_far, size - so_far));
+      if (r <= 0) {
+        PLOG(WARNING) << "failed to read block " << range.first;
+        return false;
+      }
+      so_far += r;
     }
-    pos = 7;
+    data += size;
   }
+  return true;
+}
 
-  // Source blocks in stash only, no work to do.
-  if (params.tokens[pos] == "-") {
-    return;
-  }
+// The space-separated tokens of a transfer command. They're views into the transfer list.
+class CommandTokens {
+ public:
+  CommandTokens() = default;
+  CommandTokens(const std::string_view* tokens, size_t size) : tokens_(tokens), size_(size) {}
 
-  RangeSet src = RangeSet::Parse(params.tokens[pos++]);
-  if (!src) {
-    LOG(ERROR) << "Failed to parse range in " << params.cmdline;
-    return;
+  const std::string_view& operator[](size_t i) const {
+    return tokens_[i];
   }
 
-  RangeSet locs;
-  // If there's no stashed blocks, content in the buffer is consecutive and has the same
-  // order as the source blocks.
-  if (pos == params.tokens.size()) {
-    locs = RangeSet(std::vector<Range>{ Range{ 0, src.blocks() } });
-  } else {
-    // Otherwise, the next token is the offset of the source blocks in the target range.
-    // Example: for the tokens <4,63946,63947,63948,63979> <4,6,7,8,39> <stashed_blocks>;
-    // We want to print SHA-1 for the data in buffer[6], buffer[8], buffer[9] ... buffer[38];
-    // this corresponds to the 32 src blocks #63946, #63948, #63949 ... #63978.
-    locs = RangeSet::Parse(params.tokens[pos++]);
-    CHECK_EQ(src.blocks(), locs.blocks());
+  size_t size() const {
+    return size_;
   }
 
-  LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
-  for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
-    size_t buffer_index = locs.GetBlockNumber(i);
-    CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
+ private:
+  const std::string_view* tokens_ = nullptr;
+  size_t size_ = 0;
+};
 
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
-    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+/**
+ * TransferList splits the transfer list into lines, and each line into tokens, in a single pass.
+ * The lines and tokens are views into the transfer list contents, which must outlive the
+ * TransferList; and the tokens of all the lines share one array. An empty line has no tokens.
+ */
+class TransferList {
+ public:
+  explicit TransferList(std::string_view content) {
+    size_t line_start = 0;
+    while (true) {
+      size_t line_end = content.find('\n', line_start);
+      std::string_view line = content.substr(line_start, line_end - line_start);
+      lines_.push_back(line);
+      token_offsets_.push_back(tokens_.size());
+      if (!line.empty()) {
+        size_t token_start = 0;
+        while (true) {
+          size_t token_end = line.find(' ', token_start);
+          tokens_.push_back(line.substr(token_start, token_end - token_start));
+          if (token_end == std::string_view::npos) {
+            break;
+          }
+          token_start = token_end + 1;
+        }
+      }
+      if (line_end == std::string_view::npos) {
+        break;
+      }
+      line_start = line_end + 1;
+    }
+    token_offsets_.push_back(tokens_.size());
   }
-}
 
-// If the calculated hash for the whole stash doesn't match the stash id, print the SHA-1
-// in hex for each block.
-static void PrintHashForCorruptedStashedBlocks(const std::string& id,
-                                               const std::vector<uint8_t>& buffer,
-                                               const RangeSet& src) {
-  LOG(INFO) << "printing hash in hex for stash_id: " << id;
-  CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
-
-  for (size_t i = 0; i < src.blocks(); i++) {
-    size_t block_num = src.GetBlockNumber(i);
+  size_t size() const {
+    return lines_.size();
+  }
 
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
-    std::string hexdigest = print_sha1(digest);
-    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+  std::string_view line(size_t i) const {
+    return lines_[i];
   }
-}
 
-// If the stash file doesn't exist, read the source blocks this stash contains and print the
-// SHA-1 for these blocks.
-static void PrintHashForMissingStashedBlocks(const std::string& id, int fd) {
-  if (stash_map.find(id) == stash_map.end()) {
-    LOG(ERROR) << "No stash saved for id: " << id;
-    return;
+  CommandTokens tokens(size_t i) const {
+    return CommandTokens(tokens_.data() + token_offsets_[i],
+                         token_offsets_[i + 1] - token_offsets_[i]);
   }
 
-  LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
-  const RangeSet& src = stash_map[id];
-  std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
-  if (ReadBlocks(src, buffer, fd) == -1) {
-      LOG(ERROR) << "failed to read source blocks for stash: " << id;
-      return;
+ private:
+  std::vector<std::string_view> lines_;
+  std::vector<std::string_view> tokens_;
+  // The tokens of the i-th line are tokens_[token_offsets_[i]] to tokens_[token_offsets_[i + 1]].
+  std::vector<size_t> token_offsets_;
+};
+
+// Splits a "<stash_id>:<stash_range>" token. Returns false if it doesn't have exactly one colon.
+static bool SplitStashToken(std::string_view token, std::string_view* id,
+                            std::string_view* range) {
+  size_t colon = token.find(':');
+  if (colon == std::string_view::npos || token.find(':', colon + 1) != std::string_view::npos) {
+    return false;
   }
-  PrintHashForCorruptedStashedBlocks(id, buffer, src);
+  *id = token.substr(0, colon);
+  *range = token.substr(colon + 1);
+  return true;
 }
 
-static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
-        const size_t blocks, bool printerror) {
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    const uint8_t* data = buffer.data();
-
-    SHA1(data, blocks * BLOCKSIZE, digest);
+// The blocks that a transfer command reads from, and writes to the target partition.
+struct CommandRanges {
+  // Whether the command line has been parsed successfully. Read-ahead never goes past a command
+  // that we fail to parse, as we don't know which blocks it's going to write.
+  bool valid = false;
+  // Ranges in the order that the command reads them.
+  std::vector<RangeSet> reads;
+  RangeSet writes;
+  // The id of the stash created by a 'stash' command.
+  std::string stash_id;
+};
 
-    std::string hexdigest = print_sha1(digest);
+static CommandRanges ParseCommandRanges(const CommandTokens& tokens) {
+  CommandRanges result;
+  if (tokens.size() == 0) {
+    result.valid = true;
+    return result;
+  }
 
-    if (hexdigest != expected) {
-        if (printerror) {
-            LOG(ERROR) << "failed to verify blocks (expected " << expected << ", read "
-                       << hexdigest << ")";
-        }
-        return -1;
+  std::string_view cmdname = tokens[0];
+  if (cmdname == "move" || cmdname == "bsdiff" || cmdname == "imgdiff") {
+    // move <hash> <tgt_range> <src_block_count> <src_range> ...
+    // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_block_count> <src_range> ...
+    size_t pos = (cmdname == "move") ? 2 : 5;
+    if (pos + 2 >= tokens.size()) {
+      return result;
+    }
+    RangeSet tgt = RangeSet::Parse(tokens[pos]);
+    if (!tgt) {
+      return result;
+    }
+    // LoadSrcTgtVersion3() reads the target blocks first, to see if the command is already done.
+    result.reads.push_back(tgt);
+    if (tokens[pos + 2] != "-") {
+      RangeSet src = RangeSet::Parse(tokens[pos + 2]);
+      if (!src) {
+        return result;
+      }
+      result.reads.push_back(std::move(src));
     }
+    result.writes = std::move(tgt);
+  } else if (cmdname == "stash") {
+    // stash <stash_id> <src_range>
+    if (tokens.size() < 3) {
+      return result;
+    }
+    RangeSet src = RangeSet::Parse(tokens[2]);
+    if (!src) {
+      return result;
+    }
+    result.reads.push_back(std::move(src));
+    result.stash_id = std::string(tokens[1]);
+  } else if (cmdname == "new" || cmdname == "zero" || cmdname == "erase") {
+    // new|zero|erase <tgt_range>
+    if (tokens.size() < 2) {
+      return result;
+    }
+    result.writes = RangeSet::Parse(tokens[1]);
+    if (!result.writes) {
+      return result;
+    }
+  } else if (cmdname != "free") {
+    return result;
+  }
 
-    return 0;
+  result.valid = true;
+  return result;
 }
 
-static std::string GetStashFileName(const std::string& base, const std::string& id,
-        const std::string& postfix) {
-    if (base.empty()) {
-        return "";
+/**
+ * SourcePrefetcher reads the blocks needed by the upcoming transfer commands on a background
+ * thread, so that the reads overlap with the patching and writing of the current command.
+ *
+ * Before executing each command, the main thread calls Advance() with the command index. The
+ * prefetcher then looks at up to PREFETCH_MAX_COMMANDS commands ahead, and queues their reads as
+ * long as the buffers fit in its budget (up to PREFETCH_MAX_BYTES). It stops at the first command
+ * that reads any block written by an earlier command that hasn't been executed yet; that command
+ * will be reconsidered once the conflicting writes are done. As a result, prefetched data always
+ * matches what a direct read would return at the time the command runs.
+ *
+ * The commands claim the data with Take(). A read that hasn't been prefetched (or failed in the
+ * background) is reported as a miss, and the caller falls back to reading the blocks directly.
+ */
+class SourcePrefetcher {
+ public:
+  // |commands| are the parsed ranges of the transfer commands indexed by the command index.
+  // Commands before |first_command| won't be executed and are never prefetched. Writes are ignored
+  // if |canwrite| is false (i.e. in verification mode). The buffers are limited to |max_bytes|.
+  SourcePrefetcher(const std::vector<CommandRanges>& commands, int first_command, bool canwrite,
+                   size_t max_bytes)
+      : commands_(commands),
+        next_command_(std::max(first_command, 0)),
+        canwrite_(canwrite),
+        max_bytes_(max_bytes) {}
+
+  ~SourcePrefetcher() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      cv_.notify_all();
+      thread_.join();
     }
+  }
 
-    std::string fn(CacheLocation::location().stash_directory_base());
-    fn += "/" + base + "/" + id + postfix;
+  // Opens a separate fd on the block device and starts the background thread.
+  bool Start(const std::string& blockdev) {
+    fd_.reset(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY)));
+    if (fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << blockdev << " for read-ahead";
+      return false;
+    }
+    thread_ = std::thread(&SourcePrefetcher::ThreadLoop, this);
+    return true;
+  }
 
-    return fn;
-}
+  // Called before executing the command at |cmdindex|. Drops the unclaimed data for the earlier
+  // commands and schedules the reads for the upcoming ones.
+  void Advance(int cmdindex) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    DiscardBefore(cmdindex, &lock);
 
-// Does a best effort enumeration of stash files. Ignores possible non-file items in the stash
-// directory and continues despite of errors. Calls the 'callback' function for each file.
-static void EnumerateStash(const std::string& dirname,
-                           const std::function<void(const std::string&)>& callback) {
-  if (dirname.empty()) return;
+    size_t current = static_cast<size_t>(cmdindex);
+    while (!pending_writes_.empty() && pending_writes_.front().first < current) {
+      pending_writes_.pop_front();
+    }
+    if (next_command_ <= current) {
+      pending_writes_.clear();
+      if (current < commands_.size()) {
+        AddPendingWrites(current);
+      }
+      next_command_ = current + 1;
+    }
 
-  std::unique_ptr<DIR, decltype(&closedir)> directory(opendir(dirname.c_str()), closedir);
+    bool scheduled = false;
+    for (; next_command_ < commands_.size() && next_command_ <= current + PREFETCH_MAX_COMMANDS;
+         next_command_++) {
+      const CommandRanges& command = commands_[next_command_];
+      if (!command.valid) {
+        break;
+      }
 
-  if (directory == nullptr) {
-    if (errno != ENOENT) {
-      PLOG(ERROR) << "opendir \"" << dirname << "\" failed";
+      size_t size = 0;
+      bool conflict = false;
+      for (const auto& ranges : command.reads) {
+        size += ranges.blocks() * BLOCKSIZE;
+        for (const auto& pending : pending_writes_) {
+          conflict = conflict || ranges.Overlaps(pending.second);
+        }
+      }
+      if (conflict) {
+        break;
+      }
+      // Skip the commands that would never fit; and wait for the buffers to be claimed otherwise.
+      if (size <= max_bytes_) {
+        if (reserved_bytes_ + size > max_bytes_) {
+          break;
+        }
+        TrimBuffers(size);
+        for (const auto& ranges : command.reads) {
+          Job job;
+          job.cmdindex = next_command_;
+          job.ranges = ranges;
+          job.data = AllocateBuffer(ranges.blocks() * BLOCKSIZE);
+          reserved_bytes_ += job.data.capacity();
+          jobs_.push_back(std::move(job));
+          scheduled = true;
+        }
+      }
+      AddPendingWrites(next_command_);
     }
-    return;
-  }
 
-  dirent* item;
-  while ((item = readdir(directory.get())) != nullptr) {
-    if (item->d_type != DT_REG) continue;
-    callback(dirname + "/" + item->d_name);
+    if (scheduled) {
+      lock.unlock();
+      cv_.notify_all();
+    }
   }
-}
 
-// Deletes the stash directory and all files in it. Assumes that it only
-// contains files. There is nothing we can do about unlikely, but possible
-// errors, so they are merely logged.
-static void DeleteFile(const std::string& fn) {
-  if (fn.empty()) return;
+  // Copies the prefetched blocks of |ranges| for the command at |cmdindex| into |data|. Returns
+  // false if the blocks are not available.
+  bool Take(int cmdindex, const RangeSet& ranges, uint8_t* data) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = std::find_if(jobs_.begin(), jobs_.end(), [&](const Job& job) {
+      return job.cmdindex == static_cast<size_t>(cmdindex) && job.ranges == ranges;
+    });
+    if (it == jobs_.end()) {
+      misses_++;
+      return false;
+    }
 
-  LOG(INFO) << "deleting " << fn;
+    // The read is in flight; it's cheaper to wait for it than to read the blocks again.
+    cv_.wait(lock, [&it] { return it->state != Job::READING; });
 
-  if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
-    PLOG(ERROR) << "unlink \"" << fn << "\" failed";
+    bool hit = (it->state == Job::READY);
+    if (hit) {
+      memcpy(data, it->data.data(), ranges.blocks() * BLOCKSIZE);
+      hits_++;
+      hit_blocks_ += ranges.blocks();
+    } else {
+      misses_++;
+    }
+    ReleaseJob(it);
+    return hit;
   }
-}
 
-static void DeleteStash(const std::string& base) {
-  if (base.empty()) return;
+  void LogStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG(INFO) << "read-ahead served " << hits_ << " reads (" << hit_blocks_ << " blocks); "
+              << misses_ << " reads missed";
+  }
 
-  LOG(INFO) << "deleting stash " << base;
+ private:
+  struct Job {
+    enum State { QUEUED, READING, READY, FAILED };
 
-  std::string dirname = GetStashFileName(base, "", "");
-  EnumerateStash(dirname, DeleteFile);
+    size_t cmdindex;
+    RangeSet ranges;
+    State state = QUEUED;
+    std::vector<uint8_t> data;
+  };
 
-  if (rmdir(dirname.c_str()) == -1) {
-    if (errno != ENOENT && errno != ENOTDIR) {
-      PLOG(ERROR) << "rmdir \"" << dirname << "\" failed";
+  void AddPendingWrites(size_t cmdindex) {
+    if (canwrite_ && commands_[cmdindex].writes) {
+      pending_writes_.emplace_back(cmdindex, commands_[cmdindex].writes);
     }
   }
-}
 
-static int LoadStash(CommandParameters& params, const std::string& id, bool verify, size_t* blocks,
-                     std::vector<uint8_t>& buffer, bool printnoent) {
-  // In verify mode, if source range_set was saved for the given hash, check contents in the source
-  // blocks first. If the check fails, search for the stashed files on /cache as usual.
-  if (!params.canwrite) {
-    if (stash_map.find(id) != stash_map.end()) {
-      const RangeSet& src = stash_map[id];
-      allocate(src.blocks() * BLOCKSIZE, buffer);
+  // Drops the pooled buffers until |size| more bytes fit in the budget along with them. The buffers
+  // taken from the pool are already counted, so the allocations that follow stay within it.
+  void TrimBuffers(size_t size) {
+    while (!free_buffers_.empty() && reserved_bytes_ + pooled_bytes_ + size > max_bytes_) {
+      pooled_bytes_ -= free_buffers_.back().capacity();
+      free_buffers_.pop_back();
+    }
+  }
 
-      if (ReadBlocks(src, buffer, params.fd) == -1) {
-        LOG(ERROR) << "failed to read source blocks in stash map.";
-        return -1;
-      }
-      if (VerifyBlocks(id, buffer, src.blocks(), true) != 0) {
-        LOG(ERROR) << "failed to verify loaded source blocks in stash map.";
-        PrintHashForCorruptedStashedBlocks(id, buffer, src);
-        return -1;
+  // Takes a buffer from the pool if there's one large enough.
+  std::vector<uint8_t> AllocateBuffer(size_t size) {
+    for (auto it = free_buffers_.begin(); it != free_buffers_.end(); it++) {
+      if (it->capacity() >= size) {
+        std::vector<uint8_t> buffer = std::move(*it);
+        free_buffers_.erase(it);
+        pooled_bytes_ -= buffer.capacity();
+        buffer.resize(size);
+        return buffer;
       }
-      return 0;
     }
+    return std::vector<uint8_t>(size);
   }
 
-  size_t blockcount = 0;
-  if (!blocks) {
-    blocks = &blockcount;
+  // Returns the job's buffer to the pool, and removes the job. Requires |mutex_| to be held.
+  void ReleaseJob(std::list<Job>::iterator it) {
+    reserved_bytes_ -= it->data.capacity();
+    if (free_buffers_.size() < kMaxFreeBuffers) {
+      pooled_bytes_ += it->data.capacity();
+      free_buffers_.push_back(std::move(it->data));
+    }
+    jobs_.erase(it);
+  }
+
+  void DiscardBefore(int cmdindex, std::unique_lock<std::mutex>* lock) {
+    auto stale = [cmdindex](const Job& job) { return job.cmdindex < static_cast<size_t>(cmdindex); };
+    // Don't pull the buffer from under the background thread.
+    cv_.wait(*lock, [this, &stale] {
+      return std::none_of(jobs_.begin(), jobs_.end(), [&stale](const Job& job) {
+        return stale(job) && job.state == Job::READING;
+      });
+    });
+    for (auto it = jobs_.begin(); it != jobs_.end();) {
+      auto current = it++;
+      if (stale(*current)) {
+        ReleaseJob(current);
+      }
+    }
   }
 
-  std::string fn = GetStashFileName(params.stashbase, id, "");
+  void ThreadLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      auto queued = jobs_.end();
+      cv_.wait(lock, [this, &queued] {
+        queued = std::find_if(jobs_.begin(), jobs_.end(),
+                              [](const Job& job) { return job.state == Job::QUEUED; });
+        return stopping_ || queued != jobs_.end();
+      });
+      if (stopping_) {
+        return;
+      }
 
-  struct stat sb;
-  if (stat(fn.c_str(), &sb) == -1) {
-    if (errno != ENOENT || printnoent) {
-      PLOG(ERROR) << "stat \"" << fn << "\" failed";
-      PrintHashForMissingStashedBlocks(id, params.fd);
+      // The job stays in the list while it's being read; DiscardBefore() and Take() wait for it.
+      queued->state = Job::READING;
+      lock.unlock();
+      bool success = ReadBlocksInBackground(fd_, queued->ranges, queued->data.data());
+      lock.lock();
+      queued->state = success ? Job::READY : Job::FAILED;
+      cv_.notify_all();
     }
-    return -1;
   }
 
-  LOG(INFO) << " loading " << fn;
+  static constexpr size_t kMaxFreeBuffers = 4;
+
+  const std::vector<CommandRanges>& commands_;
+  // The first command that hasn't been considered for read-ahead.
+  size_t next_command_;
+  const bool canwrite_;
+  const size_t max_bytes_;
+  // The writes of the commands between the current one and |next_command_|, which haven't been
+  // executed yet.
+  std::list<std::pair<size_t, RangeSet>> pending_writes_;
+
+  android::base::unique_fd fd_;
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+
+  std::list<Job> jobs_;
+  std::vector<std::vector<uint8_t>> free_buffers_;
+  // The capacity of the buffers held by the jobs and by the pool, which together stay within
+  // |max_bytes_|.
+  size_t reserved_bytes_ = 0;
+  size_t pooled_bytes_ = 0;
+
+  size_t hits_ = 0;
+  size_t hit_blocks_ = 0;
+  size_t misses_ = 0;
+};
 
-  if ((sb.st_size % BLOCKSIZE) != 0) {
-    LOG(ERROR) << fn << " size " << sb.st_size << " not multiple of block size " << BLOCKSIZE;
-    return -1;
+/**
+ * BlockCache keeps the blocks that the commands have read recently, so that the blocks read again
+ * by a later command (e.g. the source of a stash that's also read by the next diff) come from
+ * memory instead of the device. The least recently used blocks are dropped beyond the budget.
+ *
+ * It also remembers the ranges whose contents have been verified against a hash, so that the same
+ * blocks aren't hashed again for the same hash. Once a command writes to some blocks, the cached
+ * data and the verified ranges that cover them are dropped. The cache is only used by the main
+ * thread.
+ */
+class BlockCache {
+ public:
+  explicit BlockCache(size_t capacity) : capacity_(capacity / BLOCKSIZE) {}
+
+  // Copies the blocks of |ranges| to |out| if all of them are cached.
+  bool Read(const RangeSet& ranges, uint8_t* out) {
+    for (const auto& range : ranges) {
+      for (size_t block = range.first; block < range.second; block++) {
+        if (blocks_.find(block) == blocks_.end()) {
+          misses_++;
+          return false;
+        }
+      }
+    }
+    for (const auto& range : ranges) {
+      for (size_t block = range.first; block < range.second; block++) {
+        Entry& entry = blocks_.at(block);
+        memcpy(out, entry.data.data(), BLOCKSIZE);
+        lru_.splice(lru_.begin(), lru_, entry.lru);
+        out += BLOCKSIZE;
+      }
+    }
+    hits_++;
+    hit_blocks_ += ranges.blocks();
+    return true;
   }
 
-  android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_RDONLY)));
-  if (fd == -1) {
-    PLOG(ERROR) << "open \"" << fn << "\" failed";
-    return -1;
+  // Keeps a copy of the blocks of |ranges|, which have been read into |data|.
+  void Insert(const RangeSet& ranges, const uint8_t* data) {
+    // Don't let a single large read flush the cache.
+    if (ranges.blocks() > capacity_ / 2) {
+      return;
+    }
+    for (const auto& range : ranges) {
+      for (size_t block = range.first; block < range.second; block++, data += BLOCKSIZE) {
+        auto it = blocks_.find(block);
+        if (it == blocks_.end()) {
+          std::vector<uint8_t> buffer;
+          if (blocks_.size() >= capacity_) {
+            // Reuse the buffer of the least recently used block.
+            auto victim = blocks_.find(lru_.back());
+            buffer = std::move(victim->second.data);
+            lru_.pop_back();
+            blocks_.erase(victim);
+          } else {
+            buffer.resize(BLOCKSIZE);
+          }
+          lru_.push_front(block);
+          it = blocks_.emplace(block, Entry{ std::move(buffer), lru_.begin() }).first;
+        } else {
+          lru_.splice(lru_.begin(), lru_, it->second.lru);
+        }
+        memcpy(it->second.data.data(), data, BLOCKSIZE);
+      }
+    }
   }
 
-  allocate(sb.st_size, buffer);
-
-  if (read_all(fd, buffer, sb.st_size) == -1) {
-    return -1;
+  // Drops the blocks of |ranges|, which are about to be, or have been, overwritten.
+  void Invalidate(const RangeSet& ranges) {
+    for (const auto& range : ranges) {
+      auto it = blocks_.lower_bound(range.first);
+      while (it != blocks_.end() && it->first < range.second) {
+        lru_.erase(it->second.lru);
+        it = blocks_.erase(it);
+      }
+    }
+    verified_.remove_if(
+        [&ranges](const auto& verified) { return verified.second.Overlaps(ranges); });
   }
 
-  *blocks = sb.st_size / BLOCKSIZE;
+  // Drops everything, for a command that may write anywhere.
+  void Clear() {
+    blocks_.clear();
+    lru_.clear();
+    verified_.clear();
+  }
 
-  if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
-    LOG(ERROR) << "unexpected contents in " << fn;
-    if (stash_map.find(id) == stash_map.end()) {
-      LOG(ERROR) << "failed to find source blocks number for stash " << id
-                 << " when executing command: " << params.cmdname;
-    } else {
-      const RangeSet& src = stash_map[id];
-      PrintHashForCorruptedStashedBlocks(id, buffer, src);
+  // Returns true if |ranges| have been verified to match |hash|, and haven't been written since.
+  bool IsVerified(const std::string& hash, const RangeSet& ranges) {
+    for (const auto& verified : verified_) {
+      if (verified.first == hash && verified.second == ranges) {
+        verified_hits_++;
+        return true;
+      }
     }
-    DeleteFile(fn);
-    return -1;
+    return false;
   }
 
-  return 0;
-}
-
-static int WriteStash(const std::string& base, const std::string& id, int blocks,
-                      std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
-    if (base.empty()) {
-        return -1;
+  void SetVerified(const std::string& hash, const RangeSet& ranges) {
+    if (IsVerified(hash, ranges)) {
+      return;
     }
-
-    if (checkspace && CacheSizeCheck(blocks * BLOCKSIZE) != 0) {
-        LOG(ERROR) << "not enough space to write stash";
-        return -1;
+    verified_.emplace_front(hash, ranges);
+    if (verified_.size() > BLOCK_CACHE_MAX_VERIFIED) {
+      verified_.pop_back();
     }
+  }
 
-    std::string fn = GetStashFileName(base, id, ".partial");
-    std::string cn = GetStashFileName(base, id, "");
+  void LogStats() const {
+    LOG(INFO) << "block cache served " << hits_ << " reads (" << hit_blocks_ << " blocks); "
+              << misses_ << " reads missed; skipped " << verified_hits_ << " verifications";
+  }
 
-    if (exists) {
-        struct stat sb;
-        int res = stat(cn.c_str(), &sb);
+ private:
+  struct Entry {
+    std::vector<uint8_t> data;
+    std::list<size_t>::iterator lru;
+  };
 
-        if (res == 0) {
-            // The file already exists and since the name is the hash of the contents,
-            // it's safe to assume the contents are identical (accidental hash collisions
-            // are unlikely)
-            LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
-            *exists = true;
-            return 0;
-        }
+  const size_t capacity_;
+  // The cached blocks by block number, and the block numbers from the most recently used.
+  std::map<size_t, Entry> blocks_;
+  std::list<size_t> lru_;
+  // The recently verified hashes and ranges, from the most recent.
+  std::list<std::pair<std::string, RangeSet>> verified_;
+
+  size_t hits_ = 0;
+  size_t hit_blocks_ = 0;
+  size_t misses_ = 0;
+  size_t verified_hits_ = 0;
+};
 
-        *exists = false;
-    }
+/**
+ * MemoryBudget caps the buffer that the transfer commands load their blocks into. A move larger
+ * than the budget is copied in chunks (see MoveInChunks()). The other commands still need their
+ * whole source in memory, e.g. for bsdiff to seek in it; the buffer is released after such a
+ * command, so that it doesn't stay at its largest size for the rest of the update.
+ */
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(size_t budget) : budget_(budget) {}
 
-    LOG(INFO) << " writing " << blocks << " blocks to " << cn;
+  bool Fits(size_t size) const {
+    return size <= budget_;
+  }
 
-    android::base::unique_fd fd(
-        TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE)));
-    if (fd == -1) {
-        PLOG(ERROR) << "failed to create \"" << fn << "\"";
-        return -1;
-    }
+  // The number of blocks that a move copies at a time.
+  size_t chunk_blocks() const {
+    return std::max<size_t>(1, std::min(MOVE_CHUNK_BLOCKS, budget_ / BLOCKSIZE));
+  }
 
-    if (fchown(fd, AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
-        PLOG(ERROR) << "failed to chown \"" << fn << "\"";
-        return -1;
+  // Called after each command, with the buffer that the command has used.
+  void Release(std::vector<uint8_t>& buffer) {
+    peak_ = std::max(peak_, buffer.size());
+    if (!Fits(buffer.size())) {
+      over_budget_++;
+      std::vector<uint8_t>().swap(buffer);
     }
+  }
 
-    if (write_all(fd, buffer, blocks * BLOCKSIZE) == -1) {
-        return -1;
-    }
+  void AddChunkedMove() {
+    chunked_moves_++;
+  }
 
-    if (ota_fsync(fd) == -1) {
-        failure_type = kFsyncFailure;
-        PLOG(ERROR) << "fsync \"" << fn << "\" failed";
-        return -1;
-    }
+  void LogStats() const {
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    LOG(INFO) << "command buffer peaked at " << peak_ << " bytes (budget " << budget_ << " bytes); "
+              << over_budget_ << " commands went over the budget; " << chunked_moves_
+              << " moves copied in chunks; peak RSS " << usage.ru_maxrss << " KiB";
+  }
 
-    if (rename(fn.c_str(), cn.c_str()) == -1) {
-        PLOG(ERROR) << "rename(\"" << fn << "\", \"" << cn << "\") failed";
-        return -1;
-    }
+ private:
+  const size_t budget_;
+  size_t peak_ = 0;
+  size_t over_budget_ = 0;
+  size_t chunked_moves_ = 0;
+};
 
-    std::string dname = GetStashFileName(base, "", "");
-    android::base::unique_fd dfd(TEMP_FAILURE_RETRY(ota_open(dname.c_str(),
-                                                             O_RDONLY | O_DIRECTORY)));
-    if (dfd == -1) {
-        failure_type = kFileOpenFailure;
-        PLOG(ERROR) << "failed to open \"" << dname << "\" failed";
-        return -1;
+class MemoryStash;
+class PatchScheduler;
+struct PatchResult;
+class VerifyScheduler;
+struct VerifyResult;
+
+// Parameters for transfer list command functions
+struct CommandParameters {
+    CommandTokens tokens;
+    size_t cpos;
+    int cmdindex;
+    std::string_view cmdname;
+    std::string_view cmdline;
+    std::string_view previous_cmdline;
+    std::string freestash;
+    std::string stashbase;
+    bool canwrite;
+    int createdstash;
+    android::base::unique_fd fd;
+    // The block device opened with O_DIRECT, if enabled.
+    android::base::unique_fd direct_fd;
+    bool foundwrites;
+    bool isunresumable;
+    int version;
+    size_t written;
+    size_t stashed;
+    NewThreadInfo nti;
+    pthread_t thread;
+    // The bytes at the start of the new data to drop, which have been written before resuming.
+    uint64_t new_data_discard;
+    // The 'new' command that has been interrupted, and the number of bytes it had written.
+    int new_data_resume_index;
+    size_t new_data_resume_bytes;
+    std::vector<uint8_t> buffer;
+    uint8_t* patch_start;
+    bool target_verified;  // The target blocks have expected contents already.
+    // The parsed ranges for all the commands, indexed by the command index.
+    std::vector<CommandRanges> command_ranges;
+    std::unique_ptr<MemoryStash> memory_stash;
+    std::unique_ptr<SourcePrefetcher> prefetcher;
+    std::unique_ptr<BlockCache> block_cache;
+    std::unique_ptr<MemoryBudget> memory_budget;
+    std::unique_ptr<PatchScheduler> patcher;
+    // The result from the patch workers for the current command, if any.
+    PatchResult* precomputed;
+    std::unique_ptr<VerifyScheduler> verifier;
+    // The result from the verify workers for the current command, if any.
+    VerifyResult* verified;
+    // The profiles of the executed commands, added up per command type.
+    std::map<std::string, CommandTypeProfile> profiles;
+    // The profiles of the slowest executed commands, up to PROFILE_TOP_COMMANDS of them.
+    std::vector<CommandProfile> slowest_commands;
+    CommandCheckpoint checkpoint;
+    BlockImageContext ctx;
+};
+
+// Profiles the command that's being executed by the main thread, until the end of the scope.
+class ScopedCommandProfile {
+ public:
+  explicit ScopedCommandProfile(CommandParameters& params)
+      : params_(params), written_(params.written), stashed_(params.stashed) {
+    profile_.cmdindex = params.cmdindex;
+    profile_.cmdname = params.cmdname;
+    profile_.start = profile_.mark = CommandProfile::Clock::now();
+    current_profile = &profile_;
+  }
+
+  ~ScopedCommandProfile() {
+    current_profile = nullptr;
+    profile_.Charge();
+    profile_.total_ms =
+        std::chrono::duration<double, std::milli>(profile_.mark - profile_.start).count();
+    profile_.blocks_written = params_.written - written_;
+    profile_.blocks_stashed = params_.stashed - stashed_;
+    params_.profiles[profile_.cmdname].Add(profile_);
+
+    // Keep the slowest commands as a min-heap on the total time, so that the fastest one of them
+    // is the one to go.
+    auto slower = [](const CommandProfile& a, const CommandProfile& b) {
+      return a.total_ms > b.total_ms;
+    };
+    std::vector<CommandProfile>& slowest = params_.slowest_commands;
+    if (slowest.size() < PROFILE_TOP_COMMANDS) {
+      slowest.push_back(std::move(profile_));
+      std::push_heap(slowest.begin(), slowest.end(), slower);
+    } else if (slower(profile_, slowest.front())) {
+      std::pop_heap(slowest.begin(), slowest.end(), slower);
+      slowest.back() = std::move(profile_);
+      std::push_heap(slowest.begin(), slowest.end(), slower);
     }
+  }
 
-    if (ota_fsync(dfd) == -1) {
-        failure_type = kFsyncFailure;
-        PLOG(ERROR) << "fsync \"" << dname << "\" failed";
+ private:
+  CommandParameters& params_;
+  CommandProfile profile_;
+  size_t written_;
+  size_t stashed_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedCommandProfile);
+};
+
+// Reads the given blocks for the current command. Uses the data from the block cache or the
+// read-ahead buffers if available.
+static int ReadCommandBlocks(CommandParameters& params, const RangeSet& ranges,
+                             std::vector<uint8_t>& buffer) {
+  ScopedPhase phase(kPhaseSourceRead);
+  if (current_profile != nullptr) {
+    current_profile->blocks_read += ranges.blocks();
+  }
+  if (params.block_cache != nullptr && params.block_cache->Read(ranges, buffer.data())) {
+    return 0;
+  }
+  if (!(params.prefetcher != nullptr && params.cmdindex != -1 &&
+        params.prefetcher->Take(params.cmdindex, ranges, buffer.data())) &&
+      ReadBlocks(params.ctx, ranges, buffer, params.fd) == -1) {
+    return -1;
+  }
+  if (params.block_cache != nullptr) {
+    params.block_cache->Insert(ranges, buffer.data());
+  }
+  return 0;
+}
+
+// Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
+// handled separately).
+static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
+                                              const std::vector<uint8_t>& buffer) {
+  LOG(INFO) << "unexpected contents of source blocks in cmd:\n" << params.cmdline;
+  CHECK(params.tokens[0] == "move" || params.tokens[0] == "bsdiff" ||
+        params.tokens[0] == "imgdiff");
+
+  size_t pos = 0;
+  // Command example:
+  // move <onehash> <tgt_range> <src_blk_count> <src_range> [<loc_range> <stashed_blocks>]
+  // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_blk_count> <src_range>
+  //        [<loc_range> <stashed_blocks>]
+  if (params.tokens[0] == "move") {
+    // src_range for move starts at the 4th position.
+    if (params.tokens.size() < 5) {
+      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
+      return;
+    }
+    pos = 4;
+  } else {
+    // src_range for diff starts at the 7th position.
+    if (params.tokens.size() < 8) {
+      LOG(ERROR) << "failed to parse source range in cmd:\n" << params.cmdline;
+      return;
+    }
+    pos = 7;
+  }
+
+  // Source blocks in stash only, no work to do.
+  if (params.tokens[pos] == "-") {
+    return;
+  }
+
+  RangeSet src = RangeSet::Parse(params.tokens[pos++]);
+  if (!src) {
+    LOG(ERROR) << "Failed to parse range in " << params.cmdline;
+    return;
+  }
+
+  RangeSet locs;
+  // If there's no stashed blocks, content in the buffer is consecutive and has the same
+  // order as the source blocks.
+  if (pos == params.tokens.size()) {
+    locs = RangeSet(std::vector<Range>{ Range{ 0, src.blocks() } });
+  } else {
+    // Otherwise, the next token is the offset of the source blocks in the target range.
+    // Example: for the tokens <4,63946,63947,63948,63979> <4,6,7,8,39> <stashed_blocks>;
+    // We want to print SHA-1 for the data in buffer[6], buffer[8], buffer[9] ... buffer[38];
+    // this corresponds to the 32 src blocks #63946, #63948, #63949 ... #63978.
+    locs = RangeSet::Parse(params.tokens[pos++]);
+    CHECK_EQ(src.blocks(), locs.blocks());
+  }
+
+  LOG(INFO) << "printing hash in hex for " << src.blocks() << " source blocks";
+  for (size_t i = 0; i < src.blocks(); i++) {
+    size_t block_num = src.GetBlockNumber(i);
+    size_t buffer_index = locs.GetBlockNumber(i);
+    CHECK_LE((buffer_index + 1) * BLOCKSIZE, buffer.size());
+
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(buffer.data() + buffer_index * BLOCKSIZE, BLOCKSIZE, digest);
+    std::string hexdigest = print_sha1(digest);
+    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+  }
+}
+
+// If the calculated hash for the whole stash doesn't match the stash id, print the SHA-1
+// in hex for each block.
+static void PrintHashForCorruptedStashedBlocks(const std::string& id,
+                                               const std::vector<uint8_t>& buffer,
+                                               const RangeSet& src) {
+  LOG(INFO) << "printing hash in hex for stash_id: " << id;
+  CHECK_EQ(src.blocks() * BLOCKSIZE, buffer.size());
+
+  for (size_t i = 0; i < src.blocks(); i++) {
+    size_t block_num = src.GetBlockNumber(i);
+
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(buffer.data() + i * BLOCKSIZE, BLOCKSIZE, digest);
+    std::string hexdigest = print_sha1(digest);
+    LOG(INFO) << "  block number: " << block_num << ", SHA-1: " << hexdigest;
+  }
+}
+
+// If the stash file doesn't exist, read the source blocks this stash contains and print the
+// SHA-1 for these blocks.
+static void PrintHashForMissingStashedBlocks(BlockImageContext& ctx, const std::string& id,
+                                             int fd) {
+  if (ctx.stash_map.find(id) == ctx.stash_map.end()) {
+    LOG(ERROR) << "No stash saved for id: " << id;
+    return;
+  }
+
+  LOG(INFO) << "print hash in hex for source blocks in missing stash: " << id;
+  const RangeSet& src = ctx.stash_map[id];
+  std::vector<uint8_t> buffer(src.blocks() * BLOCKSIZE);
+  if (ReadBlocks(ctx, src, buffer, fd) == -1) {
+      LOG(ERROR) << "failed to read source blocks for stash: " << id;
+      return;
+  }
+  PrintHashForCorruptedStashedBlocks(id, buffer, src);
+}
+
+static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
+        const size_t blocks, bool printerror) {
+    ScopedPhase phase(kPhaseHashVerify);
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    const uint8_t* data = buffer.data();
+
+    SHA1(data, blocks * BLOCKSIZE, digest);
+
+    std::string hexdigest = print_sha1(digest);
+
+    if (hexdigest != expected) {
+        if (printerror) {
+            LOG(ERROR) << "failed to verify blocks (expected " << expected << ", read "
+                       << hexdigest << ")";
+        }
         return -1;
     }
 
-    return 0;
-}
+    return 0;
+}
+
+static std::string GetStashFileName(const std::string& base, const std::string& id,
+        const std::string& postfix) {
+    if (base.empty()) {
+        return "";
+    }
+
+    std::string fn(CacheLocation::location().stash_directory_base());
+    fn += "/" + base + "/" + id + postfix;
+
+    return fn;
+}
+
+// Does a best effort enumeration of stash files. Ignores possible non-file items in the stash
+// directory and continues despite of errors. Calls the 'callback' function for each file.
+static void EnumerateStash(const std::string& dirname,
+                           const std::function<void(const std::string&)>& callback) {
+  if (dirname.empty()) return;
+
+  std::unique_ptr<DIR, decltype(&closedir)> directory(opendir(dirname.c_str()), closedir);
+
+  if (directory == nullptr) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "opendir \"" << dirname << "\" failed";
+    }
+    return;
+  }
+
+  dirent* item;
+  while ((item = readdir(directory.get())) != nullptr) {
+    if (item->d_type != DT_REG) continue;
+    callback(dirname + "/" + item->d_name);
+  }
+}
+
+// Deletes the stash directory and all files in it. Assumes that it only
+// contains files. There is nothing we can do about unlikely, but possible
+// errors, so they are merely logged.
+static void DeleteFile(const std::string& fn) {
+  if (fn.empty()) return;
+
+  LOG(INFO) << "deleting " << fn;
+
+  if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
+    PLOG(ERROR) << "unlink \"" << fn << "\" failed";
+  }
+}
+
+static void DeleteStash(const std::string& base) {
+  if (base.empty()) return;
+
+  LOG(INFO) << "deleting stash " << base;
+
+  std::string dirname = GetStashFileName(base, "", "");
+  EnumerateStash(dirname, DeleteFile);
+
+  if (rmdir(dirname.c_str()) == -1) {
+    if (errno != ENOENT && errno != ENOTDIR) {
+      PLOG(ERROR) << "rmdir \"" << dirname << "\" failed";
+    }
+  }
+}
+
+static int WriteStash(BlockImageContext& ctx, const std::string& base, const std::string& id,
+                      int blocks, std::vector<uint8_t>& buffer, bool checkspace, bool* exists);
+
+/**
+ * MemoryStash keeps the stashed blocks in memory up to a budget, so that most stashes never need to
+ * be written to and read back from /cache. A stash is looked up by its id (i.e. the SHA-1 of its
+ * contents), and it is verified once when it's created.
+ *
+ * A stash that only lives in memory is lost if the device reboots, in which case the commands since
+ * the last_command_file are executed again and recreate it from its source blocks. That's only
+ * safe as long as the source blocks are intact, and the last_command_file doesn't point past the
+ * command that created the stash. Therefore the main thread calls Persist() to write all the
+ * memory-only stashes to /cache before (a) a command overwrites the source blocks of any of them,
+ * (b) a checkpoint is recorded, and (c) it gives up on a failed update. When the budget runs
+ * out, the oldest stashes spill to their files on /cache.
+ *
+ * Only Load() may be called from the PatchScheduler workers; the other functions are called from
+ * the main thread.
+ */
+class MemoryStash {
+ public:
+  MemoryStash(BlockImageContext& ctx, size_t budget) : ctx_(ctx), budget_(budget) {}
+
+  // Stashes the first |blocks| blocks in |buffer| as |id|, which are read from |src|.
+  // |cmdindex| and |cmdline| describe the stash command, and they will be saved to the
+  // last_command_file once the stash is persisted; right away if |sync| is true. Returns 0 on
+  // success.
+  int Put(const std::string& base, const std::string& id, const RangeSet& src,
+          std::vector<uint8_t>& buffer, size_t blocks, int cmdindex, std::string_view cmdline,
+          bool sync) {
+    ScopedPhase phase(kPhaseStashStore);
+    size_t size = blocks * BLOCKSIZE;
+    last_command_index_ = cmdindex;
+    last_command_ = cmdline;
+    last_command_sync_ |= sync;
+    if (entries_.find(id) != entries_.end()) {
+      return 0;
+    }
+    if (size > budget_) {
+      spilled_++;
+      return WriteStash(ctx_, base, id, blocks, buffer, false, nullptr);
+    }
+
+    // Make room for the new stash, starting with the ones that are already on /cache.
+    for (bool persisted : { true, false }) {
+      for (auto it = order_.begin(); it != order_.end() && used_ + size > budget_;) {
+        Entry& entry = entries_.at(*it);
+        if (entry.persisted != persisted) {
+          it++;
+          continue;
+        }
+        if (!entry.persisted) {
+          if (WriteStash(ctx_, base, *it, entry.data.size() / BLOCKSIZE, entry.data, false,
+                         nullptr) != 0) {
+            return -1;
+          }
+          spilled_++;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= entry.data.size();
+        entries_.erase(*it);
+        it = order_.erase(it);
+      }
+    }
+
+    Entry entry;
+    entry.src = src;
+    entry.data.assign(buffer.begin(), buffer.begin() + size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.emplace(id, std::move(entry));
+    order_.push_back(id);
+    used_ += size;
+    kept_++;
+    return 0;
+  }
+
+  // Copies the stash |id| into |buffer| if it's held in memory.
+  bool Load(const std::string& id, std::vector<uint8_t>* buffer, size_t* blocks) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+      return false;
+    }
+    const std::vector<uint8_t>& data = it->second.data;
+    if (buffer->size() < data.size()) {
+      buffer->resize(data.size());
+    }
+    std::copy(data.begin(), data.end(), buffer->begin());
+    if (blocks != nullptr) {
+      *blocks = data.size() / BLOCKSIZE;
+    }
+    return true;
+  }
+
+  void Free(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it != entries_.end()) {
+      used_ -= it->second.data.size();
+      entries_.erase(it);
+      order_.remove(id);
+    }
+  }
+
+  // Returns true if |ranges| overlaps the source blocks of any memory-only stash.
+  bool Overlaps(const RangeSet& ranges) const {
+    if (!ranges) {
+      return false;
+    }
+    for (const auto& entry : entries_) {
+      if (!entry.second.persisted && entry.second.src.Overlaps(ranges)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Writes the memory-only stashes to /cache, and then records the last stash command to
+  // |checkpoint|. Returns false on failure.
+  bool Persist(const std::string& base, CommandCheckpoint* checkpoint) {
+    if (last_command_index_ == -1) {
+      return true;
+    }
+    for (const auto& id : order_) {
+      Entry& entry = entries_.at(id);
+      if (!entry.persisted) {
+        bool exists = false;
+        if (WriteStash(ctx_, base, id, entry.data.size() / BLOCKSIZE, entry.data, false,
+                       &exists) != 0) {
+          return false;
+        }
+        entry.persisted = true;
+        persisted_++;
+      }
+    }
+    if (!checkpoint->Record(last_command_index_, last_command_, last_command_sync_)) {
+      return false;
+    }
+    last_command_index_ = -1;
+    last_command_sync_ = false;
+    return true;
+  }
+
+  void LogStats() const {
+    LOG(INFO) << "kept " << kept_ << " stashes in memory (budget " << budget_ << " bytes); persisted "
+              << persisted_ << " and spilled " << spilled_ << " stashes to /cache";
+  }
+
+ private:
+  struct Entry {
+    RangeSet src;
+    std::vector<uint8_t> data;
+    // Whether the stash file has been written.
+    bool persisted = false;
+  };
+
+  BlockImageContext& ctx_;
+  const size_t budget_;
+  size_t used_ = 0;
+  // Guards |entries_| against the PatchScheduler workers. The main thread is the only writer.
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+  // The stash ids in the order they're created.
+  std::list<std::string> order_;
+
+  // The last stash command whose update to the last_command_file is pending.
+  int last_command_index_ = -1;
+  std::string last_command_;
+  bool last_command_sync_ = false;
+
+  size_t kept_ = 0;
+  size_t persisted_ = 0;
+  size_t spilled_ = 0;
+};
+
+static int LoadStash(CommandParameters& params, const std::string& id, bool verify, size_t* blocks,
+                     std::vector<uint8_t>& buffer, bool printnoent) {
+  ScopedPhase phase(kPhaseStashLoad);
+  // In verify mode, if source range_set was saved for the given hash, check contents in the source
+  // blocks first. If the check fails, search for the stashed files on /cache as usual.
+  if (!params.canwrite) {
+    if (params.ctx.stash_map.find(id) != params.ctx.stash_map.end()) {
+      const RangeSet& src = params.ctx.stash_map[id];
+      allocate(src.blocks() * BLOCKSIZE, buffer);
+
+      if (ReadBlocks(params.ctx, src, buffer, params.fd) == -1) {
+        LOG(ERROR) << "failed to read source blocks in stash map.";
+        return -1;
+      }
+      if (VerifyBlocks(id, buffer, src.blocks(), true) != 0) {
+        LOG(ERROR) << "failed to verify loaded source blocks in stash map.";
+        PrintHashForCorruptedStashedBlocks(id, buffer, src);
+        return -1;
+      }
+      return 0;
+    }
+  }
+
+  size_t blockcount = 0;
+  if (!blocks) {
+    blocks = &blockcount;
+  }
+
+  // The stashes in memory have been verified when they were created.
+  if (params.memory_stash != nullptr && params.memory_stash->Load(id, &buffer, blocks)) {
+    return 0;
+  }
+
+  std::string fn = GetStashFileName(params.stashbase, id, "");
+
+  struct stat sb;
+  if (stat(fn.c_str(), &sb) == -1) {
+    if (errno != ENOENT || printnoent) {
+      PLOG(ERROR) << "stat \"" << fn << "\" failed";
+      PrintHashForMissingStashedBlocks(params.ctx, id, params.fd);
+    }
+    return -1;
+  }
+
+  LOG(INFO) << " loading " << fn;
+
+  if ((sb.st_size % BLOCKSIZE) != 0) {
+    LOG(ERROR) << fn << " size " << sb.st_size << " not multiple of block size " << BLOCKSIZE;
+    return -1;
+  }
+
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "open \"" << fn << "\" failed";
+    return -1;
+  }
+
+  allocate(sb.st_size, buffer);
+
+  if (read_all(params.ctx, fd, buffer, sb.st_size) == -1) {
+    return -1;
+  }
+
+  *blocks = sb.st_size / BLOCKSIZE;
+
+  if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
+    LOG(ERROR) << "unexpected contents in " << fn;
+    if (params.ctx.stash_map.find(id) == params.ctx.stash_map.end()) {
+      LOG(ERROR) << "failed to find source blocks number for stash " << id
+                 << " when executing command: " << params.cmdname;
+    } else {
+      const RangeSet& src = params.ctx.stash_map[id];
+      PrintHashForCorruptedStashedBlocks(id, buffer, src);
+    }
+    DeleteFile(fn);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Writes a stash file of |blocks| blocks, whose contents are written to the fd by |write_data|.
+static int WriteStashFile(BlockImageContext& ctx, const std::string& base, const std::string& id,
+                          int blocks, bool checkspace, bool* exists,
+                          const std::function<int(int)>& write_data) {
+    ScopedPhase phase(kPhaseStashStore);
+    if (base.empty()) {
+        return -1;
+    }
+
+    if (checkspace && CacheSizeCheck(blocks * BLOCKSIZE) != 0) {
+        LOG(ERROR) << "not enough space to write stash";
+        return -1;
+    }
+
+    std::string fn = GetStashFileName(base, id, ".partial");
+    std::string cn = GetStashFileName(base, id, "");
+
+    if (exists) {
+        struct stat sb;
+        int res = stat(cn.c_str(), &sb);
+
+        if (res == 0) {
+            // The file already exists and since the name is the hash of the contents,
+            // it's safe to assume the contents are identical (accidental hash collisions
+            // are unlikely)
+            LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
+            *exists = true;
+            return 0;
+        }
+
+        *exists = false;
+    }
+
+    LOG(INFO) << " writing " << blocks << " blocks to " << cn;
+
+    android::base::unique_fd fd(
+        TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE)));
+    if (fd == -1) {
+        PLOG(ERROR) << "failed to create \"" << fn << "\"";
+        return -1;
+    }
+
+    if (fchown(fd, AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
+        PLOG(ERROR) << "failed to chown \"" << fn << "\"";
+        return -1;
+    }
+
+    if (write_data(fd) == -1) {
+        return -1;
+    }
+
+    if (ota_fsync(fd) == -1) {
+        ctx.failure_type = kFsyncFailure;
+        PLOG(ERROR) << "fsync \"" << fn << "\" failed";
+        return -1;
+    }
+
+    if (rename(fn.c_str(), cn.c_str()) == -1) {
+        PLOG(ERROR) << "rename(\"" << fn << "\", \"" << cn << "\") failed";
+        return -1;
+    }
+
+    std::string dname = GetStashFileName(base, "", "");
+    android::base::unique_fd dfd(TEMP_FAILURE_RETRY(ota_open(dname.c_str(),
+                                                             O_RDONLY | O_DIRECTORY)));
+    if (dfd == -1) {
+        ctx.failure_type = kFileOpenFailure;
+        PLOG(ERROR) << "failed to open \"" << dname << "\" failed";
+        return -1;
+    }
+
+    if (ota_fsync(dfd) == -1) {
+        ctx.failure_type = kFsyncFailure;
+        PLOG(ERROR) << "fsync \"" << dname << "\" failed";
+        return -1;
+    }
+
+    return 0;
+}
+
+static int WriteStash(BlockImageContext& ctx, const std::string& base, const std::string& id,
+                      int blocks, std::vector<uint8_t>& buffer, bool checkspace, bool* exists) {
+  return WriteStashFile(ctx, base, id, blocks, checkspace, exists, [&](int fd) {
+    return write_all(ctx, fd, buffer, blocks * BLOCKSIZE);
+  });
+}
+
+// Creates a directory for storing stash files and checks if the /cache partition
+// hash enough space for the expected amount of blocks we need to store. Returns
+// >0 if we created the directory, zero if it existed already, and <0 of failure.
+
+static int CreateStash(State* state, size_t maxblocks, const std::string& blockdev,
+                       std::string& base) {
+  if (blockdev.empty()) {
+    return -1;
+  }
+
+  // Stash directory should be different for each partition to avoid conflicts
+  // when updating multiple partitions at the same time, so we use the hash of
+  // the block device name as the base directory
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(blockdev.data()), blockdev.size(), digest);
+  base = print_sha1(digest);
+
+  std::string dirname = GetStashFileName(base, "", "");
+  struct stat sb;
+  int res = stat(dirname.c_str(), &sb);
+  size_t max_stash_size = maxblocks * BLOCKSIZE;
+
+  if (res == -1 && errno != ENOENT) {
+    ErrorAbort(state, kStashCreationFailure, "stat \"%s\" failed: %s", dirname.c_str(),
+               strerror(errno));
+    return -1;
+  } else if (res != 0) {
+    LOG(INFO) << "creating stash " << dirname;
+    res = mkdir(dirname.c_str(), STASH_DIRECTORY_MODE);
+
+    if (res != 0) {
+      ErrorAbort(state, kStashCreationFailure, "mkdir \"%s\" failed: %s", dirname.c_str(),
+                 strerror(errno));
+      return -1;
+    }
+
+    if (chown(dirname.c_str(), AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
+      ErrorAbort(state, kStashCreationFailure, "chown \"%s\" failed: %s", dirname.c_str(),
+                 strerror(errno));
+      return -1;
+    }
+
+    if (CacheSizeCheck(max_stash_size) != 0) {
+      ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu needed)",
+                 max_stash_size);
+      return -1;
+    }
+
+    return 1;  // Created directory
+  }
+
+  LOG(INFO) << "using existing stash " << dirname;
+
+  // If the directory already exists, calculate the space already allocated to stash files and check
+  // if there's enough for all required blocks. Delete any partially completed stash files first.
+  EnumerateStash(dirname, [](const std::string& fn) {
+    if (android::base::EndsWith(fn, ".partial")) {
+      DeleteFile(fn);
+    }
+  });
+
+  size_t existing = 0;
+  EnumerateStash(dirname, [&existing](const std::string& fn) {
+    if (fn.empty()) return;
+    struct stat sb;
+    if (stat(fn.c_str(), &sb) == -1) {
+      PLOG(ERROR) << "stat \"" << fn << "\" failed";
+      return;
+    }
+    existing += static_cast<size_t>(sb.st_size);
+  });
+
+  if (max_stash_size > existing) {
+    size_t needed = max_stash_size - existing;
+    if (CacheSizeCheck(needed) != 0) {
+      ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu more needed)",
+                 needed);
+      return -1;
+    }
+  }
+
+  return 0;  // Using existing directory
+}
+
+static int FreeStash(const std::string& base, const std::string& id) {
+  if (base.empty() || id.empty()) {
+    return -1;
+  }
+
+  DeleteFile(GetStashFileName(base, id, ""));
+
+  return 0;
+}
+
+// Source contains packed data, which we want to move to the locations given in locs in the dest
+// buffer. source and dest may be the same buffer.
+static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
+                      const std::vector<uint8_t>& source) {
+  const uint8_t* from = source.data();
+  uint8_t* to = dest.data();
+  size_t start = locs.blocks();
+  // Must do the movement backward.
+  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
+    size_t blocks = it->second - it->first;
+    start -= blocks;
+    memmove(to + (it->first * BLOCKSIZE), from + (start * BLOCKSIZE), blocks * BLOCKSIZE);
+  }
+}
+
+// Parses the "<src_range>|- [<src_loc>] [<stash_id>:<stash_range> ...]" tokens starting at |pos|,
+// i.e. the same layout as handled by LoadSourceBlocks().
+static bool ParseSourceTokens(const CommandTokens& tokens, size_t pos, RangeSet* src,
+                              RangeSet* src_loc,
+                              std::vector<std::pair<std::string, RangeSet>>* stashes) {
+  if (pos >= tokens.size()) {
+    return false;
+  }
+  if (tokens[pos] == "-") {
+    pos++;
+  } else {
+    *src = RangeSet::Parse(tokens[pos++]);
+    if (!*src) {
+      return false;
+    }
+    if (pos < tokens.size()) {
+      *src_loc = RangeSet::Parse(tokens[pos++]);
+      if (!*src_loc) {
+        return false;
+      }
+    }
+  }
+  for (; pos < tokens.size(); pos++) {
+    std::string_view id;
+    std::string_view range;
+    if (!SplitStashToken(tokens[pos], &id, &range)) {
+      return false;
+    }
+    RangeSet locs = RangeSet::Parse(range);
+    if (!locs) {
+      return false;
+    }
+    stashes->emplace_back(std::string(id), std::move(locs));
+  }
+  return true;
+}
+
+// The parsed arguments of a bsdiff/imgdiff command:
+//   <patch_offset> <patch_len> <src_hash> <tgt_hash> <tgt_range> <src_block_count> <src_range>|-
+//   [<src_loc>] [<stash_id>:<stash_range> ...]
+struct DiffCommand {
+  bool imgdiff;
+  size_t patch_offset;
+  size_t patch_len;
+  std::string src_hash;
+  RangeSet tgt;
+  size_t src_blocks;
+  RangeSet src;
+  RangeSet src_loc;
+  std::vector<std::pair<std::string, RangeSet>> stashes;
+};
+
+static bool ParseDiffCommand(const CommandTokens& tokens, DiffCommand* cmd) {
+  if (tokens.size() < 8 || (tokens[0] != "bsdiff" && tokens[0] != "imgdiff")) {
+    return false;
+  }
+  cmd->imgdiff = (tokens[0] == "imgdiff");
+  if (!ParseUint(tokens[1], &cmd->patch_offset) || !ParseUint(tokens[2], &cmd->patch_len) ||
+      !ParseUint(tokens[6], &cmd->src_blocks)) {
+    return false;
+  }
+  cmd->src_hash = std::string(tokens[3]);
+  cmd->tgt = RangeSet::Parse(tokens[5]);
+  if (!cmd->tgt) {
+    return false;
+  }
+  return ParseSourceTokens(tokens, 7, &cmd->src, &cmd->src_loc, &cmd->stashes);
+}
+
+// Loads the stash file on a background thread. Returns false if the stash is missing or can't be
+// read, in which case the main thread will report the error when it executes the command.
+static bool LoadStashInBackground(const std::string& base, const MemoryStash* memory_stash,
+                                  const std::string& id, std::vector<uint8_t>* buffer) {
+  if (memory_stash != nullptr && memory_stash->Load(id, buffer, nullptr)) {
+    return true;
+  }
+  std::string fn = GetStashFileName(base, id, "");
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(fn.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    return false;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb) == -1 || (sb.st_size % BLOCKSIZE) != 0) {
+    return false;
+  }
+  buffer->resize(sb.st_size);
+  size_t so_far = 0;
+  while (so_far < buffer->size()) {
+    ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd, buffer->data() + so_far, buffer->size() - so_far));
+    if (r <= 0) {
+      return false;
+    }
+    so_far += r;
+  }
+  return true;
+}
+
+// The result of a bsdiff/imgdiff command that has been patched by a PatchScheduler worker.
+struct PatchResult {
+  // The source data assembled from the source blocks and the stashes. It has been verified against
+  // the source hash.
+  std::vector<uint8_t> source;
+  // The patched data, to be written to the target blocks.
+  std::vector<uint8_t> target;
+};
+
+/**
+ * PatchScheduler applies the patches of the upcoming bsdiff/imgdiff commands on a pool of worker
+ * threads, while the main thread keeps executing the commands in order.
+ *
+ * A diff command depends on the earlier commands that write any of its source blocks, and on the
+ * 'stash' commands that create the stashes it reads. Before executing each command, the main thread
+ * calls Advance(), which walks the next PATCH_MAX_COMMANDS commands and hands the ones with no
+ * pending dependencies to the workers, within the memory budget (up to PATCH_MAX_BYTES). Commands
+ * with pending dependencies are reconsidered on the next call.
+ *
+ * A worker assembles and verifies the source data, and applies the patch into a memory buffer. It
+ * never writes to the partition: the main thread claims the result with Take() when it reaches the
+ * command, and does all the stashing and writes in the original order. Therefore the resume
+ * semantics, including UpdateLastCommandIndex(), are the same as a serial run. Any failure in the
+ * workers is handled by executing the command on the main thread as usual.
+ */
+class PatchScheduler {
+ public:
+  PatchScheduler(const TransferList& transfer_list, size_t start,
+                 const std::vector<CommandRanges>& commands, int first_command,
+                 const std::string& stashbase, const MemoryStash* memory_stash,
+                 const uint8_t* patch_start, SourcePrefetcher* prefetcher, size_t max_bytes)
+      : transfer_list_(transfer_list),
+        start_(start),
+        commands_(commands),
+        first_command_(std::max(first_command, 0)),
+        stashbase_(stashbase),
+        memory_stash_(memory_stash),
+        patch_start_(patch_start),
+        prefetcher_(prefetcher),
+        max_bytes_(max_bytes) {}
+
+  ~PatchScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Starts |num_threads| workers, each with its own fd on the block device.
+  bool Start(const std::string& blockdev, size_t num_threads) {
+    for (size_t i = 0; i < num_threads; i++) {
+      android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY)));
+      if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << blockdev << " for patch workers";
+        break;
+      }
+      workers_.emplace_back(&PatchScheduler::WorkerLoop, this, fd.release());
+    }
+    return !workers_.empty();
+  }
+
+  // Called before executing the command at |cmdindex|. Drops the unclaimed results of the earlier
+  // commands and hands the upcoming commands that are ready to the workers.
+  void Advance(int cmdindex) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t current = static_cast<size_t>(cmdindex);
+    cv_.wait(lock, [this, current] {
+      return std::none_of(jobs_.begin(), jobs_.upper_bound(current), [](const auto& job) {
+        return job.second.state == Job::RUNNING;
+      });
+    });
+    for (auto it = jobs_.begin(); it != jobs_.end() && it->first < current;) {
+      ReleaseJob(it++);
+    }
+
+    // The blocks to be written and the stashes to be created by the commands that haven't been
+    // executed yet, starting from the current one.
+    std::vector<const RangeSet*> pending_writes;
+    std::vector<const std::string*> pending_stashes;
+    bool scheduled = false;
+    for (size_t k = current; k < commands_.size() && k <= current + PATCH_MAX_COMMANDS; k++) {
+      const CommandRanges& command = commands_[k];
+      if (!command.valid) {
+        break;
+      }
+
+      if (k > current && k >= first_command_ && jobs_.find(k) == jobs_.end()) {
+        DiffCommand diff;
+        if (ParseDiffCommand(transfer_list_.tokens(start_ + k), &diff) &&
+            IsReady(diff, pending_writes, pending_stashes)) {
+          size_t size = (diff.src_blocks + diff.tgt.blocks()) * BLOCKSIZE;
+          if (size <= max_bytes_) {
+            if (reserved_bytes_ + size > max_bytes_) {
+              break;
+            }
+            reserved_bytes_ += size;
+            Job& job = jobs_[k];
+            job.command = std::move(diff);
+            job.size = size;
+            scheduled = true;
+          }
+        }
+      }
+
+      if (command.writes) {
+        pending_writes.push_back(&command.writes);
+      }
+      if (!command.stash_id.empty()) {
+        pending_stashes.push_back(&command.stash_id);
+      }
+    }
+
+    if (scheduled) {
+      lock.unlock();
+      cv_.notify_all();
+    }
+  }
+
+  // Returns the result for the command at |cmdindex|, waiting for the worker if it's running.
+  // Returns nullptr if the command hasn't been patched in the background.
+  std::unique_ptr<PatchResult> Take(int cmdindex) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = jobs_.find(static_cast<size_t>(cmdindex));
+    if (it == jobs_.end()) {
+      return nullptr;
+    }
+
+    cv_.wait(lock, [&it] { return it->second.state != Job::RUNNING; });
+    std::unique_ptr<PatchResult> result;
+    if (it->second.state == Job::DONE) {
+      result = std::move(it->second.result);
+      patched_++;
+    } else {
+      fallbacks_++;
+    }
+    ReleaseJob(it);
+    return result;
+  }
+
+  void LogStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG(INFO) << "patched " << patched_ << " commands on " << workers_.size()
+              << " worker threads; " << fallbacks_ << " commands fell back to the main thread";
+  }
+
+ private:
+  struct Job {
+    enum State { QUEUED, RUNNING, DONE, FAILED };
+
+    State state = QUEUED;
+    DiffCommand command;
+    size_t size = 0;
+    std::unique_ptr<PatchResult> result;
+  };
+
+  static bool IsReady(const DiffCommand& diff, const std::vector<const RangeSet*>& pending_writes,
+                      const std::vector<const std::string*>& pending_stashes) {
+    for (const auto* writes : pending_writes) {
+      if (diff.src && diff.src.Overlaps(*writes)) {
+        return false;
+      }
+    }
+    for (const auto* id : pending_stashes) {
+      for (const auto& stash : diff.stashes) {
+        if (stash.first == *id) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  // Removes the job. Requires |mutex_| to be held, and the job not to be running.
+  void ReleaseJob(std::map<size_t, Job>::iterator it) {
+    reserved_bytes_ -= it->second.size;
+    jobs_.erase(it);
+  }
+
+  bool RunJob(int fd, size_t cmdindex, const DiffCommand& diff, PatchResult* result) {
+    result->source.resize(diff.src_blocks * BLOCKSIZE);
+    if (diff.src) {
+      if (diff.src.blocks() > diff.src_blocks) {
+        return false;
+      }
+      if ((prefetcher_ == nullptr ||
+           !prefetcher_->Take(cmdindex, diff.src, result->source.data())) &&
+          !ReadBlocksInBackground(fd, diff.src, result->source.data())) {
+        return false;
+      }
+      if (diff.src_loc) {
+        MoveRange(result->source, diff.src_loc, result->source);
+      }
+    }
+    for (const auto& stash : diff.stashes) {
+      std::vector<uint8_t> stash_buffer;
+      if (!LoadStashInBackground(stashbase_, memory_stash_, stash.first, &stash_buffer)) {
+        return false;
+      }
+      MoveRange(result->source, stash.second, stash_buffer);
+    }
+    if (VerifyBlocks(diff.src_hash, result->source, diff.src_blocks, false) != 0) {
+      return false;
+    }
+
+    size_t target_size = diff.tgt.blocks() * BLOCKSIZE;
+    result->target.reserve(target_size);
+    SinkFn sink = [result, target_size](const uint8_t* data, size_t len) -> size_t {
+      if (result->target.size() + len > target_size) {
+        return 0;
+      }
+      result->target.insert(result->target.end(), data, data + len);
+      return len;
+    };
+    std::string_view patch(reinterpret_cast<const char*>(patch_start_ + diff.patch_offset),
+                           diff.patch_len);
+    if (diff.imgdiff) {
+      // The workers already run in parallel; a single patch doesn't start more threads.
+      return ApplyImagePatch(result->source.data(), diff.src_blocks * BLOCKSIZE, patch, sink,
+                             nullptr, nullptr, 1) == 0;
+    }
+    return ApplyBSDiffPatch(result->source.data(), diff.src_blocks * BLOCKSIZE, patch, 0, sink,
+                            nullptr) == 0;
+  }
+
+  void WorkerLoop(int raw_fd) {
+    android::base::unique_fd fd(raw_fd);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      // Always work on the earliest command, which is the first one the main thread will need.
+      auto queued = jobs_.end();
+      cv_.wait(lock, [this, &queued] {
+        queued = std::find_if(jobs_.begin(), jobs_.end(),
+                              [](const auto& job) { return job.second.state == Job::QUEUED; });
+        return stopping_ || queued != jobs_.end();
+      });
+      if (stopping_) {
+        return;
+      }
+
+      Job& job = queued->second;
+      job.state = Job::RUNNING;
+      lock.unlock();
+      auto result = std::make_unique<PatchResult>();
+      bool success = RunJob(fd, queued->first, job.command, result.get());
+      lock.lock();
+      if (success) {
+        job.result = std::move(result);
+        job.state = Job::DONE;
+      } else {
+        job.state = Job::FAILED;
+      }
+      cv_.notify_all();
+    }
+  }
+
+  const TransferList& transfer_list_;
+  // The line number of the first command in |transfer_list_|.
+  const size_t start_;
+  const std::vector<CommandRanges>& commands_;
+  const size_t first_command_;
+  const std::string stashbase_;
+  const MemoryStash* memory_stash_;
+  const uint8_t* patch_start_;
+  SourcePrefetcher* prefetcher_;
+  const size_t max_bytes_;
+
+  std::vector<std::thread> workers_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+
+  std::map<size_t, Job> jobs_;
+  size_t reserved_bytes_ = 0;
+
+  size_t patched_ = 0;
+  size_t fallbacks_ = 0;
+};
+
+// The parsed arguments of a move/bsdiff/imgdiff/stash command, as checked by a VerifyScheduler
+// worker. A 'stash' command has no target, and its source hash is the stash id.
+struct VerifyCommand {
+  std::string tgt_hash;
+  RangeSet tgt;
+  std::string src_hash;
+  size_t src_blocks = 0;
+  RangeSet src;
+  RangeSet src_loc;
+  std::vector<std::pair<std::string, RangeSet>> stashes;
+  // The source blocks of each stash, which are found in the partition in verification mode; or
+  // nullptr to read the stash file on /cache.
+  std::vector<const RangeSet*> stash_sources;
+};
+
+static bool ParseVerifyCommand(const CommandTokens& tokens, VerifyCommand* cmd) {
+  if (tokens.size() == 0) {
+    return false;
+  }
+  size_t pos;
+  if (tokens[0] == "stash") {
+    // stash <stash_id> <src_range>
+    if (tokens.size() != 3) {
+      return false;
+    }
+    cmd->src_hash = std::string(tokens[1]);
+    cmd->src = RangeSet::Parse(tokens[2]);
+    cmd->src_blocks = cmd->src.blocks();
+    return static_cast<bool>(cmd->src);
+  } else if (tokens[0] == "move") {
+    // move <hash> <tgt_range> <src_block_count> ...
+    if (tokens.size() < 5) {
+      return false;
+    }
+    cmd->src_hash = std::string(tokens[1]);
+    cmd->tgt_hash = cmd->src_hash;
+    pos = 2;
+  } else if (tokens[0] == "bsdiff" || tokens[0] == "imgdiff") {
+    // bsdiff <offset> <len> <src_hash> <tgt_hash> <tgt_range> <src_block_count> ...
+    if (tokens.size() < 8) {
+      return false;
+    }
+    cmd->src_hash = std::string(tokens[3]);
+    cmd->tgt_hash = std::string(tokens[4]);
+    pos = 5;
+  } else {
+    return false;
+  }
+  cmd->tgt = RangeSet::Parse(tokens[pos]);
+  if (!cmd->tgt || !ParseUint(tokens[pos + 1], &cmd->src_blocks)) {
+    return false;
+  }
+  return ParseSourceTokens(tokens, pos + 2, &cmd->src, &cmd->src_loc, &cmd->stashes);
+}
+
+// The result of a command that has been checked by a VerifyScheduler worker.
+struct VerifyResult {
+  // The target blocks have the expected contents.
+  bool target_verified = false;
+  // The source blocks, together with the stashes, have the expected contents.
+  bool source_verified = false;
+};
+
+/**
+ * VerifyScheduler reads and hashes the source and target blocks of the upcoming move, diff and
+ * stash commands on a pool of worker threads in verification mode.
+ *
+ * Nothing is written to the partition in verification mode, so the blocks are the same whenever
+ * they're read, and a command never waits for the earlier ones. The stashes that a command reads
+ * are resolved to the source blocks of the stash commands before it, as the stash map does on the
+ * main thread.
+ *
+ * Before executing each command, the main thread calls Advance(), which hands the next
+ * VERIFY_MAX_COMMANDS commands to the workers; and then Take(), which returns the verdict for the
+ * current command. Only the positive verdicts are used. When the blocks don't have the expected
+ * contents, the main thread checks the command again as usual, which also looks for the stash files
+ * on /cache and prints the diagnostics. Therefore the results and the stash map are the same as a
+ * serial run.
+ */
+class VerifyScheduler {
+ public:
+  VerifyScheduler(const TransferList& transfer_list, size_t start,
+                  const std::vector<CommandRanges>& commands, const std::string& stashbase)
+      : transfer_list_(transfer_list), start_(start), commands_(commands), stashbase_(stashbase) {}
+
+  ~VerifyScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Starts |num_threads| workers, each with its own fd on the block device.
+  bool Start(const std::string& blockdev, size_t num_threads) {
+    for (size_t i = 0; i < num_threads; i++) {
+      android::base::unique_fd fd(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY)));
+      if (fd == -1) {
+        PLOG(WARNING) << "Failed to open " << blockdev << " for verify workers";
+        break;
+      }
+      workers_.emplace_back(&VerifyScheduler::WorkerLoop, this, fd.release());
+    }
+    return !workers_.empty();
+  }
+
+  // Called before executing the command at |cmdindex|. Drops the unclaimed results of the earlier
+  // commands and queues the upcoming ones.
+  void Advance(int cmdindex) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t current = static_cast<size_t>(cmdindex);
+    cv_.wait(lock, [this, current] {
+      return std::none_of(jobs_.begin(), jobs_.lower_bound(current), [](const auto& job) {
+        return job.second.state == Job::RUNNING;
+      });
+    });
+    for (auto it = jobs_.begin(); it != jobs_.end() && it->first < current;) {
+      ReleaseJob(it++);
+    }
+
+    bool scheduled = false;
+    for (size_t k = next_; k < commands_.size() && k <= current + VERIFY_MAX_COMMANDS; k++) {
+      CommandTokens tokens = transfer_list_.tokens(start_ + k);
+      VerifyCommand command;
+      // The main thread checks the current command itself.
+      if (k > current && ParseVerifyCommand(tokens, &command)) {
+        ResolveStashes(&command);
+        // Only the source blocks that get moved around need a buffer; the others are hashed as
+        // they're read. The commands that don't fit in the budget at all are left to the main
+        // thread.
+        size_t size = NeedsBuffer(command) ? command.src_blocks * BLOCKSIZE : 0;
+        if (size <= VERIFY_MAX_BYTES) {
+          if (reserved_bytes_ + size > VERIFY_MAX_BYTES) {
+            break;
+          }
+          reserved_bytes_ += size;
+          Job& job = jobs_[k];
+          job.command = std::move(command);
+          job.size = size;
+          scheduled = true;
+        }
+      }
 
-// Creates a directory for storing stash files and checks if the /cache partition
-// hash enough space for the expected amount of blocks we need to store. Returns
-// >0 if we created the directory, zero if it existed already, and <0 of failure.
+      // The stashes as seen by the commands after this one.
+      if (commands_[k].valid && !commands_[k].stash_id.empty()) {
+        stash_sources_[commands_[k].stash_id] = &commands_[k].reads[0];
+      } else if (tokens.size() == 2 && tokens[0] == "free") {
+        stash_sources_.erase(std::string(tokens[1]));
+      }
+      next_ = k + 1;
+    }
 
-static int CreateStash(State* state, size_t maxblocks, const std::string& blockdev,
-                       std::string& base) {
-  if (blockdev.empty()) {
-    return -1;
+    if (scheduled) {
+      lock.unlock();
+      cv_.notify_all();
+    }
   }
 
-  // Stash directory should be different for each partition to avoid conflicts
-  // when updating multiple partitions at the same time, so we use the hash of
-  // the block device name as the base directory
-  uint8_t digest[SHA_DIGEST_LENGTH];
-  SHA1(reinterpret_cast<const uint8_t*>(blockdev.data()), blockdev.size(), digest);
-  base = print_sha1(digest);
+  // Returns the result for the command at |cmdindex|, waiting for the worker if it's running.
+  // Returns nullptr if the command hasn't been checked in the background.
+  std::unique_ptr<VerifyResult> Take(int cmdindex) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = jobs_.find(static_cast<size_t>(cmdindex));
+    if (it == jobs_.end()) {
+      return nullptr;
+    }
 
-  std::string dirname = GetStashFileName(base, "", "");
-  struct stat sb;
-  int res = stat(dirname.c_str(), &sb);
-  size_t max_stash_size = maxblocks * BLOCKSIZE;
+    cv_.wait(lock, [&it] { return it->second.state != Job::RUNNING; });
+    std::unique_ptr<VerifyResult> result;
+    if (it->second.state == Job::DONE) {
+      result = std::move(it->second.result);
+      verified_++;
+    } else {
+      fallbacks_++;
+    }
+    ReleaseJob(it);
+    return result;
+  }
 
-  if (res == -1 && errno != ENOENT) {
-    ErrorAbort(state, kStashCreationFailure, "stat \"%s\" failed: %s", dirname.c_str(),
-               strerror(errno));
-    return -1;
-  } else if (res != 0) {
-    LOG(INFO) << "creating stash " << dirname;
-    res = mkdir(dirname.c_str(), STASH_DIRECTORY_MODE);
+  void LogStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG(INFO) << "verified " << verified_ << " commands on " << workers_.size()
+              << " worker threads; " << fallbacks_ << " commands fell back to the main thread";
+  }
 
-    if (res != 0) {
-      ErrorAbort(state, kStashCreationFailure, "mkdir \"%s\" failed: %s", dirname.c_str(),
-                 strerror(errno));
-      return -1;
-    }
+ private:
+  struct Job {
+    enum State { QUEUED, RUNNING, DONE, FAILED };
 
-    if (chown(dirname.c_str(), AID_SYSTEM, AID_SYSTEM) != 0) {  // system user
-      ErrorAbort(state, kStashCreationFailure, "chown \"%s\" failed: %s", dirname.c_str(),
-                 strerror(errno));
-      return -1;
-    }
+    State state = QUEUED;
+    VerifyCommand command;
+    size_t size = 0;
+    std::unique_ptr<VerifyResult> result;
+  };
 
-    if (CacheSizeCheck(max_stash_size) != 0) {
-      ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu needed)",
-                 max_stash_size);
-      return -1;
+  // Looks up the source blocks of the stashes that |command| reads. Requires |mutex_| to be held.
+  void ResolveStashes(VerifyCommand* command) const {
+    for (const auto& stash : command->stashes) {
+      auto it = stash_sources_.find(stash.first);
+      command->stash_sources.push_back(it == stash_sources_.end() ? nullptr : it->second);
     }
+  }
 
-    return 1;  // Created directory
+  static bool NeedsBuffer(const VerifyCommand& command) {
+    return command.src_loc || !command.stashes.empty() ||
+           command.src.blocks() != command.src_blocks;
   }
 
-  LOG(INFO) << "using existing stash " << dirname;
+  // Removes the job. Requires |mutex_| to be held, and the job not to be running.
+  void ReleaseJob(std::map<size_t, Job>::iterator it) {
+    reserved_bytes_ -= it->second.size;
+    jobs_.erase(it);
+  }
 
-  // If the directory already exists, calculate the space already allocated to stash files and check
-  // if there's enough for all required blocks. Delete any partially completed stash files first.
-  EnumerateStash(dirname, [](const std::string& fn) {
-    if (android::base::EndsWith(fn, ".partial")) {
-      DeleteFile(fn);
+  // Computes the SHA-1 of the blocks in |ranges|, reading up to VERIFY_CHUNK_BLOCKS at a time.
+  static bool HashBlocks(int fd, const RangeSet& ranges, std::vector<uint8_t>* chunk,
+                         std::string* hexdigest) {
+    chunk->resize(VERIFY_CHUNK_BLOCKS * BLOCKSIZE);
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
+    for (const auto& range : ranges) {
+      for (size_t block = range.first; block < range.second; block += VERIFY_CHUNK_BLOCKS) {
+        size_t end = std::min(range.second, block + VERIFY_CHUNK_BLOCKS);
+        if (!ReadBlocksInBackground(fd, RangeSet({ { block, end } }), chunk->data())) {
+          return false;
+        }
+        SHA1_Update(&ctx, chunk->data(), (end - block) * BLOCKSIZE);
+      }
     }
-  });
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1_Final(digest, &ctx);
+    *hexdigest = print_sha1(digest);
+    return true;
+  }
 
-  size_t existing = 0;
-  EnumerateStash(dirname, [&existing](const std::string& fn) {
-    if (fn.empty()) return;
-    struct stat sb;
-    if (stat(fn.c_str(), &sb) == -1) {
-      PLOG(ERROR) << "stat \"" << fn << "\" failed";
-      return;
+  // Assembles the source data like LoadSourceBlocks(), and checks it against the source hash.
+  bool VerifySource(int fd, const VerifyCommand& command, std::vector<uint8_t>* buffer) const {
+    if (!NeedsBuffer(command)) {
+      std::string hexdigest;
+      return HashBlocks(fd, command.src, buffer, &hexdigest) && hexdigest == command.src_hash;
     }
-    existing += static_cast<size_t>(sb.st_size);
-  });
 
-  if (max_stash_size > existing) {
-    size_t needed = max_stash_size - existing;
-    if (CacheSizeCheck(needed) != 0) {
-      ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%zu more needed)",
-                 needed);
-      return -1;
+    buffer->assign(command.src_blocks * BLOCKSIZE, 0);
+    if (command.src) {
+      if (command.src.blocks() > command.src_blocks ||
+          !ReadBlocksInBackground(fd, command.src, buffer->data())) {
+        return false;
+      }
+      if (command.src_loc) {
+        MoveRange(*buffer, command.src_loc, *buffer);
+      }
+    }
+    for (size_t i = 0; i < command.stashes.size(); i++) {
+      std::vector<uint8_t> stash_buffer;
+      const RangeSet* stash_source = command.stash_sources[i];
+      if (stash_source != nullptr) {
+        stash_buffer.resize(stash_source->blocks() * BLOCKSIZE);
+        if (!ReadBlocksInBackground(fd, *stash_source, stash_buffer.data())) {
+          return false;
+        }
+      } else if (!LoadStashInBackground(stashbase_, nullptr, command.stashes[i].first,
+                                        &stash_buffer)) {
+        return false;
+      }
+      if (stash_buffer.size() < command.stashes[i].second.blocks() * BLOCKSIZE) {
+        return false;
+      }
+      MoveRange(*buffer, command.stashes[i].second, stash_buffer);
     }
+    return VerifyBlocks(command.src_hash, *buffer, command.src_blocks, false) == 0;
   }
 
-  return 0;  // Using existing directory
-}
+  bool RunJob(int fd, const VerifyCommand& command, VerifyResult* result) const {
+    std::vector<uint8_t> buffer;
+    if (command.tgt) {
+      std::string hexdigest;
+      if (!HashBlocks(fd, command.tgt, &buffer, &hexdigest)) {
+        return false;
+      }
+      if (hexdigest == command.tgt_hash) {
+        result->target_verified = true;
+        return true;
+      }
+    }
+    result->source_verified = VerifySource(fd, command, &buffer);
+    return true;
+  }
 
-static int FreeStash(const std::string& base, const std::string& id) {
-  if (base.empty() || id.empty()) {
-    return -1;
+  void WorkerLoop(int raw_fd) {
+    android::base::unique_fd fd(raw_fd);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      // Always work on the earliest command, which is the first one the main thread will need.
+      auto queued = jobs_.end();
+      cv_.wait(lock, [this, &queued] {
+        queued = std::find_if(jobs_.begin(), jobs_.end(),
+                              [](const auto& job) { return job.second.state == Job::QUEUED; });
+        return stopping_ || queued != jobs_.end();
+      });
+      if (stopping_) {
+        return;
+      }
+
+      Job& job = queued->second;
+      job.state = Job::RUNNING;
+      lock.unlock();
+      auto result = std::make_unique<VerifyResult>();
+      bool success = RunJob(fd, job.command, result.get());
+      lock.lock();
+      if (success) {
+        job.result = std::move(result);
+        job.state = Job::DONE;
+      } else {
+        job.state = Job::FAILED;
+      }
+      cv_.notify_all();
+    }
   }
 
-  DeleteFile(GetStashFileName(base, id, ""));
+  const TransferList& transfer_list_;
+  // The line number of the first command in |transfer_list_|.
+  const size_t start_;
+  const std::vector<CommandRanges>& commands_;
+  const std::string stashbase_;
 
-  return 0;
-}
+  std::vector<std::thread> workers_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
 
-// Source contains packed data, which we want to move to the locations given in locs in the dest
-// buffer. source and dest may be the same buffer.
-static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
-                      const std::vector<uint8_t>& source) {
-  const uint8_t* from = source.data();
-  uint8_t* to = dest.data();
-  size_t start = locs.blocks();
-  // Must do the movement backward.
-  for (auto it = locs.crbegin(); it != locs.crend(); it++) {
-    size_t blocks = it->second - it->first;
-    start -= blocks;
-    memmove(to + (it->first * BLOCKSIZE), from + (start * BLOCKSIZE), blocks * BLOCKSIZE);
-  }
-}
+  std::map<size_t, Job> jobs_;
+  size_t reserved_bytes_ = 0;
+  // The next command to be looked at.
+  size_t next_ = 0;
+  // The source blocks of the stashes created by the commands before |next_|, by the stash id.
+  std::unordered_map<std::string, const RangeSet*> stash_sources_;
+
+  size_t verified_ = 0;
+  size_t fallbacks_ = 0;
+};
 
 /**
  * We expect to parse the remainder of the parameter tokens as one of:
@@ -1017,14 +3778,26 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
   CHECK(overlap != nullptr);
 
   // <src_block_count>
-  const std::string& token = params.tokens[params.cpos++];
-  if (!android::base::ParseUint(token, src_blocks)) {
+  std::string_view token = params.tokens[params.cpos++];
+  if (!ParseUint(token, src_blocks)) {
     LOG(ERROR) << "invalid src_block_count \"" << token << "\"";
     return -1;
   }
 
   allocate(*src_blocks * BLOCKSIZE, params.buffer);
 
+  // The source data has been assembled by a patch worker; only the overlap is needed.
+  if (params.precomputed != nullptr) {
+    if (params.tokens[params.cpos] != "-") {
+      RangeSet src = RangeSet::Parse(params.tokens[params.cpos]);
+      CHECK(static_cast<bool>(src));
+      *overlap = src.Overlaps(tgt);
+    }
+    params.cpos = params.tokens.size();
+    memcpy(params.buffer.data(), params.precomputed->source.data(), *src_blocks * BLOCKSIZE);
+    return 0;
+  }
+
   // "-" or <src_range> [<src_loc>]
   if (params.tokens[params.cpos] == "-") {
     // no source ranges, only stashes
@@ -1034,7 +3807,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+    if (ReadCommandBlocks(params, src, params.buffer) == -1) {
       return -1;
     }
 
@@ -1052,21 +3825,22 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
   while (params.cpos < params.tokens.size()) {
     // Each word is a an index into the stash table, a colon, and then a RangeSet describing where
     // in the source block that stashed data should go.
-    std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-    if (tokens.size() != 2) {
+    std::string_view id;
+    std::string_view range;
+    if (!SplitStashToken(params.tokens[params.cpos++], &id, &range)) {
       LOG(ERROR) << "invalid parameter";
       return -1;
     }
 
     std::vector<uint8_t> stash;
-    if (LoadStash(params, tokens[0], false, nullptr, stash, true) == -1) {
+    if (LoadStash(params, std::string(id), false, nullptr, stash, true) == -1) {
       // These source blocks will fail verification if used later, but we
       // will let the caller decide if this is a fatal failure
-      LOG(ERROR) << "failed to load stash " << tokens[0];
+      LOG(ERROR) << "failed to load stash " << id;
       continue;
     }
 
-    RangeSet locs = RangeSet::Parse(tokens[1]);
+    RangeSet locs = RangeSet::Parse(range);
     CHECK(static_cast<bool>(locs));
     MoveRange(params.buffer, locs, stash);
   }
@@ -1110,7 +3884,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
     return -1;
   }
 
-  std::string srchash = params.tokens[params.cpos++];
+  std::string srchash(params.tokens[params.cpos++]);
   std::string tgthash;
 
   if (onehash) {
@@ -1134,8 +3908,20 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   tgt = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(tgt));
 
+  // The blocks have been checked by a verify worker. Nothing is read into params.buffer, which
+  // isn't used in verification mode.
+  if (params.verified != nullptr) {
+    if (params.verified->target_verified) {
+      return 1;
+    }
+    if (params.verified->source_verified && ParseUint(params.tokens[params.cpos], src_blocks)) {
+      params.cpos = params.tokens.size();
+      return 0;
+    }
+  }
+
   std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, tgt, tgtbuffer) == -1) {
     return -1;
   }
 
@@ -1144,27 +3930,50 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
     return 1;
   }
 
-  // Load source blocks.
+  // Load source blocks. Only a source that's read from a single source range (without any stashes)
+  // can be remembered as verified.
+  size_t src_pos = params.cpos;
   if (LoadSourceBlocks(params, tgt, src_blocks, overlap) == -1) {
     return -1;
   }
+  RangeSet src;
+  if (params.block_cache != nullptr && params.tokens.size() == src_pos + 2 &&
+      params.tokens[src_pos + 1] != "-") {
+    src = RangeSet::Parse(params.tokens[src_pos + 1]);
+  }
+
+  bool src_verified = static_cast<bool>(src) && params.block_cache->IsVerified(srchash, src);
+  if (!src_verified && VerifyBlocks(srchash, params.buffer, *src_blocks, true) == 0) {
+    src_verified = true;
+    if (src) {
+      params.block_cache->SetVerified(srchash, src);
+    }
+  }
 
-  if (VerifyBlocks(srchash, params.buffer, *src_blocks, true) == 0) {
+  if (src_verified) {
     // If source and target blocks overlap, stash the source blocks so we can
     // resume from possible write errors. In verify mode, we can skip stashing
     // because the source blocks won't be overwritten.
     if (*overlap && params.canwrite) {
       LOG(INFO) << "stashing " << *src_blocks << " overlapping blocks to " << srchash;
 
+      // The last_command_file is about to point at this command.
+      if (params.memory_stash != nullptr &&
+          !params.memory_stash->Persist(params.stashbase, &params.checkpoint)) {
+        LOG(ERROR) << "failed to persist the stashes in memory";
+        return -1;
+      }
+
       bool stash_exists = false;
-      if (WriteStash(params.stashbase, srchash, *src_blocks, params.buffer, true,
+      if (WriteStash(params.ctx, params.stashbase, srchash, *src_blocks, params.buffer, true,
                      &stash_exists) != 0) {
         LOG(ERROR) << "failed to stash overlapping source blocks";
         return -1;
       }
 
-      if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
+      if (!params.checkpoint.Record(params.cmdindex, params.cmdline,
+                                    params.checkpoint.FreedSinceCommit(srchash))) {
+        return -1;
       }
 
       params.stashed += *src_blocks;
@@ -1194,11 +4003,178 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   return -1;
 }
 
+// Reads one chunk of a move into params.buffer.
+static int ReadChunk(CommandParameters& params, const RangeSet& chunk) {
+  ScopedPhase phase(kPhaseSourceRead);
+  if (current_profile != nullptr) {
+    current_profile->blocks_read += chunk.blocks();
+  }
+  return ReadBlocks(params.ctx, chunk, params.buffer, params.fd);
+}
+
+// Computes the SHA-1 of the blocks in |chunks|, reading one chunk at a time.
+static int HashChunks(CommandParameters& params, const std::vector<RangeSet>& chunks,
+                      std::string* hexdigest) {
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  for (const auto& chunk : chunks) {
+    if (ReadChunk(params, chunk) == -1) {
+      return -1;
+    }
+    ScopedPhase phase(kPhaseHashVerify);
+    SHA1_Update(&ctx, params.buffer.data(), chunk.blocks() * BLOCKSIZE);
+  }
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  *hexdigest = print_sha1(digest);
+  return 0;
+}
+
+/**
+ * Handles a move whose source doesn't fit in the memory budget like LoadSrcTgtVersion3() and
+ * PerformCommandMove() do, but one chunk at a time. The target and the source are hashed chunk by
+ * chunk, and an overlapping source is streamed to its stash file. The chunks are then copied in
+ * an order that never reads a block that an earlier chunk has overwritten; e.g. from the end when
+ * the target starts after the source, like memmove(3).
+ *
+ * Leaves |moved| false if the whole source needs to be loaded instead: the command reads from
+ * stashes, the source doesn't match (the data may come from a stash when resuming), or the
+ * overlapping ranges are interleaved such that no order is safe. Otherwise returns the status like
+ * LoadSrcTgtVersion3(), with the target already written on 0.
+ */
+static int MoveInChunks(CommandParameters& params, RangeSet& tgt, size_t* blocks, bool* moved) {
+  *moved = false;
+  // <hash> <tgt_range> <src_block_count> <src_range>
+  if (params.memory_budget == nullptr || params.verified != nullptr ||
+      params.cpos + 4 != params.tokens.size() || params.tokens[params.cpos + 3] == "-") {
+    return 0;
+  }
+  std::string hash(params.tokens[params.cpos]);
+  RangeSet target = RangeSet::Parse(params.tokens[params.cpos + 1]);
+  RangeSet src = RangeSet::Parse(params.tokens[params.cpos + 3]);
+  size_t src_blocks;
+  if (!target || !src || !ParseUint(params.tokens[params.cpos + 2], &src_blocks) ||
+      src_blocks != src.blocks() || src_blocks != target.blocks() ||
+      params.memory_budget->Fits(src_blocks * BLOCKSIZE)) {
+    return 0;
+  }
+
+  size_t chunk_blocks = params.memory_budget->chunk_blocks();
+  size_t count = (src_blocks + chunk_blocks - 1) / chunk_blocks;
+  std::vector<RangeSet> src_chunks = src.Split(count);
+  std::vector<RangeSet> tgt_chunks = target.Split(count);
+
+  // Copying forwards is safe if no chunk writes to the source of a later chunk, and backwards if
+  // no chunk writes to the source of an earlier one.
+  bool overlap = src.Overlaps(target);
+  auto is_safe = [&](bool forwards) {
+    for (size_t i = 0; i < count; i++) {
+      for (size_t j = forwards ? i + 1 : 0; j < (forwards ? count : i); j++) {
+        if (tgt_chunks[i].Overlaps(src_chunks[j])) {
+          return false;
+        }
+      }
+    }
+    return true;
+  };
+  bool forwards = !overlap || is_safe(true);
+  if (!forwards && !is_safe(false)) {
+    LOG(INFO) << "no safe order to move " << src_blocks << " blocks in chunks";
+    return 0;
+  }
+
+  allocate(chunk_blocks * BLOCKSIZE, params.buffer);
+  std::string hexdigest;
+  if (HashChunks(params, tgt_chunks, &hexdigest) == -1) {
+    return -1;
+  }
+  if (hexdigest == hash) {
+    tgt = std::move(target);
+    *blocks = src_blocks;
+    *moved = true;
+    params.cpos = params.tokens.size();
+    return 1;
+  }
+
+  if (params.block_cache == nullptr || !params.block_cache->IsVerified(hash, src)) {
+    if (HashChunks(params, src_chunks, &hexdigest) == -1) {
+      return -1;
+    }
+    if (hexdigest != hash) {
+      return 0;
+    }
+    if (params.block_cache != nullptr) {
+      params.block_cache->SetVerified(hash, src);
+    }
+  }
+
+  tgt = std::move(target);
+  *blocks = src_blocks;
+  *moved = true;
+  params.cpos = params.tokens.size();
+  if (!params.canwrite) {
+    return 0;
+  }
+
+  // Stash the overlapping source blocks, so we can resume from possible write errors.
+  if (overlap) {
+    LOG(INFO) << "stashing " << src_blocks << " overlapping blocks to " << hash;
+    if (params.memory_stash != nullptr &&
+        !params.memory_stash->Persist(params.stashbase, &params.checkpoint)) {
+      LOG(ERROR) << "failed to persist the stashes in memory";
+      return -1;
+    }
+
+    bool stash_exists = false;
+    if (WriteStashFile(params.ctx, params.stashbase, hash, src_blocks, true, &stash_exists,
+                       [&](int fd) {
+                         for (const auto& chunk : src_chunks) {
+                           if (ReadChunk(params, chunk) == -1 ||
+                               write_all(params.ctx, fd, params.buffer,
+                                         chunk.blocks() * BLOCKSIZE) == -1) {
+                             return -1;
+                           }
+                         }
+                         return 0;
+                       }) != 0) {
+      LOG(ERROR) << "failed to stash overlapping source blocks";
+      return -1;
+    }
+
+    if (!params.checkpoint.Record(params.cmdindex, params.cmdline,
+                                  params.checkpoint.FreedSinceCommit(hash))) {
+      return -1;
+    }
+
+    params.stashed += src_blocks;
+    // Can be deleted when the write has completed.
+    if (!stash_exists) {
+      params.freestash = hash;
+    }
+  }
+
+  LOG(INFO) << "  moving " << src_blocks << " blocks in " << count << " chunks"
+            << (forwards ? "" : " from the end");
+  for (size_t n = 0; n < count; n++) {
+    size_t i = forwards ? n : count - 1 - n;
+    if (ReadChunk(params, src_chunks[i]) == -1 ||
+        WriteBlocks(params.ctx, tgt_chunks[i], params.buffer, params.fd) == -1) {
+      return -1;
+    }
+  }
+  params.memory_budget->AddChunkedMove();
+  return 0;
+}
+
 static int PerformCommandMove(CommandParameters& params) {
   size_t blocks = 0;
   bool overlap = false;
   RangeSet tgt;
-  int status = LoadSrcTgtVersion3(params, tgt, &blocks, true, &overlap);
+  bool moved = false;
+  int status = MoveInChunks(params, tgt, &blocks, &moved);
+  if (status != -1 && !moved) {
+    status = LoadSrcTgtVersion3(params, tgt, &blocks, true, &overlap);
+  }
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for move";
@@ -1215,18 +4191,19 @@ static int PerformCommandMove(CommandParameters& params) {
   }
 
   if (params.canwrite) {
-    if (status == 0) {
+    if (status == 0 && !moved) {
       LOG(INFO) << "  moving " << blocks << " blocks";
 
-      if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
+      if (WriteBlocks(params.ctx, tgt, params.buffer, params.fd) == -1) {
         return -1;
       }
-    } else {
+    } else if (status != 0) {
       LOG(INFO) << "skipping " << blocks << " already moved blocks";
     }
   }
 
   if (!params.freestash.empty()) {
+    params.checkpoint.Free(params.freestash, params.cmdindex);
     FreeStash(params.stashbase, params.freestash);
     params.freestash.clear();
   }
@@ -1243,7 +4220,7 @@ static int PerformCommandStash(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
+  std::string id(params.tokens[params.cpos++]);
   size_t blocks = 0;
   if (LoadStash(params, id, true, &blocks, params.buffer, false) == 0) {
     // Stash file already exists and has expected contents. Do not read from source again, as the
@@ -1254,19 +4231,31 @@ static int PerformCommandStash(CommandParameters& params) {
   RangeSet src = RangeSet::Parse(params.tokens[params.cpos++]);
   CHECK(static_cast<bool>(src));
 
+  // The source blocks have been checked by a verify worker.
+  if (params.verified != nullptr && params.verified->source_verified) {
+    params.ctx.stash_map[id] = src;
+    return 0;
+  }
+
   allocate(src.blocks() * BLOCKSIZE, params.buffer);
-  if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, src, params.buffer) == -1) {
     return -1;
   }
   blocks = src.blocks();
-  stash_map[id] = src;
-
-  if (VerifyBlocks(id, params.buffer, blocks, true) != 0) {
-    // Source blocks have unexpected contents. If we actually need this data later, this is an
-    // unrecoverable error. However, the command that uses the data may have already completed
-    // previously, so the possible failure will occur during source block verification.
-    LOG(ERROR) << "failed to load source blocks for stash " << id;
-    return 0;
+  params.ctx.stash_map[id] = src;
+
+  // Skip the hashing if the same blocks have been verified by an earlier command.
+  if (params.block_cache == nullptr || !params.block_cache->IsVerified(id, src)) {
+    if (VerifyBlocks(id, params.buffer, blocks, true) != 0) {
+      // Source blocks have unexpected contents. If we actually need this data later, this is an
+      // unrecoverable error. However, the command that uses the data may have already completed
+      // previously, so the possible failure will occur during source block verification.
+      LOG(ERROR) << "failed to load source blocks for stash " << id;
+      return 0;
+    }
+    if (params.block_cache != nullptr) {
+      params.block_cache->SetVerified(id, src);
+    }
   }
 
   // In verify mode, we don't need to stash any blocks.
@@ -1275,12 +4264,23 @@ static int PerformCommandStash(CommandParameters& params) {
   }
 
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
-  int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
-  if (result == 0) {
-    if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-      LOG(WARNING) << "Failed to update the last command file.";
+  if (params.memory_stash != nullptr) {
+    // The last_command_file will be updated once the stash is persisted.
+    int result = params.memory_stash->Put(params.stashbase, id, src, params.buffer, blocks,
+                                          params.cmdindex, params.cmdline,
+                                          params.checkpoint.FreedSinceCommit(id));
+    if (result == 0) {
+      params.stashed += blocks;
     }
+    return result;
+  }
 
+  int result = WriteStash(params.ctx, params.stashbase, id, blocks, params.buffer, false, nullptr);
+  if (result == 0) {
+    if (!params.checkpoint.Record(params.cmdindex, params.cmdline,
+                                  params.checkpoint.FreedSinceCommit(id))) {
+      return -1;
+    }
     params.stashed += blocks;
   }
   return result;
@@ -1293,10 +4293,14 @@ static int PerformCommandFree(CommandParameters& params) {
     return -1;
   }
 
-  const std::string& id = params.tokens[params.cpos++];
-  stash_map.erase(id);
+  std::string id(params.tokens[params.cpos++]);
+  params.ctx.stash_map.erase(id);
+  if (params.memory_stash != nullptr) {
+    params.memory_stash->Free(id);
+  }
 
   if (params.createdstash || params.canwrite) {
+    params.checkpoint.Free(id, params.cmdindex);
     return FreeStash(params.stashbase, id);
   }
 
@@ -1314,26 +4318,14 @@ static int PerformCommandZero(CommandParameters& params) {
 
   LOG(INFO) << "  zeroing " << tgt.blocks() << " blocks";
 
-  allocate(BLOCKSIZE, params.buffer);
-  memset(params.buffer.data(), 0, BLOCKSIZE);
-
   if (params.canwrite) {
-    for (const auto& range : tgt) {
-      off64_t offset = static_cast<off64_t>(range.first) * BLOCKSIZE;
-      size_t size = (range.second - range.first) * BLOCKSIZE;
-      if (!discard_blocks(params.fd, offset, size)) {
+    for (const auto& extent : MergedExtents(tgt)) {
+      if (!discard_blocks(params.ctx, params.fd, extent.first, extent.second)) {
         return -1;
       }
-
-      if (!check_lseek(params.fd, offset, SEEK_SET)) {
+      if (!ZeroBlocks(params.ctx, params.fd, extent.first, extent.second)) {
         return -1;
       }
-
-      for (size_t j = range.first; j < range.second; ++j) {
-        if (write_all(params.fd, params.buffer, BLOCKSIZE) == -1) {
-          return -1;
-        }
-      }
     }
   }
 
@@ -1346,6 +4338,36 @@ static int PerformCommandZero(CommandParameters& params) {
   return 0;
 }
 
+// Makes the data written by the current 'new' command durable, and records how far it's got, so
+// that a resumed update continues from there.
+static int CheckpointNewData(CommandParameters& params, RangeSinkWriter& writer) {
+  if (params.cmdindex == -1) {
+    return 0;
+  }
+  if (!writer.Flush()) {
+    return -1;
+  }
+  {
+    ScopedPhase phase(kPhaseFsync);
+    if (ota_fsync(params.fd) == -1) {
+      params.ctx.failure_type = kFsyncFailure;
+      PLOG(ERROR) << "fsync failed";
+      return -1;
+    }
+  }
+  // The last_command_file is about to point past the earlier commands.
+  if (params.memory_stash != nullptr &&
+      !params.memory_stash->Persist(params.stashbase, &params.checkpoint)) {
+    LOG(ERROR) << "failed to persist the stashes in memory";
+    return -1;
+  }
+  if (!params.checkpoint.RecordNewData(params.cmdindex, params.previous_cmdline,
+                                       writer.BytesWritten())) {
+    return -1;
+  }
+  return 0;
+}
+
 static int PerformCommandNew(CommandParameters& params) {
   if (params.cpos >= params.tokens.size()) {
     LOG(ERROR) << "missing target blocks for new";
@@ -1358,21 +4380,57 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
+    while (params.new_data_discard > 0) {
+      const uint8_t* data;
+      size_t available;
+      {
+        ScopedPhase phase(kPhaseNewData);
+        available = params.nti.ring->WaitForData(&data);
+      }
+      if (available == 0) {
+        LOG(ERROR) << "missing " << params.new_data_discard << " bytes of new data to skip";
+        return -1;
+      }
+      size_t discard_now = std::min<uint64_t>(available, params.new_data_discard);
+      params.nti.ring->Consume(discard_now);
+      params.new_data_discard -= discard_now;
+    }
+
+    RangeSinkWriter writer(params.ctx, params.fd, tgt, params.direct_fd);
+    if (params.cmdindex != -1 && params.cmdindex == params.new_data_resume_index) {
+      LOG(INFO) << " skipping " << params.new_data_resume_bytes
+                << " bytes written before resuming";
+      writer.Skip(params.new_data_resume_bytes);
+    }
+    size_t next_checkpoint = writer.BytesWritten() + new_data_checkpoint_bytes;
+    while (!writer.Finished()) {
+      const uint8_t* data;
+      size_t available;
+      {
+        ScopedPhase phase(kPhaseNewData);
+        available = params.nti.ring->WaitForData(&data);
+      }
+      if (available == 0) {
+        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - writer.BytesWritten())
+                   << " bytes of new data";
+        return -1;
+      }
 
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+      size_t write_now = std::min(
+          { available, writer.AvailableSpace(), next_checkpoint - writer.BytesWritten() });
+      if (writer.Write(data, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
-    }
+      params.nti.ring->Consume(write_now);
 
-    pthread_mutex_unlock(&params.nti.mu);
+      if (writer.BytesWritten() == next_checkpoint && !writer.Finished()) {
+        if (CheckpointNewData(params, writer) == -1) {
+          return -1;
+        }
+        next_checkpoint += new_data_checkpoint_bytes;
+      }
+    }
   }
 
   params.written += tgt.blocks();
@@ -1388,21 +4446,30 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   size_t offset;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &offset)) {
+  if (!ParseUint(params.tokens[params.cpos++], &offset)) {
     LOG(ERROR) << "invalid patch offset";
     return -1;
   }
 
   size_t len;
-  if (!android::base::ParseUint(params.tokens[params.cpos++], &len)) {
+  if (!ParseUint(params.tokens[params.cpos++], &len)) {
     LOG(ERROR) << "invalid patch len";
     return -1;
   }
 
+  // The patch may have been applied by a worker thread already.
+  std::unique_ptr<PatchResult> result;
+  if (params.patcher != nullptr) {
+    ScopedPhase phase(kPhasePatchApply);
+    result = params.patcher->Take(params.cmdindex);
+  }
+  params.precomputed = result.get();
+
   RangeSet tgt;
   size_t blocks = 0;
   bool overlap = false;
   int status = LoadSrcTgtVersion3(params, tgt, &blocks, false, &overlap);
+  params.precomputed = nullptr;
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for diff";
@@ -1421,26 +4488,34 @@ static int PerformCommandDiff(CommandParameters& params) {
   if (params.canwrite) {
     if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
-      Value patch_value(
-          VAL_BLOB, std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
-
-      RangeSinkWriter writer(params.fd, tgt);
-      if (params.cmdname[0] == 'i') {  // imgdiff
-        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value,
+      // View the patch in place in the mapped package; it may be tens of MiB.
+      std::string_view patch(reinterpret_cast<const char*>(params.patch_start + offset), len);
+
+      RangeSinkWriter writer(params.ctx, params.fd, tgt, params.direct_fd);
+      if (result != nullptr) {
+        if (writer.Write(result->target.data(), result->target.size()) !=
+            result->target.size()) {
+          LOG(ERROR) << "Failed to write patched blocks.";
+          return -1;
+        }
+      } else if (params.cmdname[0] == 'i') {  // imgdiff
+        ScopedPhase phase(kPhasePatchApply);
+        if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, patch,
                             std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
                                       std::placeholders::_2),
                             nullptr, nullptr) != 0) {
           LOG(ERROR) << "Failed to apply image patch.";
-          failure_type = kPatchApplicationFailure;
+          params.ctx.failure_type = kPatchApplicationFailure;
           return -1;
         }
       } else {
-        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch_value, 0,
+        ScopedPhase phase(kPhasePatchApply);
+        if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, patch, 0,
                              std::bind(&RangeSinkWriter::Write, &writer, std::placeholders::_1,
                                        std::placeholders::_2),
                              nullptr) != 0) {
           LOG(ERROR) << "Failed to apply bsdiff patch.";
-          failure_type = kPatchApplicationFailure;
+          params.ctx.failure_type = kPatchApplicationFailure;
           return -1;
         }
       }
@@ -1456,6 +4531,7 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   if (!params.freestash.empty()) {
+    params.checkpoint.Free(params.freestash, params.cmdindex);
     FreeStash(params.stashbase, params.freestash);
     params.freestash.clear();
   }
@@ -1492,13 +4568,9 @@ static int PerformCommandErase(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " erasing " << tgt.blocks() << " blocks";
 
-    for (const auto& range : tgt) {
-      uint64_t blocks[2];
-      // offset in bytes
-      blocks[0] = range.first * static_cast<uint64_t>(BLOCKSIZE);
-      // length in bytes
-      blocks[1] = (range.second - range.first) * static_cast<uint64_t>(BLOCKSIZE);
-
+    // Discard the adjacent ranges at once.
+    for (const auto& extent : MergedExtents(tgt)) {
+      uint64_t blocks[2] = { static_cast<uint64_t>(extent.first), extent.second };
       if (ioctl(params.fd, BLKDISCARD, &blocks) == -1 && errno != ENOTSUP) {
         PLOG(ERROR) << "BLKDISCARD ioctl failed";
         return -1;
@@ -1523,27 +4595,115 @@ struct Command {
 //    - new data stream (filename within package.zip)
 //    - patch stream (filename within package.zip, must be uncompressed)
 
+// Writes the profiles of the command types as CSV to the profile directory, and logs the time
+// spent in each phase along with the slowest commands.
+static void WriteBlockImageProfile(const std::string& name, const std::string& blockdev,
+                                   const std::map<std::string, CommandTypeProfile>& profiles,
+                                   std::vector<CommandProfile> slowest) {
+  if (profiles.empty()) {
+    return;
+  }
+
+  std::string content = "command,count,total_ms";
+  for (const char* phase_name : kProfilePhaseNames) {
+    content += android::base::StringPrintf(",%s_ms", phase_name);
+  }
+  content += ",blocks_read,blocks_written,blocks_stashed\n";
+
+  size_t count = 0;
+  double total_ms = 0;
+  double phase_ms[kPhaseCount] = {};
+  for (const auto& entry : profiles) {
+    const CommandTypeProfile& profile = entry.second;
+    content += android::base::StringPrintf("%s,%zu,%.3f", entry.first.c_str(), profile.count,
+                                           profile.total_ms);
+    for (size_t i = 0; i < kPhaseCount; i++) {
+      content += android::base::StringPrintf(",%.3f", profile.phase_ms[i]);
+      phase_ms[i] += profile.phase_ms[i];
+    }
+    content += android::base::StringPrintf(",%zu,%zu,%zu\n", profile.blocks_read,
+                                           profile.blocks_written, profile.blocks_stashed);
+    count += profile.count;
+    total_ms += profile.total_ms;
+  }
+
+  std::string partition = android::base::Basename(blockdev);
+  std::string profile_file =
+      CacheLocation::location().profile_directory() + "/" + name + "_profile_" + partition + ".csv";
+  if (!android::base::WriteStringToFile(content, profile_file)) {
+    PLOG(WARNING) << "Failed to write the profile to " << profile_file;
+  } else {
+    LOG(INFO) << "wrote the profile of " << profiles.size() << " command types to "
+              << profile_file;
+  }
+
+  std::string summary;
+  for (size_t i = 0; i < kPhaseCount; i++) {
+    summary += android::base::StringPrintf(" %s %.1f ms", kProfilePhaseNames[i], phase_ms[i]);
+  }
+  LOG(INFO) << android::base::StringPrintf("executed %zu commands in %.1f ms:", count, total_ms)
+            << summary;
+
+  std::sort(slowest.begin(), slowest.end(), [](const CommandProfile& a, const CommandProfile& b) {
+    return a.total_ms > b.total_ms;
+  });
+  LOG(INFO) << "slowest " << slowest.size() << " commands:";
+  for (const auto& profile : slowest) {
+    size_t dominant =
+        std::max_element(profile.phase_ms, profile.phase_ms + kPhaseCount) - profile.phase_ms;
+    LOG(INFO) << android::base::StringPrintf(
+        "  %d %s: %.1f ms, mostly %s (%.1f ms); %zu blocks read, %zu written, %zu stashed",
+        profile.cmdindex, profile.cmdname.c_str(), profile.total_ms, kProfilePhaseNames[dominant],
+        profile.phase_ms[dominant], profile.blocks_read, profile.blocks_written,
+        profile.blocks_stashed);
+  }
+}
+
+/**
+ * UpdateProgress reports the progress of the block image updates to the command pipe, as the
+ * fraction of the blocks that have been written. It's shared by the partitions that are updated
+ * together by block_image_update_parallel(), so that they advance a single progress bar.
+ */
+class UpdateProgress {
+ public:
+  UpdateProgress(FILE* cmd_pipe, size_t total_blocks)
+      : cmd_pipe_(cmd_pipe), total_blocks_(total_blocks) {}
+
+  // Adds |blocks| newly written blocks to the progress.
+  void Add(size_t blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    written_ += blocks;
+    fprintf(cmd_pipe_, "set_progress %.4f\n", static_cast<double>(written_) / total_blocks_);
+    fflush(cmd_pipe_);
+  }
+
+ private:
+  FILE* cmd_pipe_;
+  const size_t total_blocks_;
+  std::mutex mutex_;
+  size_t written_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(UpdateProgress);
+};
+
+// Updates (or verifies, if |dryrun| is true) the partition with the given arguments. The progress
+// is checkpointed to |last_command_file|, and reported to |progress| if it's shared with other
+// updates. The memory budgets and the worker threads are divided by |budget_shares|, the number of
+// the updates that run at the same time.
 static Value* PerformBlockImageUpdate(const char* name, State* state,
-                                      const std::vector<std::unique_ptr<Expr>>& argv,
-                                      const Command* commands, size_t cmdcount, bool dryrun) {
+                                      const std::vector<std::unique_ptr<Value>>& args,
+                                      const Command* commands, size_t cmdcount, bool dryrun,
+                                      const std::string& last_command_file,
+                                      UpdateProgress* progress, size_t budget_shares) {
   CommandParameters params = {};
   params.canwrite = !dryrun;
+  params.checkpoint.set_last_command_file(last_command_file);
 
   LOG(INFO) << "performing " << (dryrun ? "verification" : "update");
   if (state->is_retry) {
-    is_retry = true;
+    params.ctx.is_retry = true;
     LOG(INFO) << "This update is a retry.";
   }
-  if (argv.size() != 4) {
-    ErrorAbort(state, kArgsParsingFailure, "block_image_update expects 4 arguments, got %zu",
-               argv.size());
-    return StringValue("");
-  }
-
-  std::vector<std::unique_ptr<Value>> args;
-  if (!ReadValueArgs(state, argv, &args)) {
-    return nullptr;
-  }
 
   const std::unique_ptr<Value>& blockdev_filename = args[0];
   const std::unique_ptr<Value>& transfer_list_value = args[1];
@@ -1600,48 +4760,91 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("");
   }
 
+  // Optionally bypass the page cache for the patched and new data. Not all the block devices (or
+  // files) support O_DIRECT, in which case we keep writing through the page cache.
+  if (params.canwrite && android::base::GetBoolProperty("ro.updater.direct_io", false)) {
+    params.direct_fd.reset(
+        TEMP_FAILURE_RETRY(ota_open(blockdev_filename->data.c_str(), O_WRONLY | O_DIRECT)));
+    if (params.direct_fd == -1) {
+      PLOG(WARNING) << "open \"" << blockdev_filename->data << "\" with O_DIRECT failed";
+    }
+  }
+
   if (params.canwrite) {
     params.nti.za = za;
     params.nti.entry = new_entry;
-    params.nti.brotli_compressed = android::base::EndsWith(new_data_fn->data, ".br");
-    if (params.nti.brotli_compressed) {
-      // Initialize brotli decoder state.
-      params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
-    }
-    params.nti.receiver_available = true;
-
-    pthread_mutex_init(&params.nti.mu, nullptr);
-    pthread_cond_init(&params.nti.cv, nullptr);
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-
-    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
-    if (error != 0) {
-      PLOG(ERROR) << "pthread_create failed";
-      return StringValue("");
+    params.nti.codec = GetNewDataCodec(new_data_fn->data);
+    switch (params.nti.codec) {
+      case NewDataCodec::BROTLI:
+        // Initialize brotli decoder state.
+        params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
+        break;
+      case NewDataCodec::ZSTD:
+        params.nti.zstd_dstream.reset(ZSTD_createDStream());
+        if (params.nti.zstd_dstream == nullptr ||
+            ZSTD_isError(ZSTD_initDStream(params.nti.zstd_dstream.get()))) {
+          LOG(ERROR) << "Failed to initialize the zstd decoder";
+          return StringValue("");
+        }
+        break;
+      case NewDataCodec::LZ4: {
+        LZ4F_dctx* dctx = nullptr;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+          LZ4F_freeDecompressionContext(dctx);
+          LOG(ERROR) << "Failed to initialize the lz4 decoder";
+          return StringValue("");
+        }
+        params.nti.lz4_dctx.reset(dctx);
+        break;
+      }
+      case NewDataCodec::FRAMES:
+        if (new_entry.method != kCompressStored) {
+          LOG(ERROR) << "\"" << new_data_fn->data << "\" must be stored in the package";
+          return StringValue("");
+        }
+        // The frames are read straight out of the mapped package.
+        if (new_entry.offset < 0 ||
+            static_cast<uint64_t>(new_entry.offset) > ui->package_zip_len ||
+            new_entry.uncompressed_length > ui->package_zip_len - new_entry.offset) {
+          LOG(ERROR) << "\"" << new_data_fn->data << "\" at offset " << new_entry.offset << " with "
+                     << new_entry.uncompressed_length << " bytes exceeds the package of "
+                     << ui->package_zip_len << " bytes";
+          return StringValue("");
+        }
+        if (!ParseNewDataFrames(ui->package_zip_addr + new_entry.offset,
+                                new_entry.uncompressed_length, &params.nti.frames)) {
+          return StringValue("");
+        }
+        LOG(INFO) << "decompressing " << params.nti.frames.count() << " frames of new data";
+        break;
+      case NewDataCodec::NONE:
+        break;
     }
   }
 
-  std::vector<std::string> lines = android::base::Split(transfer_list_value->data, "\n");
-  if (lines.size() < 2) {
+  // Split the transfer list once. The commands refer to the lines and tokens in place.
+  TransferList transfer_list(transfer_list_value->data);
+  if (transfer_list.size() < 2) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zd]",
-               lines.size());
+               transfer_list.size());
     return StringValue("");
   }
 
   // First line in transfer list is the version number.
-  if (!android::base::ParseInt(lines[0], &params.version, 3, 4)) {
-    LOG(ERROR) << "unexpected transfer list version [" << lines[0] << "]";
+  std::string_view version_line = transfer_list.line(0);
+  if (!ParseInt(version_line, &params.version, 3, 4)) {
+    LOG(ERROR) << "unexpected transfer list version [" << version_line << "]";
     return StringValue("");
   }
 
   LOG(INFO) << "blockimg version is " << params.version;
 
   // Second line in transfer list is the total number of blocks we expect to write.
+  std::string_view total_blocks_line = transfer_list.line(1);
   size_t total_blocks;
-  if (!android::base::ParseUint(lines[1], &total_blocks)) {
-    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]", lines[1].c_str());
+  if (!ParseUint(total_blocks_line, &total_blocks)) {
+    ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%.*s]",
+               static_cast<int>(total_blocks_line.size()), total_blocks_line.data());
     return StringValue("");
   }
 
@@ -1649,21 +4852,29 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     return StringValue("t");
   }
 
+  std::unique_ptr<UpdateProgress> own_progress;
+  if (progress == nullptr) {
+    own_progress = std::make_unique<UpdateProgress>(cmd_pipe, total_blocks);
+    progress = own_progress.get();
+  }
+  size_t reported_blocks = 0;
+
   size_t start = 2;
-  if (lines.size() < 4) {
+  if (transfer_list.size() < 4) {
     ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]",
-               lines.size());
+               transfer_list.size());
     return StringValue("");
   }
 
   // Third line is how many stash entries are needed simultaneously.
-  LOG(INFO) << "maximum stash entries " << lines[2];
+  LOG(INFO) << "maximum stash entries " << transfer_list.line(2);
 
   // Fourth line is the maximum number of blocks that will be stashed simultaneously
+  std::string_view stash_max_blocks_line = transfer_list.line(3);
   size_t stash_max_blocks;
-  if (!android::base::ParseUint(lines[3], &stash_max_blocks)) {
-    ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%s]",
-               lines[3].c_str());
+  if (!ParseUint(stash_max_blocks_line, &stash_max_blocks)) {
+    ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%.*s]",
+               static_cast<int>(stash_max_blocks_line.size()), stash_max_blocks_line.data());
     return StringValue("");
   }
 
@@ -1674,6 +4885,16 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   params.createdstash = res;
 
+  // Keep the stashes in memory, within the budget, and only write them to /cache when needed.
+  if (params.canwrite) {
+    size_t stash_memory_mb = android::base::GetUintProperty<size_t>(
+        "ro.updater.stash_memory_mb", STASH_MEMORY_DEFAULT_MB);
+    if (stash_memory_mb > 0) {
+      params.memory_stash = std::make_unique<MemoryStash>(
+          params.ctx, stash_memory_mb * 1024 * 1024 / budget_shares);
+    }
+  }
+
   // When performing an update, save the index and cmdline of the current command into
   // the last_command_file if this command writes to the stash either explicitly of implicitly.
   // Upon resuming an update, read the saved index first; then
@@ -1685,16 +4906,130 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   //      stashes with duplicate id unintentionally (b/69858743); and also speed up the update.
   // If an update succeeds or is unresumable, delete the last_command_file.
   int saved_last_command_index;
-  if (!ParseLastCommandFile(&saved_last_command_index)) {
-    DeleteLastCommandFile();
+  if (!ParseLastCommandFile(last_command_file, &saved_last_command_index)) {
+    DeleteLastCommandFile(last_command_file);
     // We failed to parse the last command, set it explicitly to -1.
     saved_last_command_index = -1;
   }
 
   start += 2;
 
+  // Read the blocks for the upcoming commands in the background, so that the I/O overlaps with the
+  // patching and writing of the current command. In update mode, the commands up to the saved index
+  // will be skipped.
+  params.command_ranges.reserve(transfer_list.size() - start);
+  for (size_t i = start; i < transfer_list.size(); i++) {
+    params.command_ranges.push_back(ParseCommandRanges(transfer_list.tokens(i)));
+  }
+
+  // Start the new data where the last update has left it: after the data of the 'new' commands
+  // that will be skipped, and the part of the next command that has been written already.
+  params.new_data_resume_index = -1;
+  if (params.canwrite) {
+    size_t resume_index = saved_last_command_index + 1;
+    auto is_new = [&](size_t index) {
+      if (index >= params.command_ranges.size() || !params.command_ranges[index].valid) {
+        return false;
+      }
+      CommandTokens tokens = transfer_list.tokens(start + index);
+      return tokens.size() > 0 && tokens[0] == "new";
+    };
+    uint64_t new_data_offset = 0;
+    uint64_t new_data_total = 0;
+    for (size_t index = 0; index < params.command_ranges.size(); index++) {
+      if (is_new(index)) {
+        uint64_t bytes = static_cast<uint64_t>(params.command_ranges[index].writes.blocks()) *
+                         BLOCKSIZE;
+        if (index < resume_index) {
+          new_data_offset += bytes;
+        }
+        new_data_total += bytes;
+      }
+    }
+    int progress_index;
+    size_t progress_bytes;
+    if (ParseNewDataProgress(last_command_file, &progress_index, &progress_bytes) &&
+        static_cast<size_t>(progress_index) == resume_index && is_new(resume_index) &&
+        progress_bytes < params.command_ranges[resume_index].writes.blocks() * BLOCKSIZE) {
+      params.new_data_resume_index = progress_index;
+      params.new_data_resume_bytes = progress_bytes;
+      new_data_offset += progress_bytes;
+    }
+
+    // A framed entry restarts from the frame that holds the offset.
+    params.new_data_discard = new_data_offset;
+    if (params.nti.codec == NewDataCodec::FRAMES) {
+      const NewDataFrames& frames = params.nti.frames;
+      params.nti.first_frame = std::min<uint64_t>(new_data_offset / frames.frame_size,
+                                                  frames.count());
+      params.new_data_discard -= params.nti.first_frame * frames.frame_size;
+    }
+    if (new_data_offset > 0) {
+      LOG(INFO) << "resuming the new data at byte " << new_data_offset;
+    }
+
+    // The ring stays a power of two, so that its offsets remain continuous when the byte counts
+    // wrap around.
+    size_t ring_bytes = NEW_DATA_RING_BYTES;
+    while (ring_bytes > BLOCKSIZE && ring_bytes * budget_shares > NEW_DATA_RING_BYTES) {
+      ring_bytes /= 2;
+    }
+    params.nti.ring = std::make_unique<NewDataRing>(
+        ring_bytes, new_data_total - new_data_offset + params.new_data_discard);
+    params.nti.max_frame_threads = std::max<size_t>(NEW_DATA_MAX_THREADS / budget_shares, 1);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+
+    int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
+    if (error != 0) {
+      PLOG(ERROR) << "pthread_create failed";
+      return StringValue("");
+    }
+  }
+  size_t num_threads = std::max<size_t>(
+      std::min<size_t>(WorkerCount(), PATCH_MAX_THREADS) / budget_shares, 1);
+
+  // In verification mode, read and hash the blocks of the upcoming commands on worker threads
+  // instead, which do their own reads.
+  if (!params.canwrite) {
+    params.verifier = std::make_unique<VerifyScheduler>(transfer_list, start, params.command_ranges,
+                                                        params.stashbase);
+    if (!params.verifier->Start(blockdev_filename->data, num_threads)) {
+      params.verifier.reset();
+    }
+  }
+
+  if (params.verifier == nullptr) {
+    params.prefetcher = std::make_unique<SourcePrefetcher>(
+        params.command_ranges, params.canwrite ? saved_last_command_index + 1 : 0,
+        params.canwrite, PREFETCH_MAX_BYTES / budget_shares);
+    if (!params.prefetcher->Start(blockdev_filename->data)) {
+      params.prefetcher.reset();
+    }
+  }
+
+  params.block_cache = std::make_unique<BlockCache>(BLOCK_CACHE_BYTES / budget_shares);
+  size_t command_memory_mb = android::base::GetUintProperty<size_t>(
+      "ro.updater.command_memory_mb", COMMAND_MEMORY_DEFAULT_MB);
+  params.memory_budget =
+      std::make_unique<MemoryBudget>(command_memory_mb * 1024 * 1024 / budget_shares);
+
+  // Apply the patches of the upcoming diff commands on worker threads. The results are written in
+  // the order of the transfer list, so there's nothing to do ahead of time in verification mode.
+  if (params.canwrite) {
+    params.patcher = std::make_unique<PatchScheduler>(
+        transfer_list, start, params.command_ranges, saved_last_command_index + 1, params.stashbase,
+        params.memory_stash.get(), params.patch_start, params.prefetcher.get(),
+        PATCH_MAX_BYTES / budget_shares);
+    if (!params.patcher->Start(blockdev_filename->data, num_threads)) {
+      params.patcher.reset();
+    }
+  }
+
   // Build a map of the available commands
-  std::unordered_map<std::string, const Command*> cmd_map;
+  std::unordered_map<std::string_view, const Command*> cmd_map;
   for (size_t i = 0; i < cmdcount; ++i) {
     if (cmd_map.find(commands[i].name) != cmd_map.end()) {
       LOG(ERROR) << "Error: command [" << commands[i].name << "] already exists in the cmd map.";
@@ -1706,19 +5041,20 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   int rc = -1;
 
   // Subsequent lines are all individual transfer commands
-  for (size_t i = start; i < lines.size(); i++) {
-    const std::string& line = lines[i];
+  for (size_t i = start; i < transfer_list.size(); i++) {
+    std::string_view line = transfer_list.line(i);
     if (line.empty()) continue;
 
-    params.tokens = android::base::Split(line, " ");
+    params.tokens = transfer_list.tokens(i);
     params.cpos = 0;
     if (i - start > std::numeric_limits<int>::max()) {
       params.cmdindex = -1;
     } else {
       params.cmdindex = i - start;
     }
-    params.cmdname = params.tokens[params.cpos++].c_str();
-    params.cmdline = line.c_str();
+    params.cmdname = params.tokens[params.cpos++];
+    params.cmdline = line;
+    params.previous_cmdline = (i > start) ? transfer_list.line(i - 1) : "";
     params.target_verified = false;
 
     if (cmd_map.find(params.cmdname) == cmd_map.end()) {
@@ -1742,7 +5078,43 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       continue;
     }
 
-    if (cmd->f(params) == -1) {
+    ScopedCommandProfile profile(params);
+
+    if (params.prefetcher != nullptr && params.cmdindex != -1) {
+      params.prefetcher->Advance(params.cmdindex);
+    }
+    if (params.patcher != nullptr && params.cmdindex != -1) {
+      params.patcher->Advance(params.cmdindex);
+    }
+    std::unique_ptr<VerifyResult> verified;
+    if (params.verifier != nullptr && params.cmdindex != -1) {
+      params.verifier->Advance(params.cmdindex);
+      verified = params.verifier->Take(params.cmdindex);
+    }
+    params.verified = verified.get();
+
+    // Persist the stashes in memory before their source blocks get overwritten. Commands that
+    // can't be parsed ahead of time may write anywhere.
+    if (params.memory_stash != nullptr &&
+        (params.cmdindex == -1 || !params.command_ranges[params.cmdindex].valid ||
+         params.memory_stash->Overlaps(params.command_ranges[params.cmdindex].writes))) {
+      if (!params.memory_stash->Persist(params.stashbase, &params.checkpoint)) {
+        LOG(ERROR) << "failed to persist the stashes in memory";
+        goto pbiudone;
+      }
+    }
+
+    int result = cmd->f(params);
+    params.verified = nullptr;
+    // Drop the cached blocks that the command has written. Commands that can't be parsed ahead of
+    // time may have written anywhere.
+    if (params.cmdindex == -1 || !params.command_ranges[params.cmdindex].valid) {
+      params.block_cache->Clear();
+    } else {
+      params.block_cache->Invalidate(params.command_ranges[params.cmdindex].writes);
+    }
+    params.memory_budget->Release(params.buffer);
+    if (result == -1) {
       LOG(ERROR) << "failed to execute command [" << line << "]";
       goto pbiudone;
     }
@@ -1753,41 +5125,91 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     if (!params.canwrite && saved_last_command_index != -1 && params.cmdindex != -1 &&
         params.cmdindex <= saved_last_command_index) {
       // TODO(xunchang) check that the cmdline of the saved index is correct.
-      std::string cmdname = std::string(params.cmdname);
+      std::string_view cmdname = params.cmdname;
       if ((cmdname == "move" || cmdname == "bsdiff" || cmdname == "imgdiff") &&
           !params.target_verified) {
         LOG(WARNING) << "Previously executed command " << saved_last_command_index << ": "
                      << params.cmdline << " doesn't produce expected target blocks.";
         saved_last_command_index = -1;
-        DeleteLastCommandFile();
+        DeleteLastCommandFile(last_command_file);
       }
     }
     if (params.canwrite) {
+      ScopedPhase phase(kPhaseFsync);
       if (ota_fsync(params.fd) == -1) {
-        failure_type = kFsyncFailure;
+        params.ctx.failure_type = kFsyncFailure;
         PLOG(ERROR) << "fsync failed";
         goto pbiudone;
       }
-      fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
-      fflush(cmd_pipe);
+      progress->Add(params.written - reported_blocks);
+      reported_blocks = params.written;
     }
   }
 
   rc = 0;
 
 pbiudone:
+  // block_image_verify leaves /cache alone.
+  if (params.canwrite) {
+    WriteBlockImageProfile(name, blockdev_filename->data, params.profiles,
+                           std::move(params.slowest_commands));
+  }
+
+  if (params.patcher != nullptr) {
+    params.patcher->LogStats();
+    params.patcher.reset();
+  }
+  if (params.prefetcher != nullptr) {
+    params.prefetcher->LogStats();
+    params.prefetcher.reset();
+  }
+  if (params.verifier != nullptr) {
+    params.verifier->LogStats();
+    params.verifier.reset();
+  }
+  if (params.block_cache != nullptr) {
+    params.block_cache->LogStats();
+    params.block_cache.reset();
+  }
+  if (params.memory_budget != nullptr) {
+    params.memory_budget->LogStats();
+    params.memory_budget.reset();
+  }
+  if (params.memory_stash != nullptr) {
+    // Save the stashes in memory, so that a retry can resume from the last stash command.
+    if (rc != 0 && !params.isunresumable &&
+        !params.memory_stash->Persist(params.stashbase, &params.checkpoint)) {
+      LOG(WARNING) << "failed to persist the stashes in memory";
+    }
+    params.memory_stash->LogStats();
+    params.memory_stash.reset();
+  }
+  // Save the pending checkpoint, so that a retry doesn't need to execute the commands again.
+  if (rc != 0 && !params.isunresumable && !params.checkpoint.Commit()) {
+    LOG(WARNING) << "failed to save the last checkpoint";
+  }
+  if (params.canwrite) {
+    LOG(INFO) << "updated the last command file " << params.checkpoint.commits()
+              << " times, and the progress of the new data " << params.checkpoint.new_data_commits()
+              << " times";
+  }
+
   if (params.canwrite) {
-    pthread_mutex_lock(&params.nti.mu);
-    if (params.nti.receiver_available) {
-      LOG(WARNING) << "new data receiver is still available after executing all commands.";
+    // Once all the commands have consumed their data, the receiver is left with the end of the
+    // stream, which it must get through without producing any more output. Stop it on a failure.
+    if (rc != 0) {
+      params.nti.ring->Close();
     }
-    params.nti.receiver_available = false;
-    pthread_cond_broadcast(&params.nti.cv);
-    pthread_mutex_unlock(&params.nti.mu);
     int ret = pthread_join(params.thread, nullptr);
     if (ret != 0) {
       LOG(WARNING) << "pthread join returned with " << strerror(ret);
     }
+    // A stored entry may carry some trailing bytes, but a decoder that produces more data than
+    // the commands consume has been given a corrupt or oversized stream.
+    if (rc == 0 && params.nti.codec != NewDataCodec::NONE && params.nti.ring->Overflowed()) {
+      LOG(ERROR) << "No space left in output range";
+      rc = -1;
+    }
 
     if (rc == 0) {
       LOG(INFO) << "wrote " << params.written << " blocks; expected " << total_blocks;
@@ -1803,17 +5225,14 @@ pbiudone:
       // Delete stash only after successfully completing the update, as it may contain blocks needed
       // to complete the update later.
       DeleteStash(params.stashbase);
-      DeleteLastCommandFile();
+      DeleteLastCommandFile(last_command_file);
     }
-
-    pthread_mutex_destroy(&params.nti.mu);
-    pthread_cond_destroy(&params.nti.cv);
   } else if (rc == 0) {
     LOG(INFO) << "verified partition contents; update may be resumed";
   }
 
   if (ota_fsync(params.fd) == -1) {
-    failure_type = kFsyncFailure;
+    params.ctx.failure_type = kFsyncFailure;
     PLOG(ERROR) << "fsync failed";
   }
   // params.fd will be automatically closed because it's a unique_fd.
@@ -1821,10 +5240,12 @@ pbiudone:
   if (params.nti.brotli_decoder_state != nullptr) {
     BrotliDecoderDestroyInstance(params.nti.brotli_decoder_state);
   }
+  params.nti.zstd_dstream.reset();
+  params.nti.lz4_dctx.reset();
 
   // Delete the last command file if the update cannot be resumed.
   if (params.isunresumable) {
-    DeleteLastCommandFile();
+    DeleteLastCommandFile(last_command_file);
   }
 
   // Only delete the stash if the update cannot be resumed, or it's a verification run and we
@@ -1833,13 +5254,46 @@ pbiudone:
     DeleteStash(params.stashbase);
   }
 
-  if (failure_type != kNoCause && state->cause_code == kNoCause) {
-    state->cause_code = failure_type;
+  if (params.ctx.failure_type != kNoCause && state->cause_code == kNoCause) {
+    state->cause_code = params.ctx.failure_type;
   }
 
   return StringValue(rc == 0 ? "t" : "");
 }
 
+// Returns the last_command_file of |blockdev| for block_image_update_parallel(), which keeps one
+// for each partition next to the usual one.
+static std::string PartitionLastCommandFile(const std::string& blockdev) {
+  return CacheLocation::location().last_command_file() + "_" + android::base::Basename(blockdev);
+}
+
+static Value* PerformBlockImageUpdate(const char* name, State* state,
+                                      const std::vector<std::unique_ptr<Expr>>& argv,
+                                      const Command* commands, size_t cmdcount, bool dryrun) {
+  if (argv.size() != 4) {
+    ErrorAbort(state, kArgsParsingFailure, "block_image_update expects 4 arguments, got %zu",
+               argv.size());
+    return StringValue("");
+  }
+
+  std::vector<std::unique_ptr<Value>> args;
+  if (!ReadValueArgs(state, argv, &args)) {
+    return nullptr;
+  }
+
+  // Verify the partition against the progress of an interrupted block_image_update_parallel(), if
+  // it has left one; so that the commands it has executed are checked by their targets.
+  std::string last_command_file = CacheLocation::location().last_command_file();
+  if (dryrun) {
+    std::string partition_file = PartitionLastCommandFile(args[0]->data);
+    if (access(partition_file.c_str(), F_OK) == 0) {
+      last_command_file = partition_file;
+    }
+  }
+  return PerformBlockImageUpdate(name, state, args, commands, cmdcount, dryrun, last_command_file,
+                                 nullptr, 1);
+}
+
 /**
  * The transfer list is a text file containing commands to transfer data from one place to another
  * on the target partition. We parse it and execute the commands in order:
@@ -1903,21 +5357,137 @@ Value* BlockImageVerifyFn(const char* name, State* state,
                 sizeof(commands) / sizeof(commands[0]), true);
 }
 
+static const Command update_commands[] = {
+    { "bsdiff",     PerformCommandDiff  },
+    { "erase",      PerformCommandErase },
+    { "free",       PerformCommandFree  },
+    { "imgdiff",    PerformCommandDiff  },
+    { "move",       PerformCommandMove  },
+    { "new",        PerformCommandNew   },
+    { "stash",      PerformCommandStash },
+    { "zero",       PerformCommandZero  }
+};
+
 Value* BlockImageUpdateFn(const char* name, State* state,
                           const std::vector<std::unique_ptr<Expr>>& argv) {
-    const Command commands[] = {
-        { "bsdiff",     PerformCommandDiff  },
-        { "erase",      PerformCommandErase },
-        { "free",       PerformCommandFree  },
-        { "imgdiff",    PerformCommandDiff  },
-        { "move",       PerformCommandMove  },
-        { "new",        PerformCommandNew   },
-        { "stash",      PerformCommandStash },
-        { "zero",       PerformCommandZero  }
-    };
+    return PerformBlockImageUpdate(name, state, argv, update_commands,
+                sizeof(update_commands) / sizeof(update_commands[0]), false);
+}
 
-    return PerformBlockImageUpdate(name, state, argv, commands,
-                sizeof(commands) / sizeof(commands[0]), false);
+// block_image_update_parallel(<partition1>, <transfer_list1>, <new_data1>, <patch_data1>,
+//                             <partition2>, ...)
+// Updates several partitions at the same time, each on its own thread; the arguments for each
+// partition are the same as block_image_update(). The partitions get their own last_command_file
+// (suffixed with the name of the block device), so that each of them can resume on its own;
+// block_image_verify() picks it up for the partition. Each partition reads the package through its
+// own zip handle. The memory budgets and the worker threads of a single update are shared evenly
+// by the partitions, and the progress is reported for all the blocks of all the partitions.
+// Returns "t" if all the updates succeed.
+Value* BlockImageUpdateParallelFn(const char* name, State* state,
+                                  const std::vector<std::unique_ptr<Expr>>& argv) {
+  if (argv.empty() || argv.size() % 4 != 0) {
+    ErrorAbort(state, kArgsParsingFailure, "%s expects a multiple of 4 arguments, got %zu", name,
+               argv.size());
+    return StringValue("");
+  }
+
+  // Evaluate all the arguments on this thread; the updates only run the transfer lists.
+  std::vector<std::unique_ptr<Value>> args;
+  if (!ReadValueArgs(state, argv, &args)) {
+    return nullptr;
+  }
+
+  UpdaterInfo* ui = static_cast<UpdaterInfo*>(state->cookie);
+  if (ui == nullptr || ui->cmd_pipe == nullptr) {
+    ErrorAbort(state, kArgsParsingFailure, "%s(): no updater info or command pipe", name);
+    return StringValue("");
+  }
+
+  size_t count = args.size() / 4;
+  std::vector<std::vector<std::unique_ptr<Value>>> partition_args(count);
+  std::vector<std::string> last_command_files;
+  size_t total_blocks = 0;
+  for (size_t i = 0; i < count; i++) {
+    for (size_t j = 0; j < 4; j++) {
+      partition_args[i].push_back(std::move(args[i * 4 + j]));
+    }
+    const std::string& blockdev = partition_args[i][0]->data;
+    std::string last_command_file = PartitionLastCommandFile(blockdev);
+    if (std::find(last_command_files.begin(), last_command_files.end(), last_command_file) !=
+        last_command_files.end()) {
+      ErrorAbort(state, kArgsParsingFailure, "%s: \"%s\" is given more than once", name,
+                 blockdev.c_str());
+      return StringValue("");
+    }
+    last_command_files.push_back(last_command_file);
+
+    // The second line of the transfer list is the number of blocks to write. A malformed transfer
+    // list is rejected by its update.
+    std::string_view transfer_list(partition_args[i][1]->data);
+    size_t line_start = transfer_list.find('\n');
+    if (line_start != std::string_view::npos) {
+      std::string_view line = transfer_list.substr(line_start + 1);
+      size_t blocks;
+      if (ParseUint(line.substr(0, line.find('\n')), &blocks)) {
+        total_blocks += blocks;
+      }
+    }
+  }
+
+  // Open the mapped package once for each partition, so that the threads don't share the state of
+  // a zip handle.
+  std::vector<UpdaterInfo> infos(count, *ui);
+  for (size_t i = 0; i < count; i++) {
+    if (OpenArchiveFromMemory(ui->package_zip_addr, ui->package_zip_len,
+                              partition_args[i][0]->data.c_str(), &infos[i].package_zip) != 0) {
+      ErrorAbort(state, kPackageExtractFileFailure, "%s(): failed to open the package for %s",
+                 name, partition_args[i][0]->data.c_str());
+      for (size_t j = 0; j < i; j++) {
+        CloseArchive(infos[j].package_zip);
+      }
+      return StringValue("");
+    }
+  }
+
+  UpdateProgress progress(ui->cmd_pipe, std::max<size_t>(total_blocks, 1));
+  std::vector<std::unique_ptr<State>> states;
+  for (size_t i = 0; i < count; i++) {
+    states.push_back(std::make_unique<State>(state->script, &infos[i]));
+    states[i]->is_retry = state->is_retry;
+  }
+  std::vector<std::unique_ptr<Value>> results(count);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < count; i++) {
+    threads.emplace_back([&, i]() {
+      results[i].reset(PerformBlockImageUpdate(
+          name, states[i].get(), partition_args[i], update_commands,
+          sizeof(update_commands) / sizeof(update_commands[0]), false, last_command_files[i],
+          &progress, count));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& info : infos) {
+    CloseArchive(info.package_zip);
+  }
+
+  // Report the first failure.
+  bool success = true;
+  for (size_t i = 0; i < count; i++) {
+    if (results[i] != nullptr && results[i]->data == "t") {
+      continue;
+    }
+    LOG(ERROR) << name << "(): failed to update " << partition_args[i][0]->data;
+    if (success) {
+      state->errmsg = states[i]->errmsg;
+      if (state->cause_code == kNoCause) {
+        state->cause_code = states[i]->cause_code;
+      }
+    }
+    success = false;
+  }
+  return StringValue(success ? "t" : "");
 }
 
 Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique_ptr<Expr>>& argv) {
@@ -1956,16 +5526,18 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
   SHA_CTX ctx;
   SHA1_Init(&ctx);
 
+  // The failures are reported with their own cause codes below.
+  BlockImageContext context;
   std::vector<uint8_t> buffer(BLOCKSIZE);
   for (const auto& range : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
+    if (!check_lseek(context, fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
       ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", blockdev_filename->data.c_str(),
                  strerror(errno));
       return StringValue("");
     }
 
     for (size_t j = range.first; j < range.second; ++j) {
-      if (read_all(fd, buffer, BLOCKSIZE) == -1) {
+      if (read_all(context, fd, buffer, BLOCKSIZE) == -1) {
         ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data.c_str(),
                    strerror(errno));
         return StringValue("");
@@ -2015,7 +5587,8 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   RangeSet blk0(std::vector<Range>{ Range{ 0, 1 } });
   std::vector<uint8_t> block0_buffer(BLOCKSIZE);
 
-  if (ReadBlocks(blk0, block0_buffer, fd) == -1) {
+  BlockImageContext context;
+  if (ReadBlocks(context, blk0, block0_buffer, fd) == -1) {
     ErrorAbort(state, kFreadFailure, "failed to read %s: %s", arg_filename->data.c_str(),
                strerror(errno));
     return StringValue("");
@@ -2039,6 +5612,128 @@ Value* CheckFirstBlockFn(const char* name, State* state,
   return StringValue("t");
 }
 
+// The outcome of recovering a group of blocks on one worker thread.
+struct RecoverResult {
+  size_t blocks = 0;
+  // The blocks that read differently through libfec, i.e. that have been corrected.
+  size_t corrected = 0;
+  bool success = true;
+  size_t failed_block = 0;
+  int failed_errno = 0;
+};
+
+// Reads |ranges| through |fh| in batches of RECOVER_BATCH_BLOCKS, which makes libfec correct and
+// rewrite the corrupted blocks. Each batch is read from |fd| first, bypassing libfec, to tell the
+// corrected blocks apart; that read also brings the blocks into the page cache for libfec. Stops
+// early once |failed| is set by another worker.
+static void RecoverBlocks(fec::io& fh, int fd, const RangeSet& ranges,
+                          const std::atomic<bool>& failed, RecoverResult* result) {
+  std::vector<uint8_t> raw(RECOVER_BATCH_BLOCKS * BLOCKSIZE);
+  std::vector<uint8_t> recovered(RECOVER_BATCH_BLOCKS * BLOCKSIZE);
+  for (const auto& range : ranges) {
+    for (size_t block = range.first; block < range.second; block += RECOVER_BATCH_BLOCKS) {
+      if (failed.load()) {
+        return;
+      }
+      size_t end = std::min(range.second, block + RECOVER_BATCH_BLOCKS);
+      size_t size = (end - block) * BLOCKSIZE;
+      bool raw_read =
+          fd != -1 && ReadBlocksInBackground(fd, RangeSet({ { block, end } }), raw.data());
+      if (fh.pread(recovered.data(), size, static_cast<off64_t>(block) * BLOCKSIZE) !=
+          static_cast<ssize_t>(size)) {
+        result->success = false;
+        result->failed_block = block;
+        result->failed_errno = errno;
+        return;
+      }
+      result->blocks += end - block;
+      if (raw_read) {
+        for (size_t i = 0; i < size; i += BLOCKSIZE) {
+          if (memcmp(raw.data() + i, recovered.data() + i, BLOCKSIZE) != 0) {
+            result->corrected++;
+          }
+        }
+      }
+    }
+  }
+}
+
+bool RecoverBlockImage(const std::string& filename, fec::io& fh, uint64_t data_size,
+                       const RangeSet& ranges, RecoverStats* stats, std::string* err) {
+  // Stay within the data area, libfec validates and corrects metadata. The last block of the data
+  // area may be a partial one.
+  size_t data_blocks = (data_size + BLOCKSIZE - 1) / BLOCKSIZE;
+  RangeSet data;
+  for (const auto& range : ranges) {
+    if (range.first < data_blocks) {
+      data.PushBack({ range.first, std::min(range.second, data_blocks) });
+    }
+  }
+  if (!data) {
+    return true;
+  }
+
+  // Split the blocks among the workers, each of which reads through its own libfec handle. The
+  // first one uses |fh|.
+  size_t num_threads = std::min<size_t>({ WorkerCount(), RECOVER_MAX_THREADS, data.blocks() });
+  std::vector<RangeSet> groups = data.Split(num_threads);
+  std::vector<fec::io> handles(groups.size() - 1);
+  std::vector<android::base::unique_fd> fds;
+  for (size_t i = 0; i < groups.size(); i++) {
+    if (i > 0 && !handles[i - 1].open(filename, O_RDWR)) {
+      *err = android::base::StringPrintf("fec_open \"%s\" failed: %s", filename.c_str(),
+                                         strerror(errno));
+      return false;
+    }
+    fds.emplace_back(TEMP_FAILURE_RETRY(ota_open(filename.c_str(), O_RDONLY)));
+    if (fds.back() == -1) {
+      PLOG(WARNING) << "failed to open \"" << filename << "\"; not counting the corrections";
+    }
+  }
+
+  // If we want to be able to recover from a situation where rewriting a corrected
+  // block doesn't guarantee the same data will be returned when re-read later, we
+  // can save a copy of corrected blocks to /cache. Note:
+  //
+  //  1. Maximum space required from /cache is the same as the maximum number of
+  //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
+  //     this would be ~16 MiB, for example.
+  //
+  //  2. RecoverBlocks() already finds the corrected blocks, by reading them without
+  //     libfec first.
+  auto start = std::chrono::steady_clock::now();
+  std::atomic<bool> failed{ false };
+  std::vector<RecoverResult> results(groups.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < groups.size(); i++) {
+    workers.emplace_back([&, i]() {
+      RecoverBlocks(i == 0 ? fh : handles[i - 1], fds[i], groups[i], failed, &results[i]);
+      if (!results[i].success) {
+        failed.store(true);
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+  for (const auto& result : results) {
+    if (!result.success) {
+      *err = android::base::StringPrintf("failed to recover %s (block %zu): %s", filename.c_str(),
+                                         result.failed_block, strerror(result.failed_errno));
+      return false;
+    }
+    stats->blocks += result.blocks;
+    stats->corrected += result.corrected;
+  }
+  LOG(INFO) << "read " << stats->blocks << " blocks on " << workers.size() << " threads in "
+            << duration.count() << " s ("
+            << stats->blocks * BLOCKSIZE / 1048576.0 / std::max(duration.count(), 1e-6)
+            << " MiB/s); corrected " << stats->corrected << " blocks";
+  return true;
+}
+
 Value* BlockImageRecoverFn(const char* name, State* state,
                            const std::vector<std::unique_ptr<Expr>>& argv) {
   if (argv.size() != 2) {
@@ -2092,39 +5787,24 @@ Value* BlockImageRecoverFn(const char* name, State* state,
     return StringValue("");
   }
 
-  uint8_t buffer[BLOCKSIZE];
-  for (const auto& range : rs) {
-    for (size_t j = range.first; j < range.second; ++j) {
-      // Stay within the data area, libfec validates and corrects metadata
-      if (status.data_size <= static_cast<uint64_t>(j) * BLOCKSIZE) {
-        continue;
-      }
-
-      if (fh.pread(buffer, BLOCKSIZE, static_cast<off64_t>(j) * BLOCKSIZE) != BLOCKSIZE) {
-        ErrorAbort(state, kLibfecFailure, "failed to recover %s (block %zu): %s",
-                   filename->data.c_str(), j, strerror(errno));
-        return StringValue("");
-      }
-
-      // If we want to be able to recover from a situation where rewriting a corrected
-      // block doesn't guarantee the same data will be returned when re-read later, we
-      // can save a copy of corrected blocks to /cache. Note:
-      //
-      //  1. Maximum space required from /cache is the same as the maximum number of
-      //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
-      //     this would be ~16 MiB, for example.
-      //
-      //  2. To find out if this block was corrupted, call fec_get_status after each
-      //     read and check if the errors field value has increased.
-    }
+  RecoverStats stats;
+  std::string err;
+  if (!RecoverBlockImage(filename->data, fh, status.data_size, rs, &stats, &err)) {
+    ErrorAbort(state, kLibfecFailure, "%s", err.c_str());
+    return StringValue("");
   }
   LOG(INFO) << "..." << filename->data << " image recovered successfully.";
   return StringValue("t");
 }
 
+void SetNewDataCheckpointInterval(size_t bytes) {
+  new_data_checkpoint_bytes = bytes;
+}
+
 void RegisterBlockImageFunctions() {
   RegisterFunction("block_image_verify", BlockImageVerifyFn);
   RegisterFunction("block_image_update", BlockImageUpdateFn);
+  RegisterFunction("block_image_update_parallel", BlockImageUpdateParallelFn);
   RegisterFunction("block_image_recover", BlockImageRecoverFn);
   RegisterFunction("check_first_block", CheckFirstBlockFn);
   RegisterFunction("range_sha1", RangeSha1Fn);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Private headers exposed for testing purpose only.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <fec/io.h>
+
+#include "otautil/rangeset.h"
+
+// How often a 'new' command records its progress by default, so that a resumed update doesn't
+// write (or, with a framed entry, decompress) the same data again.
+constexpr size_t NEW_DATA_CHECKPOINT_BYTES = 64 * 1024 * 1024;
+
+// Sets how many bytes a 'new' command writes between the checkpoints of its progress. It must be a
+// multiple of the block size.
+void SetNewDataCheckpointInterval(size_t bytes);
+
+struct RecoverStats {
+  // The blocks read through libfec.
+  size_t blocks = 0;
+  // The blocks that read differently through libfec, i.e. that have been corrected.
+  size_t corrected = 0;
+};
+
+// Reads |ranges| of |filename| through libfec on a few threads, which makes libfec correct and
+// rewrite the corrupted blocks. |fh| is an open handle to the file, and the ranges are clipped to
+// the first |data_size| bytes of it. Returns false and sets |err| on failure.
+bool RecoverBlockImage(const std::string& filename, fec::io& fh, uint64_t data_size,
+                       const RangeSet& ranges, RecoverStats* stats, std::string* err);
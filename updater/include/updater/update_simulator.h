@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_UPDATE_SIMULATOR_H_
+#define _UPDATER_UPDATE_SIMULATOR_H_
+
+// Replays the block image update of one partition from an OTA package against a copy of the
+// source image, and prints the time it takes. See update_simulator.cpp for the arguments. Returns
+// 0 on success.
+int update_simulator(int argc, const char** argv);
+
+#endif
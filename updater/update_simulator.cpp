@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// update_simulator replays the block image update of one partition from an OTA package on the
+// host, against a copy of the source image, and reports how long it takes.
+//
+// Usage: update_simulator [options] <ota_package.zip> <source_image>
+//   --partition=<name>   The partition to update, i.e. the prefix of the transfer list, the new
+//                        data and the patch data in the package. Defaults to "system".
+//   --work_dir=<dir>     Where to keep the target image, the stashes and the profiles. Defaults to
+//                        a new directory under /tmp, which is removed after a successful run
+//                        unless --keep is given.
+//   --verify             Run block_image_verify on the source image before the update.
+//   --keep               Keep the work directory.
+//
+// The source image is copied into the work directory first, so it stays intact and the runs can
+// be repeated and compared across builds. The stashes and the last_command_file go to the work
+// directory instead of /cache.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <ziparchive/zip_archive.h>
+
+#include "edify/expr.h"
+#include "otafault/config.h"
+#include "otautil/SysUtil.h"
+#include "otautil/cache_location.h"
+#include "otautil/error_code.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/update_simulator.h"
+#include "updater/updater.h"
+
+struct selabel_handle* sehandle = nullptr;
+
+// blockimg.cpp prints the remount history of the partition with uiPrintf(), which is provided by
+// install.cpp in the updater.
+void uiPrintf(State* _Nonnull state, const char* _Nonnull format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  std::string message;
+  android::base::StringAppendV(&message, format, ap);
+  va_end(ap);
+  LOG(INFO) << message;
+}
+
+// package_extract_file(package_path): returns the contents of the entry in the package. The
+// simulator only needs the one-argument version, which the block image updates use for the
+// transfer list.
+static Value* PackageExtractFileFn(const char* name, State* state,
+                                   const std::vector<std::unique_ptr<Expr>>& argv) {
+  std::vector<std::string> args;
+  if (argv.size() != 1 || !ReadArgs(state, argv, &args)) {
+    return ErrorAbort(state, kArgsParsingFailure, "%s() expects 1 arg, got %zu", name,
+                      argv.size());
+  }
+
+  ZipArchiveHandle za = static_cast<UpdaterInfo*>(state->cookie)->package_zip;
+  ZipString zip_string_path(args[0].c_str());
+  ZipEntry entry;
+  if (FindEntry(za, zip_string_path, &entry) != 0) {
+    return ErrorAbort(state, kPackageExtractFileFailure, "%s(): no %s in package", name,
+                      args[0].c_str());
+  }
+
+  std::string buffer(entry.uncompressed_length, '\0');
+  int32_t ret = ExtractToMemory(za, &entry, reinterpret_cast<uint8_t*>(&buffer[0]), buffer.size());
+  if (ret != 0) {
+    return ErrorAbort(state, kPackageExtractFileFailure, "%s(): failed to extract %s: %s", name,
+                      args[0].c_str(), ErrorCodeString(ret));
+  }
+  return new Value(VAL_BLOB, buffer);
+}
+
+static bool HasEntry(ZipArchiveHandle za, const std::string& name) {
+  ZipString zip_string_path(name.c_str());
+  ZipEntry entry;
+  return FindEntry(za, zip_string_path, &entry) == 0;
+}
+
+// Sums up the per-phase times in the profile written by PerformBlockImageUpdate(). Returns the
+// phase names and their totals in milliseconds, in the order of the columns.
+static bool ReadProfile(const std::string& path,
+                        std::vector<std::pair<std::string, double>>* phases) {
+  std::string content;
+  if (!android::base::ReadFileToString(path, &content)) {
+    PLOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+  std::vector<std::string> lines = android::base::Split(android::base::Trim(content), "\n");
+  if (lines.empty()) {
+    return false;
+  }
+
+  // command,count,total_ms,<phase>_ms,...,blocks_read,blocks_written,blocks_stashed
+  std::vector<std::string> header = android::base::Split(lines[0], ",");
+  std::vector<size_t> columns;
+  for (size_t i = 3; i < header.size(); i++) {
+    if (android::base::EndsWith(header[i], "_ms")) {
+      phases->emplace_back(header[i].substr(0, header[i].size() - 3), 0.0);
+      columns.push_back(i);
+    }
+  }
+  for (size_t i = 1; i < lines.size(); i++) {
+    std::vector<std::string> fields = android::base::Split(lines[i], ",");
+    for (size_t k = 0; k < columns.size(); k++) {
+      if (columns[k] < fields.size()) {
+        (*phases)[k].second += strtod(fields[columns[k]].c_str(), nullptr);
+      }
+    }
+  }
+  return true;
+}
+
+// Returns the value of the "log <key>: <value>" line that the updater sent to the command pipe.
+static size_t ReadPipeLog(const std::string& pipe_content, const std::string& key) {
+  for (const auto& line : android::base::Split(pipe_content, "\n")) {
+    std::string prefix = "log " + key + ": ";
+    size_t value;
+    if (android::base::StartsWith(line, prefix) &&
+        android::base::ParseUint(line.substr(prefix.size()), &value)) {
+      return value;
+    }
+  }
+  return 0;
+}
+
+// Copies |source| to |target| in chunks, so that the copy doesn't add to the peak memory.
+static bool CopyImage(const std::string& source, const std::string& target) {
+  android::base::unique_fd source_fd(TEMP_FAILURE_RETRY(open(source.c_str(), O_RDONLY)));
+  if (source_fd == -1) {
+    PLOG(ERROR) << "Failed to open " << source;
+    return false;
+  }
+  android::base::unique_fd target_fd(
+      TEMP_FAILURE_RETRY(open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+  if (target_fd == -1) {
+    PLOG(ERROR) << "Failed to create " << target;
+    return false;
+  }
+  std::vector<char> buffer(1024 * 1024);
+  while (true) {
+    ssize_t n = TEMP_FAILURE_RETRY(read(source_fd, buffer.data(), buffer.size()));
+    if (n == -1) {
+      PLOG(ERROR) << "Failed to read " << source;
+      return false;
+    }
+    if (n == 0) {
+      return true;
+    }
+    if (!android::base::WriteFully(target_fd, buffer.data(), n)) {
+      PLOG(ERROR) << "Failed to write " << target;
+      return false;
+    }
+  }
+}
+
+static double PeakRssMiB() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1) {
+    return 0;
+  }
+  return usage.ru_maxrss / 1024.0;
+}
+
+// Runs the edify |function| on the image, and reports the time it takes. Returns false if it
+// fails.
+static bool RunBlockImageFunction(const std::string& function, const std::string& image,
+                                  const std::string& partition, const std::string& new_data,
+                                  UpdaterInfo* updater_info) {
+  std::string script = android::base::StringPrintf(
+      R"(%s("%s", package_extract_file("%s.transfer.list"), "%s", "%s.patch.dat"))",
+      function.c_str(), image.c_str(), partition.c_str(), new_data.c_str(), partition.c_str());
+  std::unique_ptr<Expr> root;
+  int error_count = 0;
+  if (parse_string(script.c_str(), &root, &error_count) != 0 || error_count > 0) {
+    LOG(ERROR) << "Failed to parse " << script;
+    return false;
+  }
+
+  State state(script, updater_info);
+  ota_io_init(updater_info->package_zip, false);
+
+  auto start = std::chrono::steady_clock::now();
+  std::string result;
+  bool status = Evaluate(&state, root, &result);
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+
+  if (!status || result.empty()) {
+    LOG(ERROR) << function << " failed: " << state.errmsg << " (cause " << state.cause_code << ")";
+    return false;
+  }
+  printf("%s: %.3f s\n", function.c_str(), duration.count());
+  return true;
+}
+
+static void Usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [--partition=<name>] [--work_dir=<dir>] [--verify] [--keep] "
+          "<ota_package.zip> <source_image>\n",
+          name);
+}
+
+int update_simulator(int argc, const char** argv) {
+  std::string partition = "system";
+  std::string work_dir;
+  bool verify = false;
+  bool keep = false;
+
+  constexpr struct option OPTIONS[] = {
+    { "partition", required_argument, nullptr, 0 },
+    { "work_dir", required_argument, nullptr, 0 },
+    { "verify", no_argument, nullptr, 0 },
+    { "keep", no_argument, nullptr, 0 },
+    { nullptr, 0, nullptr, 0 },
+  };
+  int arg;
+  int option_index;
+  optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
+  while ((arg = getopt_long(argc, const_cast<char**>(argv), "", OPTIONS, &option_index)) != -1) {
+    if (arg != 0) {
+      Usage(argv[0]);
+      return 1;
+    }
+    std::string option = OPTIONS[option_index].name;
+    if (option == "partition") {
+      partition = optarg;
+    } else if (option == "work_dir") {
+      work_dir = optarg;
+    } else if (option == "verify") {
+      verify = true;
+    } else if (option == "keep") {
+      keep = true;
+    }
+  }
+  if (argc - optind != 2) {
+    Usage(argv[0]);
+    return 1;
+  }
+  std::string package_path = argv[optind];
+  std::string source_image = argv[optind + 1];
+
+  bool remove_work_dir = false;
+  if (work_dir.empty()) {
+    char temp_dir[] = "/tmp/update_simulator-XXXXXX";
+    if (mkdtemp(temp_dir) == nullptr) {
+      PLOG(ERROR) << "Failed to create the work directory";
+      return 1;
+    }
+    work_dir = temp_dir;
+    remove_work_dir = !keep;
+  }
+
+  // Keep everything that the updater writes out of /cache.
+  CacheLocation::location().set_cache_temp_source(work_dir + "/saved.file");
+  CacheLocation::location().set_last_command_file(work_dir + "/last_command");
+  CacheLocation::location().set_stash_directory_base(work_dir + "/stash");
+  CacheLocation::location().set_profile_directory(work_dir);
+  if (mkdir((work_dir + "/stash").c_str(), 0700) == -1 && errno != EEXIST) {
+    PLOG(ERROR) << "Failed to create the stash directory";
+    return 1;
+  }
+
+  std::string image = work_dir + "/" + partition + ".img";
+  if (!CopyImage(source_image, image)) {
+    return 1;
+  }
+
+  MemMapping map;
+  if (!map.MapFile(package_path)) {
+    LOG(ERROR) << "Failed to map " << package_path;
+    return 1;
+  }
+  ZipArchiveHandle za;
+  int open_err = OpenArchiveFromMemory(map.addr, map.length, package_path.c_str(), &za);
+  if (open_err != 0) {
+    LOG(ERROR) << "Failed to open " << package_path << ": " << ErrorCodeString(open_err);
+    CloseArchive(za);
+    return 1;
+  }
+
+  // Pick the new data in any of the formats that block_image_update() understands.
+  std::string new_data = partition + ".new.dat";
+  for (const char* suffix : { ".frames", ".br", ".zst", ".lz4" }) {
+    if (HasEntry(za, partition + ".new.dat" + suffix)) {
+      new_data = partition + ".new.dat" + suffix;
+      break;
+    }
+  }
+  if (!HasEntry(za, partition + ".transfer.list") || !HasEntry(za, new_data) ||
+      !HasEntry(za, partition + ".patch.dat")) {
+    LOG(ERROR) << package_path << " doesn't have a block image update for " << partition;
+    CloseArchive(za);
+    return 1;
+  }
+
+  RegisterBuiltins();
+  RegisterBlockImageFunctions();
+  RegisterFunction("package_extract_file", PackageExtractFileFn);
+
+  // The updater reports the number of bytes written and stashed on the command pipe.
+  FILE* cmd_pipe = tmpfile();
+  if (cmd_pipe == nullptr) {
+    PLOG(ERROR) << "Failed to create the command pipe";
+    CloseArchive(za);
+    return 1;
+  }
+
+  UpdaterInfo updater_info;
+  updater_info.cmd_pipe = cmd_pipe;
+  updater_info.package_zip = za;
+  updater_info.version = 3;
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  bool success = true;
+  if (verify) {
+    success = RunBlockImageFunction("block_image_verify", image, partition, new_data,
+                                    &updater_info);
+  }
+  auto start = std::chrono::steady_clock::now();
+  if (success) {
+    success = RunBlockImageFunction("block_image_update", image, partition, new_data,
+                                    &updater_info);
+  }
+  std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+  CloseArchive(za);
+
+  if (success) {
+    std::string pipe_content;
+    fflush(cmd_pipe);
+    rewind(cmd_pipe);
+    android::base::ReadFdToString(fileno(cmd_pipe), &pipe_content);
+    double written_mib = ReadPipeLog(pipe_content, "bytes_written_" + partition + ".img") /
+                         (1024.0 * 1024.0);
+    double stashed_mib = ReadPipeLog(pipe_content, "bytes_stashed_" + partition + ".img") /
+                         (1024.0 * 1024.0);
+    printf("written: %.1f MiB\n", written_mib);
+    printf("stashed: %.1f MiB\n", stashed_mib);
+    printf("throughput: %.1f MiB/s\n", written_mib / duration.count());
+    printf("peak_rss: %.1f MiB\n", PeakRssMiB());
+
+    std::vector<std::pair<std::string, double>> phases;
+    if (ReadProfile(work_dir + "/block_image_update_profile_" + partition + ".img.csv",
+                    &phases)) {
+      for (const auto& phase : phases) {
+        printf("phase_%s: %.3f s (%.1f%%)\n", phase.first.c_str(), phase.second / 1000.0,
+               phase.second / 10.0 / duration.count());
+      }
+    }
+  }
+  fclose(cmd_pipe);
+
+  // A successful update has removed its stashes and the last_command_file already. Keep the work
+  // directory after a failure, for a look at what's left.
+  if (success && remove_work_dir) {
+    unlink(android::base::StringPrintf("%s/block_image_update_profile_%s.img.csv",
+                                       work_dir.c_str(), partition.c_str())
+               .c_str());
+    unlink(image.c_str());
+    rmdir((work_dir + "/stash").c_str());
+    if (rmdir(work_dir.c_str()) == -1) {
+      PLOG(WARNING) << "Failed to remove " << work_dir;
+    }
+  } else {
+    printf("work_dir: %s\n", work_dir.c_str());
+  }
+  return success ? 0 : 1;
+}